@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+
+namespace Tree
+{
+
+// A Red_black_tree can keep, in every node, an aggregate of all keys of its
+// subtree and answer range_aggregate(a, b) in O(log n). The Aggregate
+// parameter of the tree describes it:
+//   value_type                - type of the aggregate (void = no aggregate)
+//   identity()                - aggregate of no keys
+//   combine(lhs, rhs)         - lhs covers keys before rhs; must be associative
+//   lift(key)                 - aggregate of one key
+// The Monoid parameters below provide value_type, identity() and combine();
+// Key_aggregate lifts the key itself, Rb_map lifts the mapped value.
+
+struct No_aggregate
+{
+    using value_type = void;
+};
+
+template <typename T>
+struct Sum_monoid
+{
+    using value_type = T;
+
+    static value_type identity() { return T{}; }
+    static value_type combine(const value_type &lhs, const value_type &rhs) { return lhs + rhs; }
+};
+
+template <typename T>
+struct Min_monoid
+{
+    using value_type = T;
+
+    static value_type identity() { return std::numeric_limits<T>::max(); }
+    static value_type combine(const value_type &lhs, const value_type &rhs) { return std::min(lhs, rhs); }
+};
+
+template <typename T>
+struct Max_monoid
+{
+    using value_type = T;
+
+    static value_type identity() { return std::numeric_limits<T>::lowest(); }
+    static value_type combine(const value_type &lhs, const value_type &rhs) { return std::max(lhs, rhs); }
+};
+
+// aggregate of the keys themselves, e.g. Key_aggregate<Sum_monoid<int64_t>>
+template <typename Monoid>
+struct Key_aggregate : Monoid
+{
+    template <typename KeyT>
+    static typename Monoid::value_type lift(const KeyT &key)
+    {
+        return typename Monoid::value_type(key);
+    }
+};
+
+} // namespace Tree
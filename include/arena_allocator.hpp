@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace Tree
+{
+
+namespace detail
+{
+
+// Hands out small blocks from big contiguous chunks. Blocks are grouped by
+// size class, freed blocks go to a per-class free list, and everything can be
+// released at once in O(chunks).
+class Arena_resource
+{
+    struct Chunk
+    {
+        Chunk *next_;
+    };
+
+    struct Free_block
+    {
+        Free_block *next_;
+    };
+
+    static constexpr std::size_t kGranule        = alignof(std::max_align_t);
+    static constexpr std::size_t kMaxBlock       = 256;
+    static constexpr std::size_t kClasses        = kMaxBlock / kGranule;
+    static constexpr std::size_t kChunkHeader    = (sizeof(Chunk) + kGranule - 1) / kGranule * kGranule;
+    static constexpr std::size_t kFirstChunkSize = 16 * 1024;
+    static constexpr std::size_t kMaxChunkSize   = 4 * 1024 * 1024;
+
+    Chunk      *chunks_          = nullptr;
+    char       *cur_             = nullptr;
+    char       *end_             = nullptr;
+    std::size_t next_chunk_size_ = kFirstChunkSize;
+
+    Free_block *free_[kClasses] = {};
+
+    static std::size_t class_of_(std::size_t bytes) noexcept
+    {
+        return (bytes + kGranule - 1) / kGranule - 1;
+    }
+
+    void grow_(std::size_t block_size)
+    {
+        std::size_t chunk_size = next_chunk_size_;
+        while (chunk_size < kChunkHeader + block_size)
+            chunk_size *= 2;
+
+        Chunk *chunk = static_cast<Chunk *>(::operator new(chunk_size));
+        chunk->next_ = chunks_;
+        chunks_      = chunk;
+
+        cur_ = reinterpret_cast<char *>(chunk) + kChunkHeader;
+        end_ = reinterpret_cast<char *>(chunk) + chunk_size;
+
+        if (next_chunk_size_ < kMaxChunkSize)
+            next_chunk_size_ *= 2;
+    }
+
+public:
+    Arena_resource() = default;
+
+    Arena_resource(const Arena_resource &)            = delete;
+    Arena_resource &operator=(const Arena_resource &) = delete;
+
+    ~Arena_resource() { release(); }
+
+    static constexpr bool fits(std::size_t bytes, std::size_t align) noexcept
+    {
+        return bytes <= kMaxBlock && align <= kGranule;
+    }
+
+    void *allocate(std::size_t bytes)
+    {
+        const std::size_t cls = class_of_(bytes);
+
+        if (Free_block *block = free_[cls])
+        {
+            free_[cls] = block->next_;
+            return block;
+        }
+
+        const std::size_t block_size = (cls + 1) * kGranule;
+        if (static_cast<std::size_t>(end_ - cur_) < block_size)
+            grow_(block_size);
+
+        void *block = cur_;
+        cur_ += block_size;
+
+        return block;
+    }
+
+    void deallocate(void *ptr, std::size_t bytes) noexcept
+    {
+        const std::size_t cls = class_of_(bytes);
+
+        Free_block *block = static_cast<Free_block *>(ptr);
+        block->next_ = free_[cls];
+        free_[cls]   = block;
+    }
+
+    // drops every chunk at once, all outstanding blocks become invalid
+    void release() noexcept
+    {
+        while (chunks_)
+        {
+            Chunk *next = chunks_->next_;
+            ::operator delete(chunks_);
+            chunks_ = next;
+        }
+
+        cur_             = nullptr;
+        end_             = nullptr;
+        next_chunk_size_ = kFirstChunkSize;
+
+        for (auto &head : free_)
+            head = nullptr;
+    }
+};
+
+} // namespace detail
+
+// Std-compatible allocator on top of Arena_resource. Copies (and rebinds)
+// share one arena; a copy-constructed container gets an arena of its own.
+template <typename T>
+class Arena_allocator
+{
+    template <typename U>
+    friend class Arena_allocator;
+
+    std::shared_ptr<detail::Arena_resource> arena_;
+
+public:
+    using value_type = T;
+
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap            = std::true_type;
+    using is_always_equal                        = std::false_type;
+
+    Arena_allocator()
+        : arena_(std::make_shared<detail::Arena_resource>()) {}
+
+    // no move operations on purpose: a moved-from allocator keeps its arena
+    Arena_allocator(const Arena_allocator &) noexcept            = default;
+    Arena_allocator &operator=(const Arena_allocator &) noexcept = default;
+
+    template <typename U>
+    Arena_allocator(const Arena_allocator<U> &other) noexcept
+        : arena_(other.arena_) {}
+
+    Arena_allocator select_on_container_copy_construction() const
+    {
+        return Arena_allocator();
+    }
+
+    T *allocate(std::size_t n)
+    {
+        if (n == 1 && detail::Arena_resource::fits(sizeof(T), alignof(T)))
+            return static_cast<T *>(arena_->allocate(sizeof(T)));
+
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        if (n == 1 && detail::Arena_resource::fits(sizeof(T), alignof(T)))
+            arena_->deallocate(ptr, sizeof(T));
+        else
+            std::allocator<T>().deallocate(ptr, n);
+    }
+
+    // frees the whole arena if nobody else shares it; the caller must not
+    // touch any block obtained from it afterwards
+    bool try_release() noexcept
+    {
+        if (arena_.use_count() != 1)
+            return false;
+
+        arena_->release();
+        return true;
+    }
+
+    template <typename U>
+    bool operator==(const Arena_allocator<U> &other) const noexcept { return arena_ == other.arena_; }
+
+    template <typename U>
+    bool operator!=(const Arena_allocator<U> &other) const noexcept { return arena_ != other.arena_; }
+};
+
+} // namespace Tree
@@ -0,0 +1,382 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#define DRIVER_HAS_POSIX_READ 1
+#endif
+
+#if __has_include(<sys/mman.h>) && __has_include(<sys/stat.h>) && __has_include(<fcntl.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define DRIVER_HAS_MMAP 1
+#endif
+
+namespace Driver
+{
+
+// Command readers: bool next(mode, a, b) returns the next command
+// (k/d/m/n X or q A B) or false at the end of input / on a malformed one.
+
+// std::istream >> per token
+class Stream_reader
+{
+    std::istream &in_;
+
+public:
+    explicit Stream_reader(std::istream &in) : in_(in) {}
+
+    bool next(char &mode, int64_t &a, int64_t &b)
+    {
+        if (!(in_ >> mode))
+            return false;
+
+        if (mode == 'k' || mode == 'd' || mode == 'm' || mode == 'n')
+        {
+            if (!(in_ >> a))
+            {
+                std::cerr << "ERROR: expected number after '" << mode << "'\n";
+                return false;
+            }
+
+            return true;
+        }
+
+        if (mode == 'q')
+        {
+            if (!(in_ >> a >> b))
+            {
+                std::cerr << "ERROR: expected two numbers after 'q'\n";
+                return false;
+            }
+
+            return true;
+        }
+
+        std::cerr << "ERROR: unknown mode '" << mode << "'\n";
+        return false;
+    }
+};
+
+// Reads the descriptor in 1 MiB blocks with read(2) and parses tokens in place:
+// no stream state, locale or per-token virtual calls. Accepts the same
+// input as Stream_reader.
+class Fd_reader
+{
+    static constexpr std::size_t kBufSize = std::size_t{1} << 20;
+
+    int fd_;
+
+    std::unique_ptr<char[]> buf_;
+    const char *cur_ = nullptr;
+    const char *end_ = nullptr;
+
+    bool        eof_   = false;
+    std::size_t bytes_ = 0;
+
+    // false when the input is over
+    bool fill_()
+    {
+        if (cur_ != end_)
+            return true;
+
+        if (eof_)
+            return false;
+
+#ifdef DRIVER_HAS_POSIX_READ
+        ssize_t got = 0;
+        do
+            got = ::read(fd_, buf_.get(), kBufSize);
+        while (got < 0 && errno == EINTR);
+#else
+        const std::size_t got = std::fread(buf_.get(), 1, kBufSize, stdin);
+#endif
+
+        if (got <= 0)
+        {
+            eof_ = true;
+            return false;
+        }
+
+        cur_    = buf_.get();
+        end_    = cur_ + got;
+        bytes_ += static_cast<std::size_t>(got);
+
+        return true;
+    }
+
+    static bool is_space_(char c) noexcept
+    {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    static bool is_digit_(char c) noexcept
+    {
+        return static_cast<unsigned char>(c - '0') < 10;
+    }
+
+    bool skip_spaces_()
+    {
+        while (fill_())
+        {
+            if (!is_space_(*cur_))
+                return true;
+            ++cur_;
+        }
+
+        return false;
+    }
+
+    // [+-]digits into int64_t, false on a missing number or overflow
+    bool parse_int_(int64_t &value)
+    {
+        if (!skip_spaces_())
+            return false;
+
+        const bool negative = *cur_ == '-';
+        if (*cur_ == '-' || *cur_ == '+')
+            ++cur_;
+
+        const uint64_t limit = negative ? uint64_t{1} << 63 : (uint64_t{1} << 63) - 1;
+
+        uint64_t magnitude = 0;
+        bool     any_digit = false;
+
+        while (fill_() && is_digit_(*cur_))
+        {
+            const unsigned digit = static_cast<unsigned>(*cur_++ - '0');
+
+            if (magnitude > (limit - digit) / 10)
+                return false;
+
+            magnitude = magnitude * 10 + digit;
+            any_digit = true;
+        }
+
+        if (!any_digit)
+            return false;
+
+        value = negative ? static_cast<int64_t>(0 - magnitude) : static_cast<int64_t>(magnitude);
+        return true;
+    }
+
+public:
+    explicit Fd_reader(int fd = 0)
+        : fd_(fd), buf_(new char[kBufSize]) {}
+
+    bool next(char &mode, int64_t &a, int64_t &b)
+    {
+        if (!skip_spaces_())
+            return false;
+
+        mode = *cur_++;
+
+        if (mode == 'k' || mode == 'd' || mode == 'm' || mode == 'n')
+        {
+            if (!parse_int_(a))
+            {
+                std::cerr << "ERROR: expected number after '" << mode << "'\n";
+                return false;
+            }
+
+            return true;
+        }
+
+        if (mode == 'q')
+        {
+            if (!parse_int_(a) || !parse_int_(b))
+            {
+                std::cerr << "ERROR: expected two numbers after 'q'\n";
+                return false;
+            }
+
+            return true;
+        }
+
+        std::cerr << "ERROR: unknown mode '" << mode << "'\n";
+        return false;
+    }
+
+    // bytes taken from the descriptor so far
+    std::size_t bytes_read() const noexcept { return bytes_; }
+};
+
+// Replays a binary command log (scripts/log_convert.py writes it):
+//   8-byte header "RBTLOG\0\1", then per command an opcode byte
+//   ('k', 'd', 'm', 'n', 'q') and its operands as zigzag LEB128 varints.
+// The file is memory-mapped (read into memory where mmap is missing),
+// so decoding is a walk over bytes with no tokenizing at all.
+class Binary_reader
+{
+    static constexpr char        kMagic[]   = {'R', 'B', 'T', 'L', 'O', 'G', '\0', '\1'};
+    static constexpr std::size_t kMagicSize = sizeof(kMagic);
+
+    const unsigned char *data_ = nullptr;
+    const unsigned char *cur_  = nullptr;
+    const unsigned char *end_  = nullptr;
+
+    std::size_t size_ = 0;
+    bool        open_ = false;
+
+#ifdef DRIVER_HAS_MMAP
+    void *map_ = nullptr;
+#endif
+    std::vector<unsigned char> copy_; // fallback storage
+
+    bool load_(const std::string &path)
+    {
+#ifdef DRIVER_HAS_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        size_ = static_cast<std::size_t>(st.st_size);
+
+        if (size_)
+        {
+            map_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map_ == MAP_FAILED)
+            {
+                map_ = nullptr;
+                ::close(fd);
+                return false;
+            }
+#ifdef MADV_SEQUENTIAL
+            ::madvise(map_, size_, MADV_SEQUENTIAL);
+#endif
+            data_ = static_cast<const unsigned char *>(map_);
+        }
+
+        ::close(fd);
+        return true;
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return false;
+
+        copy_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        size_ = copy_.size();
+        data_ = copy_.data();
+        return true;
+#endif
+    }
+
+    // zigzag LEB128, false on a truncated or over-long varint
+    bool parse_int_(int64_t &value)
+    {
+        uint64_t raw = 0;
+
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            if (cur_ == end_)
+                return false;
+
+            const unsigned char byte = *cur_++;
+
+            // the 10th byte holds only bit 63
+            if (shift == 63 && byte > 1)
+                return false;
+
+            raw |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+            if (byte < 0x80)
+            {
+                value = static_cast<int64_t>((raw >> 1) ^ (0 - (raw & 1)));
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+public:
+    explicit Binary_reader(const std::string &path)
+    {
+        if (!load_(path))
+        {
+            std::cerr << "ERROR: can't open binary input '" << path << "'\n";
+            return;
+        }
+
+        if (size_ < kMagicSize || std::memcmp(data_, kMagic, kMagicSize) != 0)
+        {
+            std::cerr << "ERROR: '" << path << "' is not a binary command log\n";
+            return;
+        }
+
+        cur_  = data_ + kMagicSize;
+        end_  = data_ + size_;
+        open_ = true;
+    }
+
+    Binary_reader(const Binary_reader &)            = delete;
+    Binary_reader &operator=(const Binary_reader &) = delete;
+
+    ~Binary_reader()
+    {
+#ifdef DRIVER_HAS_MMAP
+        if (map_)
+            ::munmap(map_, size_);
+#endif
+    }
+
+    bool is_open() const noexcept { return open_; }
+
+    bool next(char &mode, int64_t &a, int64_t &b)
+    {
+        if (cur_ == end_)
+            return false;
+
+        mode = static_cast<char>(*cur_++);
+
+        if (mode == 'k' || mode == 'd' || mode == 'm' || mode == 'n')
+        {
+            if (!parse_int_(a))
+            {
+                std::cerr << "ERROR: expected number after '" << mode << "'\n";
+                return false;
+            }
+
+            return true;
+        }
+
+        if (mode == 'q')
+        {
+            if (!parse_int_(a) || !parse_int_(b))
+            {
+                std::cerr << "ERROR: expected two numbers after 'q'\n";
+                return false;
+            }
+
+            return true;
+        }
+
+        std::cerr << "ERROR: unknown opcode " << static_cast<int>(static_cast<unsigned char>(mode))
+                  << " at byte " << (cur_ - data_ - 1) << '\n';
+        return false;
+    }
+
+    // size of the whole log, header included
+    std::size_t bytes_read() const noexcept { return size_; }
+};
+
+} // namespace Driver
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "red_black_tree.hpp"
+
+namespace Tree
+{
+
+namespace detail
+{
+
+// Number of readers inside a read section, split over cache-line sized
+// stripes so that readers on different cores do not fight for one counter.
+class Read_indicator
+{
+    static constexpr std::size_t kStripes    = 32;
+    static constexpr std::size_t kCacheLine  = 64;
+
+    struct alignas(kCacheLine) Stripe
+    {
+        std::atomic<std::size_t> count_{0};
+    };
+
+    Stripe stripes_[kStripes];
+
+    static std::size_t my_stripe_() noexcept
+    {
+        static std::atomic<std::size_t> next_stripe{0};
+        thread_local const std::size_t stripe =
+            next_stripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+
+        return stripe;
+    }
+
+public:
+    std::size_t arrive() noexcept
+    {
+        const std::size_t stripe = my_stripe_();
+        stripes_[stripe].count_.fetch_add(1);
+        return stripe;
+    }
+
+    void depart(std::size_t stripe) noexcept
+    {
+        stripes_[stripe].count_.fetch_sub(1);
+    }
+
+    bool empty() const noexcept
+    {
+        for (const Stripe &s : stripes_)
+            if (s.count_.load())
+                return false;
+
+        return true;
+    }
+};
+
+} // namespace detail
+
+// One writer, many lock-free readers (the left-right scheme, an RCU relative).
+// Two copies of the tree are kept. The writer updates the copy nobody reads,
+// publishes it with one atomic store, waits for a grace period (every reader
+// that could still see the old copy has left) and replays the update there.
+// Readers never block and never retry: a read section is two counter updates
+// around a plain search in a tree that stays frozen while they are inside.
+// Writes cost twice as much as on a bare tree and are serialized by a mutex.
+template <typename KeyT, typename Alloc = std::allocator<KeyT>, typename Layout = Pointer_layout>
+class Concurrent_tree
+{
+public:
+    using tree_type = Red_black_tree<KeyT, Alloc, Layout>;
+
+private:
+    tree_type trees_[2];
+
+    std::atomic<unsigned> read_side_{0}; // readers search trees_[read_side_]
+    std::atomic<unsigned> version_  {0}; // indicator new readers register at
+
+    mutable detail::Read_indicator readers_[2];
+
+    std::mutex writer_;
+
+    // returns once no reader can still be inside the copy that was
+    // published before the last read_side_ flip
+    void wait_for_readers_() noexcept
+    {
+        const unsigned version = version_.load();
+
+        while (!readers_[version ^ 1].empty())
+            std::this_thread::yield();
+
+        version_.store(version ^ 1);
+
+        while (!readers_[version].empty())
+            std::this_thread::yield();
+    }
+
+    class Read_section_
+    {
+        detail::Read_indicator &indicator_;
+        std::size_t             stripe_;
+
+    public:
+        explicit Read_section_(detail::Read_indicator &indicator) noexcept
+            : indicator_(indicator), stripe_(indicator.arrive()) {}
+
+        Read_section_(const Read_section_ &)            = delete;
+        Read_section_ &operator=(const Read_section_ &) = delete;
+
+        ~Read_section_() { indicator_.depart(stripe_); }
+    };
+
+public:
+    Concurrent_tree() = default;
+
+    explicit Concurrent_tree(const Alloc &alloc)
+        : trees_{tree_type(alloc), tree_type(alloc)} {}
+
+    Concurrent_tree(const Concurrent_tree &)            = delete;
+    Concurrent_tree &operator=(const Concurrent_tree &) = delete;
+
+    // f(const tree_type &) runs against a consistent version of the tree;
+    // iterators and references must not leave f
+    template <typename F>
+    decltype(auto) read(F &&f) const
+    {
+        const Read_section_ section(readers_[version_.load()]);
+        return std::forward<F>(f)(std::as_const(trees_[read_side_.load()]));
+    }
+
+    // f(tree_type &) is applied to both copies, so it must do the same thing
+    // both times; readers see either none or all of its changes
+    template <typename F>
+    void write(F &&f)
+    {
+        std::lock_guard<std::mutex> lock(writer_);
+
+        const unsigned side = read_side_.load();
+
+        f(trees_[side ^ 1]);
+
+        read_side_.store(side ^ 1);
+        wait_for_readers_();
+
+        try
+        {
+            f(trees_[side]);
+        }
+        catch (...)
+        {
+            // the copies must not diverge
+            trees_[side] = trees_[side ^ 1];
+            throw;
+        }
+    }
+
+    void insert(const KeyT &key)
+    {
+        write([&key](tree_type &tree) { tree.insert_elem(key); });
+    }
+
+    std::size_t erase(const KeyT &key)
+    {
+        std::size_t removed = 0;
+        write([&key, &removed](tree_type &tree) { removed = tree.erase(key); });
+
+        return removed;
+    }
+
+    uint64_t range_queries(const KeyT &key1, const KeyT &key2) const
+    {
+        return read([&](const tree_type &tree) { return tree.range_queries(key1, key2); });
+    }
+
+    std::size_t rank(const KeyT &key) const
+    {
+        return read([&key](const tree_type &tree) { return tree.rank(key); });
+    }
+
+    // copy of the first key not less than key, nullopt if there is none
+    std::optional<KeyT> lower_bound(const KeyT &key) const
+    {
+        return read([&key](const tree_type &tree) -> std::optional<KeyT>
+        {
+            const auto it = tree.lower_bound(key);
+            if (it == tree.end())
+                return std::nullopt;
+
+            return *it;
+        });
+    }
+
+    bool contains(const KeyT &key) const
+    {
+        return read([&key](const tree_type &tree)
+        {
+            const auto it = tree.lower_bound(key);
+            return it != tree.end() && !(key < *it);
+        });
+    }
+
+    std::size_t size() const
+    {
+        return read([](const tree_type &tree) { return tree.size(); });
+    }
+};
+
+} // namespace Tree
@@ -1,7 +1,16 @@
 #pragma once
 
 #include <cstdint>
+#include <iterator>
 #include <iostream>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "command_reader.hpp"
+#include "thread_pool.hpp"
 
 namespace Driver
 {
@@ -12,66 +21,200 @@ constexpr bool kVerifyWithSet = true;
 constexpr bool kVerifyWithSet = false;
 #endif
 
-static bool read_next(std::istream &in,
-                      char         &mode,
-                      int64_t      &a,
-                      int64_t      &b)
+struct Run_options
 {
-    if (!(in >> mode))
-        return false;
+    // after this many q/m/n commands in a row without k/d, answer q and n
+    // from a frozen snapshot (policy.freeze) until the next update; 0 = off
+    std::size_t freeze_after = 0;
 
-    if (mode == 'k')
-    {
-        if (!(in >> a))
-        {
-            std::cerr << "ERROR: expected key after 'k'\n";
-            return false;
-        }
+    // parse stdin with Fd_reader instead of std::cin
+    bool fast_input = false;
 
-        return true;
-    }
+    // replay this binary command log (Binary_reader) instead of stdin
+    std::string binary_input;
+
+    // > 1: runs of consecutive q commands are answered together by
+    // policy.query_batch, split over this many threads; answers keep input order
+    unsigned threads = 1;
+};
+
+// q A B of a query run
+using Query = std::pair<int64_t, int64_t>;
 
-    if (mode == 'q')
+// longest query run answered at once, bounds the memory of a batch
+constexpr std::size_t kMaxQueryBatch = std::size_t{1} << 16;
+
+template <typename TreeT, typename = void>
+struct Has_insert_hint : std::false_type {};
+
+template <typename TreeT>
+struct Has_insert_hint<TreeT, std::void_t<decltype(std::declval<TreeT &>().insert_hint(
+                                  std::declval<TreeT &>().end(), std::declval<int64_t>()))>> : std::true_type {};
+
+// 'k' of the program and the benchmark: in append-mostly logs a key past the
+// maximum is linked via the end() hint; a set without insert_hint (the skip
+// list places any key with one search) takes every key through insert_elem
+template <typename TreeT>
+void insert_key(TreeT &tree, int64_t key)
+{
+    if constexpr (Has_insert_hint<TreeT>::value)
     {
-        if (!(in >> a >> b))
+        if (!tree.empty() && *std::prev(tree.end()) < key)
         {
-            std::cerr << "ERROR: expected two numbers after 'q'\n";
-            return false;
+            tree.insert_hint(tree.end(), key);
+            return;
         }
-
-        return true;
     }
 
-    std::cerr << "ERROR: unknown mode '" << mode << "'\n";
-    return false;
+    tree.insert_elem(key);
 }
 
-
-template <typename TreeT, typename PolicyT>
-int run(TreeT &tree, PolicyT &policy)
+// feeds every command of reader to policy
+template <typename ReaderT, typename TreeT, typename PolicyT>
+int run_commands(ReaderT &reader, TreeT &tree, PolicyT &policy, const Run_options &opts = {})
 {
-    std::ios::sync_with_stdio(false);
-    std::cin.tie(nullptr);
-
     char    mode = 0;
     int64_t a    = 0;
     int64_t b    = 0;
 
-    while (read_next(std::cin, mode, a, b))
+    // leading run of strictly increasing 'k' keys is loaded in O(n) at once
+    std::vector<int64_t> sorted_run;
+    bool collecting = tree.empty();
+
+    std::optional<decltype(policy.freeze(tree))> frozen;
+    std::size_t reads_in_row = 0;
+
+    Thread_pool pool(opts.threads);
+
+    std::vector<Query>   batch;
+    std::vector<int64_t> answers;
+
+    // the tree does not change inside a query run, so the whole batch can
+    // be answered from whatever set is current when it ends
+    auto flush_batch = [&]
     {
-        if (mode == 'k')
+        if (batch.empty())
+            return;
+
+        answers.resize(batch.size());
+
+        if (frozen)
+            policy.query_batch(*frozen, batch, answers, pool);
+        else
+            policy.query_batch(tree, batch, answers, pool);
+
+        for (std::size_t i = 0; i < batch.size(); ++i)
+            policy.handle_answer('q', batch[i].first, batch[i].second, answers[i]);
+
+        batch.clear();
+    };
+
+    while (reader.next(mode, a, b))
+    {
+        if (collecting)
+        {
+            if (mode == 'k' && (sorted_run.empty() || sorted_run.back() < a))
+            {
+                sorted_run.push_back(a);
+                continue;
+            }
+
+            if (!sorted_run.empty())
+                policy.insert_sorted(tree, sorted_run);
+
+            collecting = false;
+            sorted_run = {};
+        }
+
+        if (mode != 'q')
+            flush_batch();
+
+        if (mode == 'k' || mode == 'd')
         {
-            policy.insert(tree, a);
-            continue;
+            frozen.reset();
+            reads_in_row = 0;
         }
+        else if (opts.freeze_after && !frozen && ++reads_in_row >= opts.freeze_after)
+            frozen.emplace(policy.freeze(tree));
 
-        const auto ans = policy.query(tree, a, b);
-        policy.handle_answer(a, b, ans);
+        switch (mode)
+        {
+            case 'k':
+                policy.insert(tree, a);
+                break;
+
+            case 'd':
+                policy.erase(tree, a);
+                break;
+
+            case 'q':
+            {
+                // a single thread gains from a run only if the set batches
+                // queries at all, and then only on a tree too big for the
+                // cache (see Red_black_tree::range_queries_batch)
+                bool one_by_one = pool.size() == 1;
+                if constexpr (TreeT::kBatchesQueries)
+                    one_by_one = one_by_one && (frozen || tree.size() < TreeT::kBatchMinKeys);
+
+                if (one_by_one)
+                {
+                    policy.handle_answer(mode, a, b, frozen ? policy.query(*frozen, a, b)
+                                                            : policy.query(tree,    a, b));
+                    break;
+                }
+
+                batch.emplace_back(a, b);
+
+                if (batch.size() == kMaxQueryBatch)
+                    flush_batch();
+                break;
+            }
+
+            case 'm':
+                policy.handle_answer(mode, a, b, policy.select(tree, a));
+                break;
+
+            case 'n':
+                policy.handle_answer(mode, a, b, frozen ? policy.rank(*frozen, a)
+                                                        : policy.rank(tree,    a));
+                break;
+        }
     }
 
+    flush_batch();
+
+    if (collecting && !sorted_run.empty())
+        policy.insert_sorted(tree, sorted_run);
+
     policy.finalize();
 
     return 0;
 }
 
+// commands from stdin or from opts.binary_input
+template <typename TreeT, typename PolicyT>
+int run(TreeT &tree, PolicyT &policy, const Run_options &opts = {})
+{
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+
+    if (!opts.binary_input.empty())
+    {
+        Binary_reader reader(opts.binary_input);
+        if (!reader.is_open())
+            return 1;
+
+        return run_commands(reader, tree, policy, opts);
+    }
+
+    if (opts.fast_input)
+    {
+        Fd_reader reader(0);
+        return run_commands(reader, tree, policy, opts);
+    }
+
+    Stream_reader reader(std::cin);
+    return run_commands(reader, tree, policy, opts);
+}
+
 } // namespace Driver
\ No newline at end of file
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+namespace Tree
+{
+
+namespace detail
+{
+
+// number of trailing one bits
+inline unsigned trailing_ones(std::size_t x) noexcept
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return ~x ? static_cast<unsigned>(__builtin_ctzll(~static_cast<unsigned long long>(x))) : 64u;
+#else
+    unsigned cnt = 0;
+    for (; x & 1; x >>= 1)
+        ++cnt;
+    return cnt;
+#endif
+}
+
+inline void prefetch(const void *addr) noexcept
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(addr);
+#else
+    (void)addr;
+#endif
+}
+
+} // namespace detail
+
+// Immutable sorted set for read-only traffic (see Red_black_tree::freeze).
+// Keys are stored in Eytzinger order: the implicit binary tree is laid out
+// level by level, node k has children 2k and 2k + 1. A search is a branchless
+// walk down that array that prefetches the cache line four levels ahead, and
+// a range count is a difference of two ranks. Compare is the order of the
+// tree it was frozen from, transparent lookups work as in the tree.
+template <typename KeyT, typename Compare = std::less<KeyT>>
+class Frozen_set
+{
+    // 16 consecutive slots = the descendants of a node four levels below
+    static constexpr std::size_t kPrefetchStride = 16;
+
+    // lookups taking any K exist only for a transparent Compare
+    template <typename C>
+    using Transparent_ = typename C::is_transparent;
+
+    std::vector<KeyT>        keys_;  // 1-based, keys_[0] is padding
+    std::vector<std::size_t> ranks_; // ranks_[k] = in-order index of keys_[k]
+    Compare                  comp_;
+
+    // places sorted keys into the implicit tree rooted at k
+    template <typename It>
+    void fill_(It &it, std::size_t k, std::size_t &next_rank)
+    {
+        if (k >= keys_.size())
+            return;
+
+        fill_(it, 2 * k, next_rank);
+
+        keys_ [k] = *it;
+        ranks_[k] = next_rank++;
+        ++it;
+
+        fill_(it, 2 * k + 1, next_rank);
+    }
+
+    // after the walk k is past a leaf; dropping the trailing right turns
+    // (and the one left turn before them) gives the answer node, 0 = none
+    std::size_t rank_of_(std::size_t k) const noexcept
+    {
+        k >>= detail::trailing_ones(k) + 1;
+        return k ? ranks_[k] : size();
+    }
+
+    template <typename K>
+    std::size_t rank_(const K &key) const
+    {
+        const std::size_t n    = size();
+        const KeyT       *base = keys_.data();
+
+        std::size_t k = 1;
+        while (k <= n)
+        {
+            // the last four levels have nothing below to fetch, and a pointer
+            // past the array is UB even if the prefetch cannot fault
+            if (kPrefetchStride * k <= n)
+                detail::prefetch(base + kPrefetchStride * k);
+            k = 2 * k + comp_(base[k], key);
+        }
+
+        return rank_of_(k);
+    }
+
+    template <typename K>
+    std::size_t count_not_greater_(const K &key) const
+    {
+        const std::size_t n    = size();
+        const KeyT       *base = keys_.data();
+
+        std::size_t k = 1;
+        while (k <= n)
+        {
+            if (kPrefetchStride * k <= n)
+                detail::prefetch(base + kPrefetchStride * k);
+            k = 2 * k + !comp_(key, base[k]);
+        }
+
+        return rank_of_(k);
+    }
+
+    template <typename K>
+    uint64_t range_queries_(const K &key1, const K &key2) const
+    {
+        if (!comp_(key1, key2))
+            return 0;
+
+        return count_not_greater_(key2) - rank_(key1);
+    }
+
+public:
+    Frozen_set() : keys_(1), ranks_(1) {}
+
+    // keys must be strictly increasing
+    template <typename ForwardIt>
+    Frozen_set(ForwardIt first, ForwardIt last, const Compare &comp = Compare())
+        : keys_ (static_cast<std::size_t>(std::distance(first, last)) + 1),
+          ranks_(keys_.size()),
+          comp_ (comp)
+    {
+        std::size_t next_rank = 0;
+        fill_(first, 1, next_rank);
+
+        assert(first == last);
+    }
+
+    std::size_t size () const noexcept { return keys_.size() - 1; }
+    bool        empty() const noexcept { return size() == 0; }
+
+    // number of keys less than key
+    std::size_t rank(const KeyT &key) const { return rank_(key); }
+
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    std::size_t rank(const K &key) const { return rank_(key); }
+
+    // number of keys not greater than key
+    std::size_t count_not_greater(const KeyT &key) const { return count_not_greater_(key); }
+
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    std::size_t count_not_greater(const K &key) const { return count_not_greater_(key); }
+
+    // same contract as Red_black_tree::range_queries
+    uint64_t range_queries(const KeyT &key1, const KeyT &key2) const { return range_queries_(key1, key2); }
+
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    uint64_t range_queries(const K &key1, const K &key2) const { return range_queries_(key1, key2); }
+
+    // same contract as Red_black_tree::range_queries_batch; the walks are
+    // branchless and prefetched already, so the queries are simply taken in turn
+    template <typename ForwardIt, typename OutIt>
+    void range_queries_batch(ForwardIt first, ForwardIt last, OutIt out) const
+    {
+        for (; first != last; ++first, ++out)
+            *out = range_queries(first->first, first->second);
+    }
+};
+
+} // namespace Tree
@@ -15,13 +15,12 @@ namespace Tree
 template <typename KeyT>
 class Print_tree
 {
-    using NodeT = Tree::detail::Node<KeyT>;
-
     // draws a single node (for Graphviz .dot)
+    template <typename NodeT>
     void emit_node_(const NodeT &node, std::ofstream &out, bool is_root) const
     {
         const char* fill = is_root ? "#5A5A5A"
-                                   : (node.color == Color::red ? "#D85C5C" : "#BDBDBD");
+                                   : (node.color() == Color::red ? "#D85C5C" : "#BDBDBD");
         const char* font = is_root ? "white" : "black";
 
         out << node.key_
@@ -37,6 +36,7 @@ class Print_tree
             << " [shape=box, style=filled, fillcolor=\"#BDBDBD\", label=\"NULL\"];\n";
     }
 
+    template <typename NodeT>
     void print_(const NodeT   &node,
                 std::ofstream &out,
                 std::size_t   &nil_counter,
@@ -44,10 +44,10 @@ class Print_tree
     {
         emit_node_(node, out, is_root);
 
-        if (node.left_ && !node.left_is_thread)
+        if (!node.left_is_thread())
         {
-            out << node.key_ << " -> " << node.left_->key_ << ";\n";
-            print_(*node.left_, out, nil_counter, false);
+            out << node.key_ << " -> " << node.left()->key_ << ";\n";
+            print_(*node.left(), out, nil_counter, false);
         }
         else
         {
@@ -56,10 +56,10 @@ class Print_tree
             out << node.key_ << " -> " << nil_id << ";\n";
         }
 
-        if (node.right_ && !node.right_is_thread)
+        if (!node.right_is_thread())
         {
-            out << node.key_ << " -> " << node.right_->key_ << ";\n";
-            print_(*node.right_, out, nil_counter, false);
+            out << node.key_ << " -> " << node.right()->key_ << ";\n";
+            print_(*node.right(), out, nil_counter, false);
         }
         else
         {
@@ -70,7 +70,8 @@ class Print_tree
     }
 
 public:
-    void dump(const Tree::Red_black_tree<KeyT> &rb_tree,
+    template <typename Alloc, typename Layout, typename Compare, typename Aggregate>
+    void dump(const Tree::Red_black_tree<KeyT, Alloc, Layout, Compare, Aggregate> &rb_tree,
               const std::string &dot_path     = "graphviz/file_graph.dot",
               const std::string& /*png_path*/ = "graphviz/tree_graph.png",
               bool /*auto_open*/ = true) const
@@ -100,7 +101,7 @@ public:
                "node  [shape=record, style=filled];\n"
                "edge  [color=black, arrowsize=0.8];\n";
 
-        const NodeT* root = rb_tree.debug_root();
+        const auto* root = rb_tree.debug_root();
         if (!root)
         {
             out << "empty_tree [label=\"EMPTY TREE\", shape=box, style=filled, fillcolor=\"#CCCCCC\"];\n";
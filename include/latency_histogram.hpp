@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace Driver
+{
+
+// HDR-style histogram of latencies in ns. Buckets are log-linear: every
+// power of two is split into kSubBuckets equal steps, so a recorded value
+// is known to within 1/kSubBuckets (~3%) whatever its size, and record()
+// is a count-leading-zeros and an increment. Percentiles report the top of
+// the bucket holding the requested rank, capped by the exact maximum.
+class Latency_histogram
+{
+    static constexpr unsigned      kSubBits    = 5;
+    static constexpr uint64_t      kSubBuckets = uint64_t{1} << kSubBits;
+    static constexpr std::size_t   kBuckets    = (64 - kSubBits + 1) * kSubBuckets;
+
+    std::array<uint64_t, kBuckets> counts_{};
+    uint64_t total_ = 0;
+    uint64_t max_   = 0;
+
+    static unsigned msb_(uint64_t v) noexcept
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63u - static_cast<unsigned>(__builtin_clzll(v));
+#else
+        unsigned msb = 0;
+        while (v >>= 1)
+            ++msb;
+        return msb;
+#endif
+    }
+
+    static std::size_t index_(uint64_t v) noexcept
+    {
+        if (v < kSubBuckets)
+            return static_cast<std::size_t>(v);
+
+        const unsigned shift = msb_(v) - kSubBits;
+        return static_cast<std::size_t>((shift + 1) * kSubBuckets + ((v >> shift) - kSubBuckets));
+    }
+
+    // largest value that lands in bucket i
+    static uint64_t upper_(std::size_t i) noexcept
+    {
+        if (i < kSubBuckets)
+            return i;
+
+        const unsigned shift = static_cast<unsigned>(i / kSubBuckets) - 1;
+        const uint64_t low   = (kSubBuckets + i % kSubBuckets) << shift;
+
+        return low + ((uint64_t{1} << shift) - 1);
+    }
+
+public:
+    void record(uint64_t ns) noexcept
+    {
+        ++counts_[index_(ns)];
+        ++total_;
+        max_ = std::max(max_, ns);
+    }
+
+    uint64_t count() const noexcept { return total_; }
+    uint64_t max  () const noexcept { return max_; }
+
+    // smallest bucket top with at least p (0..1] of the values at or below it
+    uint64_t percentile(double p) const noexcept
+    {
+        if (total_ == 0)
+            return 0;
+
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * static_cast<double>(total_))));
+
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < kBuckets; ++i)
+        {
+            seen += counts_[i];
+            if (seen >= rank)
+                return std::min(upper_(i), max_);
+        }
+
+        return max_;
+    }
+};
+
+} // namespace Driver
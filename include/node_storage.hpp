@@ -0,0 +1,422 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "rb_node.hpp"
+
+namespace Tree
+{
+
+namespace detail
+{
+
+// allocators that can drop all of their memory at once (see Arena_allocator)
+template <typename AllocT, typename = void>
+struct has_try_release : std::false_type {};
+
+template <typename AllocT>
+struct has_try_release<AllocT, std::void_t<decltype(std::declval<AllocT &>().try_release())>>
+    : std::true_type {};
+
+// Owns the nodes and the header of one tree. Interface used by Red_black_tree:
+//   header()               - header node, its address may change only in reserve() and moves
+//   reserve(n, keep)       - make room for n more nodes, returns where keep lives afterwards
+//   owns(addr)             - addr points into memory reserve() may move
+//   create(color, args...) - construct a node, its key from args (room must be reserved)
+//   destroy(node)          - destroy a node created by create()
+//   try_release_all()      - drop every node at once if possible
+template <typename NodeT, typename Alloc, typename Layout>
+class Node_storage;
+
+// one allocation per node, nodes never move
+template <typename NodeT, typename Alloc>
+class Node_storage<NodeT, Alloc, Pointer_layout>
+{
+public:
+    using Node_alloc  = typename std::allocator_traits<Alloc>::template rebind_alloc<NodeT>;
+    using Node_traits = std::allocator_traits<Node_alloc>;
+
+    static constexpr bool kNodesMove = false;
+
+private:
+    static_assert(std::is_same<typename Node_traits::pointer, NodeT *>::value,
+                  "Red_black_tree supports allocators with raw pointers only");
+
+    Node_alloc alloc_;
+    NodeT      header_{};
+
+public:
+    explicit Node_storage(const Alloc &alloc) noexcept
+        : alloc_(alloc) {}
+
+    // the header stays behind: the tree relinks the nodes to its own one
+    Node_storage(Node_storage &&other) noexcept
+        : alloc_(std::move(other.alloc_)) {}
+
+    Node_storage(const Node_storage &)            = delete;
+    Node_storage &operator=(const Node_storage &) = delete;
+
+    Alloc get_allocator() const { return Alloc(alloc_); }
+
+    Alloc copy_allocator() const
+    {
+        return Alloc(Node_traits::select_on_container_copy_construction(alloc_));
+    }
+
+    NodeT       *header()       noexcept { return &header_; }
+    const NodeT *header() const noexcept { return &header_; }
+
+    NodeT *reserve(std::size_t /*count*/, NodeT *keep = nullptr) noexcept { return keep; }
+
+    bool owns(const void * /*addr*/) const noexcept { return false; }
+
+    template <typename... Args>
+    NodeT *create(Color color, Args &&...args)
+    {
+        NodeT *node = Node_traits::allocate(alloc_, 1);
+
+        try
+        {
+            Node_traits::construct(alloc_, node, std::in_place, color, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            Node_traits::deallocate(alloc_, node, 1);
+            throw;
+        }
+
+        return node;
+    }
+
+    void destroy(NodeT *node) noexcept
+    {
+        Node_traits::destroy   (alloc_, node);
+        Node_traits::deallocate(alloc_, node, 1);
+    }
+
+    // arena owned by this tree alone => drop it in O(chunks)
+    bool try_release_all() noexcept
+    {
+        if constexpr (has_try_release<Node_alloc>::value && std::is_trivially_destructible<NodeT>::value)
+            return alloc_.try_release();
+        else
+            return false;
+    }
+
+    // the caller has already destroyed its own nodes
+    void move_assign(Node_storage &other) noexcept
+    {
+        if constexpr (Node_traits::propagate_on_container_move_assignment::value)
+            alloc_ = std::move(other.alloc_);
+    }
+
+    void swap(Node_storage &other) noexcept
+    {
+        using std::swap;
+
+        if constexpr (Node_traits::propagate_on_container_swap::value)
+            swap(alloc_, other.alloc_);
+    }
+};
+
+// All nodes and the header in one array (header at index 0), freed slots are
+// reused through an intrusive free list. Growing moves the array to a bigger
+// buffer, which invalidates every node pointer and iterator of the tree.
+template <typename NodeT, typename Alloc>
+class Node_storage<NodeT, Alloc, Compact_layout>
+{
+public:
+    using Node_alloc  = typename std::allocator_traits<Alloc>::template rebind_alloc<NodeT>;
+    using Node_traits = std::allocator_traits<Node_alloc>;
+
+    static constexpr bool kNodesMove = true;
+
+private:
+    static_assert(std::is_same<typename Node_traits::pointer, NodeT *>::value,
+                  "Red_black_tree supports allocators with raw pointers only");
+
+    struct Free_slot
+    {
+        std::size_t next_; // 0 = end of the list (slot 0 is the header)
+    };
+
+    static_assert(sizeof(Free_slot) <= sizeof(NodeT), "a free slot must fit into a node");
+
+    static constexpr std::size_t kMinCapacity = 16;
+
+    Node_alloc  alloc_;
+    NodeT      *slots_      = nullptr;
+    std::size_t capacity_   = 0;
+    std::size_t used_       = 0; // slots handed out so far, header included
+    std::size_t free_head_  = 0;
+    std::size_t free_count_ = 0;
+
+    NodeT empty_header_{}; // header until the array exists, links only to itself
+
+    Free_slot &free_slot_(std::size_t slot) const noexcept
+    {
+        return *std::launder(reinterpret_cast<Free_slot *>(slots_ + slot));
+    }
+
+    // live[i] == slot i holds a node (header included)
+    std::vector<bool> live_slots_() const
+    {
+        std::vector<bool> live(used_, true);
+        for (std::size_t slot = free_head_; slot != 0; slot = free_slot_(slot).next_)
+            live[slot] = false;
+
+        return live;
+    }
+
+    void relocate_(std::size_t new_capacity)
+    {
+        NodeT *fresh = Node_traits::allocate(alloc_, new_capacity);
+
+        if (!slots_)
+        {
+            try
+            {
+                Node_traits::construct(alloc_, fresh);
+            }
+            catch (...)
+            {
+                Node_traits::deallocate(alloc_, fresh, new_capacity);
+                throw;
+            }
+
+            slots_    = fresh;
+            capacity_ = new_capacity;
+            used_     = 1;
+            return;
+        }
+
+        if constexpr (std::is_trivially_copyable<NodeT>::value)
+            std::memcpy(static_cast<void *>(fresh), static_cast<const void *>(slots_), used_ * sizeof(NodeT));
+        else
+        {
+            std::vector<bool> live;
+            std::size_t       moved = 0;
+
+            try
+            {
+                live = live_slots_();
+
+                for (; moved < used_; ++moved)
+                {
+                    if (!live[moved])
+                    {
+                        ::new (static_cast<void *>(fresh + moved)) Free_slot{free_slot_(moved).next_};
+                        continue;
+                    }
+
+                    Node_traits::construct(alloc_, fresh + moved, std::move_if_noexcept(slots_[moved].key_));
+                    fresh[moved].copy_links_from(slots_[moved]);
+                }
+            }
+            catch (...)
+            {
+                for (std::size_t slot = 0; slot < moved; ++slot)
+                    if (live[slot])
+                        Node_traits::destroy(alloc_, fresh + slot);
+
+                Node_traits::deallocate(alloc_, fresh, new_capacity);
+                throw;
+            }
+
+            for (std::size_t slot = 0; slot < used_; ++slot)
+                if (live[slot])
+                    Node_traits::destroy(alloc_, slots_ + slot);
+        }
+
+        Node_traits::deallocate(alloc_, slots_, capacity_);
+
+        slots_    = fresh;
+        capacity_ = new_capacity;
+    }
+
+    void steal_(Node_storage &other) noexcept
+    {
+        slots_      = std::exchange(other.slots_,      nullptr);
+        capacity_   = std::exchange(other.capacity_,   0);
+        used_       = std::exchange(other.used_,       0);
+        free_head_  = std::exchange(other.free_head_,  0);
+        free_count_ = std::exchange(other.free_count_, 0);
+    }
+
+    // only the header and free slots may be left at this point
+    void deallocate_() noexcept
+    {
+        if (!slots_)
+            return;
+
+        Node_traits::destroy   (alloc_, slots_);
+        Node_traits::deallocate(alloc_, slots_, capacity_);
+
+        slots_      = nullptr;
+        capacity_   = 0;
+        used_       = 0;
+        free_head_  = 0;
+        free_count_ = 0;
+    }
+
+public:
+    explicit Node_storage(const Alloc &alloc) noexcept
+        : alloc_(alloc) {}
+
+    // the array (header included) changes hands, nothing to relink
+    Node_storage(Node_storage &&other) noexcept
+        : alloc_(std::move(other.alloc_))
+    {
+        steal_(other);
+    }
+
+    Node_storage(const Node_storage &)            = delete;
+    Node_storage &operator=(const Node_storage &) = delete;
+
+    ~Node_storage() { deallocate_(); }
+
+    Alloc get_allocator() const { return Alloc(alloc_); }
+
+    Alloc copy_allocator() const
+    {
+        return Alloc(Node_traits::select_on_container_copy_construction(alloc_));
+    }
+
+    NodeT       *header()       noexcept { return slots_ ? slots_ : &empty_header_; }
+    const NodeT *header() const noexcept { return slots_ ? slots_ : &empty_header_; }
+
+    NodeT *reserve(std::size_t count, NodeT *keep = nullptr)
+    {
+        if (count == 0 || (slots_ && capacity_ - used_ + free_count_ >= count))
+            return keep;
+
+        const std::size_t needed = (slots_ ? used_ - free_count_ : 1) + count;
+        if (needed > NodeT::kMaxNodes)
+            throw std::length_error("Red_black_tree: too many nodes for Compact_layout");
+
+        std::size_t new_capacity = std::max({needed, 2 * capacity_, kMinCapacity});
+        if (new_capacity > NodeT::kMaxNodes)
+            new_capacity = NodeT::kMaxNodes;
+
+        const std::ptrdiff_t keep_slot = !keep || keep == &empty_header_ ? 0 : keep - slots_;
+
+        relocate_(new_capacity);
+
+        return keep ? slots_ + keep_slot : nullptr;
+    }
+
+    bool owns(const void *addr) const noexcept
+    {
+        std::less<const void *> before;
+        return slots_ && !before(addr, slots_) && before(addr, slots_ + capacity_);
+    }
+
+    template <typename... Args>
+    NodeT *create(Color color, Args &&...args)
+    {
+        assert((free_count_ || used_ < capacity_) && "reserve() before create()");
+
+        if (!free_count_)
+        {
+            Node_traits::construct(alloc_, slots_ + used_, std::in_place, color, std::forward<Args>(args)...);
+            return slots_ + used_++;
+        }
+
+        const std::size_t slot = free_head_;
+        const std::size_t next = free_slot_(slot).next_;
+
+        try
+        {
+            Node_traits::construct(alloc_, slots_ + slot, std::in_place, color, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            ::new (static_cast<void *>(slots_ + slot)) Free_slot{next};
+            throw;
+        }
+
+        free_head_ = next;
+        --free_count_;
+
+        return slots_ + slot;
+    }
+
+    void destroy(NodeT *node) noexcept
+    {
+        const std::size_t slot = static_cast<std::size_t>(node - slots_);
+
+        Node_traits::destroy(alloc_, node);
+        ::new (static_cast<void *>(node)) Free_slot{free_head_};
+
+        free_head_ = slot;
+        ++free_count_;
+    }
+
+    // keeps the array and the header, forgets every node
+    bool try_release_all() noexcept
+    {
+        if (!slots_)
+            return true;
+
+        if constexpr (!std::is_trivially_destructible<NodeT>::value)
+        {
+            try
+            {
+                const std::vector<bool> live = live_slots_();
+
+                for (std::size_t slot = 1; slot < used_; ++slot)
+                    if (live[slot])
+                        Node_traits::destroy(alloc_, slots_ + slot);
+            }
+            catch (...)
+            {
+                return false;
+            }
+        }
+
+        used_       = 1;
+        free_head_  = 0;
+        free_count_ = 0;
+
+        return true;
+    }
+
+    // the caller has already destroyed its own nodes
+    void move_assign(Node_storage &other) noexcept
+    {
+        deallocate_();
+
+        if constexpr (Node_traits::propagate_on_container_move_assignment::value)
+            alloc_ = std::move(other.alloc_);
+
+        steal_(other);
+    }
+
+    void swap(Node_storage &other) noexcept
+    {
+        using std::swap;
+
+        swap(slots_,      other.slots_);
+        swap(capacity_,   other.capacity_);
+        swap(used_,       other.used_);
+        swap(free_head_,  other.free_head_);
+        swap(free_count_, other.free_count_);
+
+        if constexpr (Node_traits::propagate_on_container_swap::value)
+            swap(alloc_, other.alloc_);
+    }
+};
+
+} // namespace detail
+
+} // namespace Tree
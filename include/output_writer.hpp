@@ -0,0 +1,70 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
+namespace Driver
+{
+
+// Formats integers with std::to_chars into a 1 MiB buffer and hands it to
+// the stream in whole blocks, instead of one formatted insertion per answer.
+class Output_writer
+{
+    static constexpr std::size_t kBufSize   = std::size_t{1} << 20;
+    static constexpr std::size_t kMaxNumber = 24; // "-9223372036854775808" fits
+
+    std::ostream &out_;
+
+    std::unique_ptr<char[]> buf_;
+    std::size_t             len_ = 0;
+
+    void reserve_(std::size_t bytes)
+    {
+        if (kBufSize - len_ < bytes)
+            flush();
+    }
+
+public:
+    explicit Output_writer(std::ostream &out)
+        : out_(out), buf_(new char[kBufSize]) {}
+
+    Output_writer(const Output_writer &)            = delete;
+    Output_writer &operator=(const Output_writer &) = delete;
+
+    ~Output_writer()
+    {
+        try
+        {
+            flush();
+        }
+        catch (...) {}
+    }
+
+    void write(int64_t value)
+    {
+        reserve_(kMaxNumber);
+
+        char *first = buf_.get() + len_;
+        len_ += static_cast<std::size_t>(std::to_chars(first, first + kMaxNumber, value).ptr - first);
+    }
+
+    void put(char c)
+    {
+        reserve_(1);
+        buf_[len_++] = c;
+    }
+
+    void flush()
+    {
+        if (len_)
+            out_.write(buf_.get(), static_cast<std::streamsize>(len_));
+
+        len_ = 0;
+        out_.flush();
+    }
+};
+
+} // namespace Driver
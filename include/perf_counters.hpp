@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define DRIVER_HAS_PERF_EVENTS 1
+#endif
+
+namespace Driver
+{
+
+// Hardware counters of the calling thread, user space only, through
+// perf_event_open(2). All events form one group, so start()/stop() are one
+// ioctl each and the counters always cover the same instructions. An event
+// the machine or the kernel refuses (no PMU in a VM, perf_event_paranoid,
+// seccomp) is left out and the reason kept in error(); with none open the
+// object is inert and start()/stop() cost nothing.
+class Perf_counters
+{
+public:
+    enum Event { kCycles, kInstructions, kL1dMisses, kLlcMisses, kBranchMisses, kEvents };
+
+    static constexpr const char *kNames[kEvents] =
+        {"cycles", "instructions", "L1d misses", "LLC misses", "branch misses"};
+
+private:
+    int         fds_[kEvents]  = {-1, -1, -1, -1, -1};
+    int         slot_[kEvents] = {-1, -1, -1, -1, -1}; // place in the group read
+    int         leader_        = -1;
+    int         opened_        = 0;
+    std::size_t runs_          = 0;
+    std::string error_;
+
+#ifdef DRIVER_HAS_PERF_EVENTS
+    static perf_event_attr attr_(Event event) noexcept
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+
+        attr.size           = sizeof(attr);
+        attr.disabled       = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        attr.read_format    = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        auto cache = [](uint64_t id, uint64_t result)
+        {
+            return id | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+        };
+
+        switch (event)
+        {
+            case kCycles:
+                attr.type   = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case kInstructions:
+                attr.type   = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case kL1dMisses:
+                attr.type   = PERF_TYPE_HW_CACHE;
+                attr.config = cache(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS);
+                break;
+            case kLlcMisses:
+                attr.type   = PERF_TYPE_HW_CACHE;
+                attr.config = cache(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS);
+                break;
+            case kBranchMisses:
+            default:
+                attr.type   = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+        }
+
+        return attr;
+    }
+#endif
+
+public:
+    Perf_counters()
+    {
+#ifdef DRIVER_HAS_PERF_EVENTS
+        for (int e = 0; e < kEvents; ++e)
+        {
+            perf_event_attr attr = attr_(static_cast<Event>(e));
+
+            const long fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0);
+            if (fd < 0)
+            {
+                if (error_.empty())
+                    error_ = std::string(kNames[e]) + ": " + std::strerror(errno);
+                continue;
+            }
+
+            fds_ [e] = static_cast<int>(fd);
+            slot_[e] = opened_++;
+
+            if (leader_ < 0)
+                leader_ = fds_[e];
+        }
+#else
+        error_ = "perf_event_open is not available on this platform";
+#endif
+    }
+
+    ~Perf_counters()
+    {
+#ifdef DRIVER_HAS_PERF_EVENTS
+        for (int fd : fds_)
+            if (fd >= 0)
+                close(fd);
+#endif
+    }
+
+    Perf_counters(const Perf_counters &)            = delete;
+    Perf_counters &operator=(const Perf_counters &) = delete;
+
+    bool available() const noexcept { return opened_ > 0; }
+    bool available(Event event) const noexcept { return fds_[event] >= 0; }
+
+    // why the first missing event could not be opened, empty if none is missing
+    const std::string &error() const noexcept { return error_; }
+
+    void start() noexcept
+    {
+#ifdef DRIVER_HAS_PERF_EVENTS
+        if (leader_ >= 0)
+            ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    void stop() noexcept
+    {
+#ifdef DRIVER_HAS_PERF_EVENTS
+        if (leader_ >= 0)
+        {
+            ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            ++runs_;
+        }
+#endif
+    }
+
+    // start()/stop() pairs so far
+    std::size_t runs() const noexcept { return runs_; }
+
+    // totals over all runs, scaled up if the kernel multiplexed the group;
+    // 0 for a missing event
+    void read(uint64_t (&values)[kEvents]) const noexcept
+    {
+        for (uint64_t &v : values)
+            v = 0;
+
+#ifdef DRIVER_HAS_PERF_EVENTS
+        if (leader_ < 0)
+            return;
+
+        // nr, time_enabled, time_running, one value per event
+        uint64_t buf[3 + kEvents] = {};
+        if (::read(leader_, buf, sizeof(buf)) < 0)
+            return;
+
+        const double scale = buf[2] ? static_cast<double>(buf[1]) / static_cast<double>(buf[2]) : 1.0;
+
+        for (int e = 0; e < kEvents; ++e)
+            if (slot_[e] >= 0)
+                values[e] = static_cast<uint64_t>(static_cast<double>(buf[3 + slot_[e]]) * scale);
+#endif
+    }
+};
+
+} // namespace Driver
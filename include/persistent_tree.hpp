@@ -0,0 +1,466 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "rb_node.hpp"
+
+namespace Tree
+{
+
+namespace detail
+{
+
+// Immutable node of Persistent_tree: once built it is shared by every
+// version that reaches it, so there are no parent links or threads.
+template <typename KeyT>
+class Persistent_node
+{
+public:
+    KeyT        key_;
+    std::size_t size_; // number of keys in the subtree rooted at this node
+
+private:
+    const Persistent_node *left_;
+    const Persistent_node *right_;
+    Color                  color_;
+
+public:
+    Persistent_node(Color color, const Persistent_node *left, const KeyT &key,
+                    const Persistent_node *right)
+        : key_  (key),
+          size_ ((left ? left->size_ : 0) + (right ? right->size_ : 0) + 1),
+          left_ (left),
+          right_(right),
+          color_(color) {}
+
+    Color color() const noexcept { return color_; }
+
+    const Persistent_node *left () const noexcept { return left_;  }
+    const Persistent_node *right() const noexcept { return right_; }
+};
+
+} // namespace detail
+
+// Red-black tree whose every update makes a new version and leaves the old
+// ones intact. An update copies only the nodes on its search path (and the
+// few the rebalancing touches): O(log n) new nodes, the rest is shared, so
+// n versions of an n-key tree take O(n log n) nodes, not O(n^2).
+//
+// Nodes are never freed one by one (any version may still use them); they
+// are carved from blocks of the allocator and released with the tree.
+// Insertion balancing is Okasaki's, deletion is Kahrs'.
+template <typename KeyT, typename Alloc = std::allocator<KeyT>>
+class Persistent_tree
+{
+    using NodeT      = detail::Persistent_node<KeyT>;
+    using Link       = const NodeT *;
+    using NodeAlloc  = typename std::allocator_traits<Alloc>::template rebind_alloc<NodeT>;
+    using NodeTraits = std::allocator_traits<NodeAlloc>;
+
+    static constexpr std::size_t kBlockNodes = 1024;
+
+public:
+    // read-only view of one version; a pointer-sized handle, valid while
+    // the Persistent_tree that made it is alive
+    class Version
+    {
+        friend class Persistent_tree;
+
+        Link root_ = nullptr;
+
+        explicit Version(Link root) noexcept : root_(root) {}
+
+        template <typename Out>
+        static void collect_(Link node, Out &out)
+        {
+            if (!node)
+                return;
+
+            collect_(node->left(), out);
+            out.push_back(node->key_);
+            collect_(node->right(), out);
+        }
+
+    public:
+        Version() = default;
+
+        std::size_t size () const noexcept { return root_ ? root_->size_ : 0; }
+        bool        empty() const noexcept { return !root_; }
+
+        // number of keys less than key
+        std::size_t rank(const KeyT &key) const
+        {
+            std::size_t less = 0;
+
+            for (Link cur = root_; cur;)
+            {
+                if (cur->key_ < key)
+                {
+                    less += (cur->left() ? cur->left()->size_ : 0) + 1;
+                    cur   = cur->right();
+                }
+                else
+                    cur = cur->left();
+            }
+
+            return less;
+        }
+
+        // number of keys not greater than key
+        std::size_t count_not_greater(const KeyT &key) const
+        {
+            std::size_t not_greater = 0;
+
+            for (Link cur = root_; cur;)
+            {
+                if (key < cur->key_)
+                    cur = cur->left();
+                else
+                {
+                    not_greater += (cur->left() ? cur->left()->size_ : 0) + 1;
+                    cur          = cur->right();
+                }
+            }
+
+            return not_greater;
+        }
+
+        // same contract as Red_black_tree::range_queries
+        uint64_t range_queries(const KeyT &key1, const KeyT &key2) const
+        {
+            if (!(key1 < key2))
+                return 0;
+
+            return count_not_greater(key2) - rank(key1);
+        }
+
+        bool contains(const KeyT &key) const
+        {
+            for (Link cur = root_; cur;)
+            {
+                if (key < cur->key_)
+                    cur = cur->left();
+                else if (cur->key_ < key)
+                    cur = cur->right();
+                else
+                    return true;
+            }
+
+            return false;
+        }
+
+        // all keys in order, O(n)
+        std::vector<KeyT> keys() const
+        {
+            std::vector<KeyT> out;
+            out.reserve(size());
+            collect_(root_, out);
+
+            return out;
+        }
+
+#ifdef CUSTOM_MODE_DEBUG
+        const NodeT *debug_root() const noexcept { return root_; } // for internal debugging tools only
+#endif
+    };
+
+private:
+    NodeAlloc           alloc_;
+    std::vector<NodeT*> blocks_;
+    std::size_t         used_in_last_ = kBlockNodes;
+
+    std::vector<Link> roots_{nullptr}; // roots_[i] = root of version i
+
+    Link make_(Color color, Link left, const KeyT &key, Link right)
+    {
+        if (used_in_last_ == kBlockNodes)
+        {
+            blocks_.reserve(blocks_.size() + 1);
+            blocks_.push_back(NodeTraits::allocate(alloc_, kBlockNodes));
+            used_in_last_ = 0;
+        }
+
+        NodeT *node = blocks_.back() + used_in_last_;
+        NodeTraits::construct(alloc_, node, color, left, key, right);
+        ++used_in_last_;
+
+        return node;
+    }
+
+    Link with_color_(Link node, Color color)
+    {
+        return make_(color, node->left(), node->key_, node->right());
+    }
+
+    static bool is_red_(Link node) noexcept
+    {
+        return node && node->color() == Color::red;
+    }
+
+    static bool is_black_node_(Link node) noexcept
+    {
+        return node && node->color() == Color::black;
+    }
+
+    // black node (left, key, right) with any red-red pair just below it
+    // rotated away; two red children are split into a red node over blacks
+    Link balance_(Link left, const KeyT &key, Link right)
+    {
+        constexpr Color R = Color::red;
+        constexpr Color B = Color::black;
+
+        if (is_red_(left) && is_red_(right))
+            return make_(R, with_color_(left, B), key, with_color_(right, B));
+
+        if (is_red_(left))
+        {
+            if (is_red_(left->left()))
+                return make_(R, with_color_(left->left(), B), left->key_,
+                                make_(B, left->right(), key, right));
+
+            if (is_red_(left->right()))
+            {
+                Link mid = left->right();
+                return make_(R, make_(B, left->left(), left->key_, mid->left()), mid->key_,
+                                make_(B, mid->right(), key, right));
+            }
+        }
+
+        if (is_red_(right))
+        {
+            if (is_red_(right->right()))
+                return make_(R, make_(B, left, key, right->left()), right->key_,
+                                with_color_(right->right(), B));
+
+            if (is_red_(right->left()))
+            {
+                Link mid = right->left();
+                return make_(R, make_(B, left, key, mid->left()), mid->key_,
+                                make_(B, mid->right(), right->key_, right->right()));
+            }
+        }
+
+        return make_(B, left, key, right);
+    }
+
+    // key must be absent
+    Link insert_(Link node, const KeyT &key)
+    {
+        if (!node)
+            return make_(Color::red, nullptr, key, nullptr);
+
+        if (key < node->key_)
+        {
+            Link left = insert_(node->left(), key);
+            return node->color() == Color::black ? balance_(left, node->key_, node->right())
+                                                 : make_(Color::red, left, node->key_, node->right());
+        }
+
+        Link right = insert_(node->right(), key);
+        return node->color() == Color::black ? balance_(node->left(), node->key_, right)
+                                             : make_(Color::red, node->left(), node->key_, right);
+    }
+
+    // left lost one black level
+    Link balance_left_(Link left, const KeyT &key, Link right)
+    {
+        constexpr Color R = Color::red;
+        constexpr Color B = Color::black;
+
+        if (is_red_(left))
+            return make_(R, with_color_(left, B), key, right);
+
+        if (is_black_node_(right))
+            return balance_(left, key, with_color_(right, R));
+
+        assert(is_red_(right) && is_black_node_(right->left()));
+
+        Link mid = right->left();
+        return make_(R, make_(B, left, key, mid->left()), mid->key_,
+                        balance_(mid->right(), right->key_, with_color_(right->right(), R)));
+    }
+
+    // right lost one black level
+    Link balance_right_(Link left, const KeyT &key, Link right)
+    {
+        constexpr Color R = Color::red;
+        constexpr Color B = Color::black;
+
+        if (is_red_(right))
+            return make_(R, left, key, with_color_(right, B));
+
+        if (is_black_node_(left))
+            return balance_(with_color_(left, R), key, right);
+
+        assert(is_red_(left) && is_black_node_(left->right()));
+
+        Link mid = left->right();
+        return make_(R, balance_(with_color_(left->left(), R), left->key_, mid->left()), mid->key_,
+                        make_(B, mid->right(), key, right));
+    }
+
+    // joins two subtrees of equal black height, all keys of left < right
+    Link fuse_(Link left, Link right)
+    {
+        constexpr Color R = Color::red;
+        constexpr Color B = Color::black;
+
+        if (!left)
+            return right;
+        if (!right)
+            return left;
+
+        if (is_red_(left) && is_red_(right))
+        {
+            Link mid = fuse_(left->right(), right->left());
+            if (is_red_(mid))
+                return make_(R, make_(R, left->left(), left->key_, mid->left()), mid->key_,
+                                make_(R, mid->right(), right->key_, right->right()));
+
+            return make_(R, left->left(), left->key_, make_(R, mid, right->key_, right->right()));
+        }
+
+        if (!is_red_(left) && !is_red_(right))
+        {
+            Link mid = fuse_(left->right(), right->left());
+            if (is_red_(mid))
+                return make_(R, make_(B, left->left(), left->key_, mid->left()), mid->key_,
+                                make_(B, mid->right(), right->key_, right->right()));
+
+            return balance_left_(left->left(), left->key_, make_(B, mid, right->key_, right->right()));
+        }
+
+        if (is_red_(right))
+            return make_(R, fuse_(left, right->left()), right->key_, right->right());
+
+        return make_(R, left->left(), left->key_, fuse_(left->right(), right));
+    }
+
+    // key must be present
+    Link erase_(Link node, const KeyT &key)
+    {
+        if (key < node->key_)
+        {
+            Link left = erase_(node->left(), key);
+            return is_black_node_(node->left()) ? balance_left_(left, node->key_, node->right())
+                                                : make_(Color::red, left, node->key_, node->right());
+        }
+
+        if (node->key_ < key)
+        {
+            Link right = erase_(node->right(), key);
+            return is_black_node_(node->right()) ? balance_right_(node->left(), node->key_, right)
+                                                 : make_(Color::red, node->left(), node->key_, right);
+        }
+
+        return fuse_(node->left(), node->right());
+    }
+
+    Link blacken_(Link root)
+    {
+        return is_red_(root) ? with_color_(root, Color::black) : root;
+    }
+
+    void release_() noexcept
+    {
+        for (std::size_t b = 0; b < blocks_.size(); ++b)
+        {
+            const std::size_t used = (b + 1 == blocks_.size()) ? used_in_last_ : kBlockNodes;
+
+            for (std::size_t i = 0; i < used; ++i)
+                NodeTraits::destroy(alloc_, blocks_[b] + i);
+
+            NodeTraits::deallocate(alloc_, blocks_[b], kBlockNodes);
+        }
+
+        blocks_.clear();
+        used_in_last_ = kBlockNodes;
+    }
+
+public:
+    Persistent_tree() = default;
+
+    explicit Persistent_tree(const Alloc &alloc) : alloc_(alloc) {}
+
+    Persistent_tree(const Persistent_tree &)            = delete;
+    Persistent_tree &operator=(const Persistent_tree &) = delete;
+
+    Persistent_tree(Persistent_tree &&other) noexcept
+        : alloc_       (other.alloc_),
+          blocks_      (std::move(other.blocks_)),
+          used_in_last_(std::exchange(other.used_in_last_, kBlockNodes)),
+          roots_       (std::exchange(other.roots_, std::vector<Link>{nullptr})) {}
+
+    Persistent_tree &operator=(Persistent_tree &&other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    ~Persistent_tree() { release_(); }
+
+    void swap(Persistent_tree &other) noexcept
+    {
+        using std::swap;
+        swap(alloc_,        other.alloc_);
+        swap(blocks_,       other.blocks_);
+        swap(used_in_last_, other.used_in_last_);
+        swap(roots_,        other.roots_);
+    }
+
+    // every call makes a new version, also when the key is already there
+    // (version numbers then follow update positions in a command stream)
+    void insert_elem(const KeyT &key)
+    {
+        Link root = roots_.back();
+
+        if (!current().contains(key))
+            root = blacken_(insert_(root, key));
+
+        roots_.push_back(root);
+    }
+
+    // makes a new version, returns the number of removed keys
+    std::size_t erase(const KeyT &key)
+    {
+        Link root = roots_.back();
+
+        const bool found = current().contains(key);
+        if (found)
+            root = blacken_(erase_(root, key));
+
+        roots_.push_back(root);
+        return found;
+    }
+
+    // version 0 is the empty tree, version i follows the i-th update
+    Version version(std::size_t i) const
+    {
+        assert(i < roots_.size() && "no such version");
+        return Version(roots_[i]);
+    }
+
+    Version     current () const noexcept { return Version(roots_.back()); }
+    std::size_t versions() const noexcept { return roots_.size(); }
+
+    std::size_t size () const noexcept { return current().size();  }
+    bool        empty() const noexcept { return current().empty(); }
+
+    uint64_t range_queries(const KeyT &key1, const KeyT &key2) const
+    {
+        return current().range_queries(key1, key2);
+    }
+
+    // nodes built over all versions (memory use is this times sizeof node)
+    std::size_t node_count() const noexcept
+    {
+        return blocks_.empty() ? 0 : (blocks_.size() - 1) * kBlockNodes + used_in_last_;
+    }
+};
+
+} // namespace Tree
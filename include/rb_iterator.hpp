@@ -4,20 +4,14 @@
 #include <iterator>
 #include <cassert>
 
-namespace Tree
-{
+#include "rb_node.hpp"
 
-namespace detail
+namespace Tree
 {
-template <typename KeyT>
-struct Node;
-}
 
-template <typename KeyT>
+template <typename KeyT, typename NodeT = detail::Node<KeyT>>
 class RB_const_iterator
 {
-    using NodeT = detail::Node<KeyT>;
-
     const NodeT *node_   = nullptr;
     const NodeT *header_ = nullptr;
 
@@ -52,15 +46,15 @@ public:
     {
         assert(node_ != header_ && "++end() is UB");
 
-        if (node_->right_is_thread)
+        if (node_->right_is_thread())
         {
-            node_ = node_->right_;
+            node_ = node_->right();
             return *this;
         }
 
-        node_ = node_->right_;
-        while (node_ != header_ && !node_->left_is_thread)
-            node_ = node_->left_;
+        node_ = node_->right();
+        while (node_ != header_ && !node_->left_is_thread())
+            node_ = node_->left();
 
         return *this;
     }
@@ -79,21 +73,21 @@ public:
     {
         if (node_ == header_)
         {
-            node_ = header_->right_;
+            node_ = header_->right();
             return *this;
         }
 
-        assert(node_ != header_->left_ && "--begin() is UB");
+        assert(node_ != header_->left() && "--begin() is UB");
 
-        if (node_->left_is_thread)
+        if (node_->left_is_thread())
         {
-            node_ = node_->left_;
+            node_ = node_->left();
             return *this;
         }
 
-        node_ = node_->left_;
-        while (node_ != header_ && !node_->right_is_thread)
-            node_ = node_->right_;
+        node_ = node_->left();
+        while (node_ != header_ && !node_->right_is_thread())
+            node_ = node_->right();
 
         return *this;
     }
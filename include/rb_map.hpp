@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include "aggregate.hpp"
+#include "red_black_tree.hpp"
+
+namespace Tree
+{
+
+template <typename KeyT, typename MappedT>
+struct Map_entry
+{
+    KeyT    key{};
+    MappedT value{};
+};
+
+namespace detail
+{
+
+// orders entries by key with Compare; transparent, so the map looks entries
+// up by a bare key (or by anything Compare itself accepts)
+template <typename Compare>
+struct Entry_compare : Compare
+{
+    using is_transparent = void;
+
+    Entry_compare() = default;
+    explicit Entry_compare(const Compare &comp) : Compare(comp) {}
+
+    template <typename KeyT, typename MappedT>
+    bool operator()(const Map_entry<KeyT, MappedT> &lhs, const Map_entry<KeyT, MappedT> &rhs) const
+    {
+        return Compare::operator()(lhs.key, rhs.key);
+    }
+
+    template <typename KeyT, typename MappedT, typename K>
+    bool operator()(const Map_entry<KeyT, MappedT> &lhs, const K &rhs) const
+    {
+        return Compare::operator()(lhs.key, rhs);
+    }
+
+    template <typename K, typename KeyT, typename MappedT>
+    bool operator()(const K &lhs, const Map_entry<KeyT, MappedT> &rhs) const
+    {
+        return Compare::operator()(lhs, rhs.key);
+    }
+
+    // bare keys, for the bounds of range_aggregate
+    template <typename L, typename R>
+    bool operator()(const L &lhs, const R &rhs) const
+    {
+        return Compare::operator()(lhs, rhs);
+    }
+};
+
+// Monoid over the mapped values of the entries
+template <typename Monoid>
+struct Mapped_aggregate : Monoid
+{
+    template <typename KeyT, typename MappedT>
+    static typename Monoid::value_type lift(const Map_entry<KeyT, MappedT> &entry)
+    {
+        return typename Monoid::value_type(entry.value);
+    }
+};
+
+} // namespace detail
+
+// Ordered map on Red_black_tree: every key carries a value, and every
+// subtree keeps the Monoid (Sum_monoid, Min_monoid, Max_monoid or any type
+// with value_type / identity() / combine()) of its values. Besides the
+// counts of the set, range_aggregate(a, b) folds the values of the keys in
+// [a, b] in O(log n), so a weight per key needs no separate Fenwick tree
+// kept in sync. Updating a value is O(log n) as well: the aggregates on its
+// path to the root are recomputed.
+template <typename KeyT, typename MappedT, typename Monoid = Sum_monoid<MappedT>,
+          typename Compare = std::less<KeyT>,
+          typename Alloc   = std::allocator<Map_entry<KeyT, MappedT>>,
+          typename Layout  = Pointer_layout>
+class Rb_map
+{
+public:
+    using entry_type     = Map_entry<KeyT, MappedT>;
+    using aggregate_type = typename Monoid::value_type;
+    using tree_type      = Red_black_tree<entry_type, Alloc, Layout,
+                                          detail::Entry_compare<Compare>, detail::Mapped_aggregate<Monoid>>;
+    using const_iterator = typename tree_type::const_iterator;
+
+private:
+    tree_type tree_;
+
+public:
+    Rb_map() = default;
+
+    explicit Rb_map(const Compare &comp, const Alloc &alloc = Alloc())
+        : tree_(detail::Entry_compare<Compare>(comp), alloc) {}
+
+    // adds key with value unless key is there already (its value is kept)
+    std::pair<const_iterator, bool> insert(const KeyT &key, const MappedT &value)
+    {
+        return tree_.insert(entry_type{key, value});
+    }
+
+    // adds key or overwrites its value
+    std::pair<const_iterator, bool> insert_or_assign(const KeyT &key, const MappedT &value)
+    {
+        auto res = tree_.insert(entry_type{key, value});
+
+        if (!res.second)
+            tree_.modify(res.first, [&value](entry_type &entry) { entry.value = value; });
+
+        return res;
+    }
+
+    // f(value) changes the value of the entry at pos in place
+    template <typename F>
+    void update(const_iterator pos, F &&f)
+    {
+        tree_.modify(pos, [&f](entry_type &entry) { std::forward<F>(f)(entry.value); });
+    }
+
+    std::size_t erase(const KeyT &key)
+    {
+        const const_iterator pos = find(key);
+        if (pos == end())
+            return 0;
+
+        tree_.erase(pos);
+        return 1;
+    }
+
+    const_iterator find(const KeyT &key) const
+    {
+        const const_iterator pos = tree_.lower_bound(key);
+        return pos != end() && !tree_.key_comp()(key, *pos) ? pos : end();
+    }
+
+    bool contains(const KeyT &key) const { return tree_.contains(key); }
+
+    const MappedT &at(const KeyT &key) const
+    {
+        const const_iterator pos = find(key);
+        if (pos == end())
+            throw std::out_of_range("Rb_map::at: no such key");
+
+        return pos->value;
+    }
+
+    const_iterator begin() const { return tree_.begin(); }
+    const_iterator end  () const { return tree_.end(); }
+
+    const_iterator lower_bound(const KeyT &key) const { return tree_.lower_bound(key); }
+    const_iterator upper_bound(const KeyT &key) const { return tree_.upper_bound(key); }
+
+    std::size_t size () const noexcept { return tree_.size(); }
+    bool        empty() const noexcept { return tree_.empty(); }
+
+    // number of keys less than key
+    std::size_t rank(const KeyT &key) const { return tree_.rank(key); }
+
+    // number of keys in [key1, key2], 0 if key2 <= key1
+    uint64_t range_queries(const KeyT &key1, const KeyT &key2) const { return tree_.range_queries(key1, key2); }
+
+    // Monoid of the values of the keys in [key1, key2] in key order,
+    // Monoid::identity() if key2 <= key1
+    aggregate_type range_aggregate(const KeyT &key1, const KeyT &key2) const
+    {
+        return tree_.range_aggregate(key1, key2);
+    }
+
+    // Monoid of all values, O(1)
+    aggregate_type aggregate() const { return tree_.aggregate(); }
+
+    const tree_type &tree() const noexcept { return tree_; }
+};
+
+} // namespace Tree
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace Tree
+{
+
+enum class Color
+{
+    red,
+    black,
+};
+
+// node storage modes for Red_black_tree
+struct Pointer_layout {}; // one allocation per node, 64-bit links
+struct Compact_layout {}; // one contiguous array, 32-bit relative links
+
+namespace detail
+{
+
+// aggregate of the subtree rooted at a node (see Red_black_tree's Aggregate);
+// AggT = void leaves an empty base, which takes no space in the node
+template <typename AggT>
+struct Aggregate_slot
+{
+    AggT agg_{};
+};
+
+template <>
+struct Aggregate_slot<void> {};
+
+// Both node types expose the same accessors, the tree never touches links
+// directly. A thread link (left_is_thread / right_is_thread) points to the
+// in-order neighbour instead of a child.
+template <typename KeyT, typename AggT = void>
+class Node : public Aggregate_slot<AggT>
+{
+public:
+    KeyT key_{};
+
+private:
+    Node *parent_ = nullptr;
+    Node *left_   = nullptr;
+    Node *right_  = nullptr;
+
+public:
+    std::size_t size_ = 0; // number of keys in the subtree rooted at this node
+
+private:
+    unsigned color_           : 1;
+    unsigned left_is_thread_  : 1;
+    unsigned right_is_thread_ : 1;
+
+public:
+    Node()
+        : color_          {static_cast<unsigned>(Color::black)},
+          left_is_thread_ {1},
+          right_is_thread_{1} {}
+
+    Node(const KeyT &key, Color color = Color::red)
+        : key_            {key},
+          size_           {1},
+          color_          {static_cast<unsigned>(color)},
+          left_is_thread_ {1},
+          right_is_thread_{1} {}
+
+    // the key is built in place from args
+    template <typename... Args>
+    Node(std::in_place_t, Color color, Args &&...args)
+        : key_            (std::forward<Args>(args)...),
+          size_           {1},
+          color_          {static_cast<unsigned>(color)},
+          left_is_thread_ {1},
+          right_is_thread_{1} {}
+
+    Color color() const noexcept { return static_cast<Color>(color_); }
+    void  set_color(Color color) noexcept { color_ = static_cast<unsigned>(color); }
+
+    Node *parent() const noexcept { return parent_; }
+    Node *left  () const noexcept { return left_;   }
+    Node *right () const noexcept { return right_;  }
+
+    void set_parent(Node *node) noexcept { parent_ = node; }
+    void set_left  (Node *node) noexcept { left_   = node; }
+    void set_right (Node *node) noexcept { right_  = node; }
+
+    bool left_is_thread () const noexcept { return left_is_thread_;  }
+    bool right_is_thread() const noexcept { return right_is_thread_; }
+
+    void set_left_thread (bool is_thread) noexcept { left_is_thread_  = is_thread; }
+    void set_right_thread(bool is_thread) noexcept { right_is_thread_ = is_thread; }
+};
+
+// Node for Compact_layout. All nodes of a tree sit in one array, so a link is
+// the distance to the target in nodes, stored in 31 bits next to a flag bit:
+// 24 bytes for an int64_t key instead of 48. Offsets are relative to the node
+// itself, so the whole array can be moved to a bigger buffer as is.
+// Parent offset 0 means "no parent"; left/right offset 0 is a link to self
+// (only the header of an empty tree has it).
+template <typename KeyT, typename AggT = void>
+class Compact_node : public Aggregate_slot<AggT>
+{
+public:
+    KeyT key_{};
+
+private:
+    std::int32_t  parent_          : 31;
+    std::uint32_t color_           : 1;
+    std::int32_t  left_            : 31;
+    std::uint32_t left_is_thread_  : 1;
+    std::int32_t  right_           : 31;
+    std::uint32_t right_is_thread_ : 1;
+
+public:
+    std::uint32_t size_ = 0;
+
+    // |offset| must fit into 31 bits
+    static constexpr std::size_t kMaxNodes = std::size_t{1} << 30;
+
+    Compact_node()
+        : parent_{0}, color_{static_cast<std::uint32_t>(Color::black)},
+          left_  {0}, left_is_thread_ {1},
+          right_ {0}, right_is_thread_{1} {}
+
+    Compact_node(const KeyT &key, Color color = Color::red)
+        : key_   {key},
+          parent_{0}, color_{static_cast<std::uint32_t>(color)},
+          left_  {0}, left_is_thread_ {1},
+          right_ {0}, right_is_thread_{1},
+          size_  {1} {}
+
+    Compact_node(KeyT &&key, Color color = Color::red)
+        : key_   {std::move(key)},
+          parent_{0}, color_{static_cast<std::uint32_t>(color)},
+          left_  {0}, left_is_thread_ {1},
+          right_ {0}, right_is_thread_{1},
+          size_  {1} {}
+
+    template <typename... Args>
+    Compact_node(std::in_place_t, Color color, Args &&...args)
+        : key_   (std::forward<Args>(args)...),
+          parent_{0}, color_{static_cast<std::uint32_t>(color)},
+          left_  {0}, left_is_thread_ {1},
+          right_ {0}, right_is_thread_{1},
+          size_  {1} {}
+
+    Color color() const noexcept { return static_cast<Color>(color_); }
+    void  set_color(Color color) noexcept { color_ = static_cast<std::uint32_t>(color); }
+
+    Compact_node *parent() const noexcept { return parent_ ? self_() + parent_ : nullptr; }
+    Compact_node *left  () const noexcept { return self_() + left_;  }
+    Compact_node *right () const noexcept { return self_() + right_; }
+
+    void set_parent(Compact_node *node) noexcept { parent_ = node ? offset_to_(node) : 0; }
+    void set_left  (Compact_node *node) noexcept { left_   = offset_to_(node); }
+    void set_right (Compact_node *node) noexcept { right_  = offset_to_(node); }
+
+    bool left_is_thread () const noexcept { return left_is_thread_;  }
+    bool right_is_thread() const noexcept { return right_is_thread_; }
+
+    void set_left_thread (bool is_thread) noexcept { left_is_thread_  = is_thread; }
+    void set_right_thread(bool is_thread) noexcept { right_is_thread_ = is_thread; }
+
+    // takes over links, flags, size and aggregate of a node that lives at the same
+    // index of another array (relocation)
+    void copy_links_from(const Compact_node &other) noexcept
+    {
+        parent_          = other.parent_;
+        color_           = other.color_;
+        left_            = other.left_;
+        left_is_thread_  = other.left_is_thread_;
+        right_           = other.right_;
+        right_is_thread_ = other.right_is_thread_;
+        size_            = other.size_;
+
+        static_cast<Aggregate_slot<AggT> &>(*this) = other;
+    }
+
+private:
+    Compact_node *self_() const noexcept { return const_cast<Compact_node *>(this); }
+
+    std::int32_t offset_to_(const Compact_node *node) const noexcept
+    {
+        return static_cast<std::int32_t>(node - this);
+    }
+};
+
+static_assert(sizeof(Compact_node<std::int64_t>) == 24, "compact node must stay 24 bytes for int64_t keys");
+
+template <typename KeyT, typename Layout, typename AggT = void>
+struct Layout_node;
+
+template <typename KeyT, typename AggT>
+struct Layout_node<KeyT, Pointer_layout, AggT> { using type = Node<KeyT, AggT>; };
+
+template <typename KeyT, typename AggT>
+struct Layout_node<KeyT, Compact_layout, AggT> { using type = Compact_node<KeyT, AggT>; };
+
+} // namespace detail
+
+} // namespace Tree
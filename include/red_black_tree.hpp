@@ -1,84 +1,188 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
 #include <utility>
 #include <iterator>
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 
+#include "aggregate.hpp"
+#include "frozen_set.hpp"
+#include "node_storage.hpp"
 #include "rb_iterator.hpp"
+#include "rb_node.hpp"
 
 
 namespace Tree
 {
 
-enum class Color
+// rebalancing work done by one tree since it was built (or reset_stats()).
+// Counted only when RBTREE_STATS is defined; it changes the class layout,
+// so the whole program must be built with the same setting.
+struct Rb_stats
 {
-    red,
-    black,
+    uint64_t left_rotations   = 0;
+    uint64_t right_rotations  = 0;
+    uint64_t recolors         = 0; // red uncle: parent, uncle and grandparent flipped
+    uint64_t insert_fix_loops = 0; // iterations of the fix_insert loop
+    uint64_t erase_fix_loops  = 0; // iterations of the fix_erase loop
+
+    uint64_t rotations() const noexcept { return left_rotations + right_rotations; }
 };
 
-namespace detail
+// Layout picks the node storage: Pointer_layout (default) allocates every node
+// separately; Compact_layout keeps all nodes in one array with 32-bit links,
+// which halves the node size but invalidates iterators on every insert that
+// grows the array.
+// Compare orders the keys like in std::set and is the only comparison the
+// tree uses. With a transparent Compare (std::less<> and the like) lookups
+// also accept any type it can compare with KeyT, e.g. std::string_view for
+// std::string keys, without building a KeyT per probe.
+// Aggregate (see aggregate.hpp) keeps a monoid of every subtree's keys next
+// to its size, for range_aggregate(); No_aggregate adds nothing to a node.
+template <typename KeyT, typename Alloc = std::allocator<KeyT>, typename Layout = Pointer_layout,
+          typename Compare = std::less<KeyT>, typename Aggregate = No_aggregate>
+class Red_black_tree
 {
+public:
+    using aggregate_type = typename Aggregate::value_type;
 
-template <typename KeyT>
-struct Node
-{
-    KeyT  key_;
-    Color color;
+private:
+    static constexpr bool kAggregated = !std::is_void_v<aggregate_type>;
 
-    Node *parent_ = nullptr;
-    Node *left_   = nullptr;
-    Node *right_  = nullptr;
+    using NodeT   = typename detail::Layout_node<KeyT, Layout, aggregate_type>::type;
+    using Storage = detail::Node_storage<NodeT, Alloc, Layout>;
 
-    unsigned left_is_thread  : 1;
-    unsigned right_is_thread : 1;
+    using Node_traits = typename Storage::Node_traits;
 
-    Node() = default;
+    // range_queries_batch walks all keys when there are at most this many
+    // per query endpoint, otherwise it descends once per endpoint
+    static constexpr std::size_t kSweepPerEndpoint = 4;
 
-    Node(const KeyT &key, Color color = Color::red)
-        : key_   {key},
-          color  {color},
-          left_is_thread {1},
-          right_is_thread{1} {}
-};
-} // namespace detail
+    // lookups taking any K exist only for a transparent Compare
+    template <typename C>
+    using Transparent_ = typename C::is_transparent;
 
-template <typename KeyT>
-class Red_black_tree
-{
-    using NodeT  = detail::Node<KeyT>;
+    Storage storage_;
+    Compare comp_;
 
-    NodeT header_storage_{};
-    NodeT *header_ = &header_storage_;
+    NodeT *header_ = storage_.header();
     NodeT *root_   = nullptr;
 
+#ifdef RBTREE_STATS
+    Rb_stats stats_; // not swapped: counts the work done through this object
+#endif
+
+    // compiles to nothing without RBTREE_STATS
+    void count_([[maybe_unused]] uint64_t Rb_stats::*counter) noexcept
+    {
+#ifdef RBTREE_STATS
+        ++(stats_.*counter);
+#endif
+    }
+
+    // header and root move together with the array in Compact_layout
+    void sync_with_storage_() noexcept
+    {
+        header_ = storage_.header();
+        root_   = header_->parent();
+    }
+
+    // room for count more nodes; keep is a node pointer the caller still needs
+    NodeT *reserve_nodes_(std::size_t count, NodeT *keep = nullptr)
+    {
+        keep = storage_.reserve(count, keep);
+
+        if constexpr (Storage::kNodesMove)
+            sync_with_storage_();
+
+        return keep;
+    }
+
     NodeT *get_parent(NodeT *node) const
     {
-        return node ? node->parent_ : nullptr;
+        return node ? node->parent() : nullptr;
     }
 
     NodeT *get_grandparent(NodeT *node) const
     {
         NodeT *parent_node = get_parent(node);
 
-        return parent_node ? parent_node->parent_ : nullptr;
+        return parent_node ? parent_node->parent() : nullptr;
     }
 
-    NodeT *left_child (NodeT *node) { return (node && !node->left_is_thread)  ? node->left_  : nullptr; }
-    NodeT *right_child(NodeT *node) { return (node && !node->right_is_thread) ? node->right_ : nullptr; }
+    static NodeT *left_child (NodeT *node) { return (node && !node->left_is_thread())  ? node->left()  : nullptr; }
+    static NodeT *right_child(NodeT *node) { return (node && !node->right_is_thread()) ? node->right() : nullptr; }
 
-    const NodeT *left_child (const NodeT *node) { return (node && !node->left_is_thread)  ? node->left_  : nullptr; }
-    const NodeT *right_child(const NodeT *node) { return (node && !node->right_is_thread) ? node->right_ : nullptr; }
+    static const NodeT *left_child (const NodeT *node) { return (node && !node->left_is_thread())  ? node->left()  : nullptr; }
+    static const NodeT *right_child(const NodeT *node) { return (node && !node->right_is_thread()) ? node->right() : nullptr; }
+
+    static std::size_t subtree_size(const NodeT *node) noexcept
+    {
+        return node ? node->size_ : 0;
+    }
+
+    // recompute size of the node from its (already correct) children
+    static void update_size_(NodeT *node) noexcept
+    {
+        node->size_ = static_cast<decltype(node->size_)>(subtree_size(left_child(node)) + subtree_size(right_child(node)) + 1);
+    }
+
+    static aggregate_type subtree_aggregate_(const NodeT *node)
+    {
+        return node ? node->agg_ : Aggregate::identity();
+    }
+
+    // recompute the aggregate of the node from its (already correct)
+    // children; a no-op without Aggregate. lift and combine must not throw,
+    // they run inside the rebalancing
+    static void pull_([[maybe_unused]] NodeT *node) noexcept
+    {
+        if constexpr (kAggregated)
+            node->agg_ = Aggregate::combine(Aggregate::combine(subtree_aggregate_(left_child(node)), Aggregate::lift(node->key_)),
+                                            subtree_aggregate_(right_child(node)));
+    }
+
+    // a new node was linked below parent_node => every ancestor got one more key
+    void increment_sizes_upward_(NodeT *parent_node) noexcept
+    {
+        for (NodeT *cur = parent_node; cur && cur != header_; cur = cur->parent())
+        {
+            ++cur->size_;
+            pull_(cur);
+        }
+    }
+
+    // a node was unlinked below parent_node => every ancestor lost one key
+    void decrement_sizes_upward_(NodeT *parent_node) noexcept
+    {
+        for (NodeT *cur = parent_node; cur && cur != header_; cur = cur->parent())
+        {
+            --cur->size_;
+            pull_(cur);
+        }
+    }
+
+    static bool is_black_(const NodeT *node) noexcept
+    {
+        return !node || node->color() == Color::black;
+    }
 
     // balance after insert
     void fix_insert(NodeT *node) noexcept
     {
         while (node && node != root_)
         {
+            count_(&Rb_stats::insert_fix_loops);
+
             NodeT *parent = get_parent(node);
-            if (!parent || parent == header_ || parent->color != Color::red)
+            if (!parent || parent == header_ || parent->color() != Color::red)
                 break;
 
             NodeT *grand = get_grandparent(node);
@@ -92,14 +196,16 @@ class Red_black_tree
         }
 
         if (root_)
-            root_->color = Color::black;
+            root_->set_color(Color::black);
     }
 
     void recolor_parent_uncle_grand_(NodeT *parent, NodeT *uncle, NodeT *grand) noexcept
     {
-        parent->color = Color::black;
-        uncle ->color = Color::black;
-        grand ->color = Color::red;
+        count_(&Rb_stats::recolors);
+
+        parent->set_color(Color::black);
+        uncle ->set_color(Color::black);
+        grand ->set_color(Color::red);
     }
 
     // parent is left child of grandparent
@@ -108,14 +214,14 @@ class Red_black_tree
         NodeT *uncle = right_child(grand);
 
         // uncle is red => recolor and continue from grandparent
-        if (uncle && uncle->color == Color::red)
+        if (uncle && uncle->color() == Color::red)
         {
             recolor_parent_uncle_grand_(parent, uncle, grand);
             return grand;
         }
 
         // node is right child => rotate parent to make a line
-        if (!parent->right_is_thread && node == parent->right_)
+        if (!parent->right_is_thread() && node == parent->right())
         {
             node   = parent;
             left_rotate(node);
@@ -127,8 +233,8 @@ class Red_black_tree
         }
 
         // rotate grand, recolor
-        parent->color = Color::black;
-        grand ->color = Color::red;
+        parent->set_color(Color::black);
+        grand ->set_color(Color::red);
         right_rotate(grand);
 
         return node;
@@ -139,13 +245,13 @@ class Red_black_tree
     {
         NodeT* uncle = left_child(grand);
 
-        if (uncle && uncle->color == Color::red)
+        if (uncle && uncle->color() == Color::red)
         {
             recolor_parent_uncle_grand_(parent, uncle, grand);
             return grand;
         }
 
-        if (!parent->left_is_thread && node == parent->left_)
+        if (!parent->left_is_thread() && node == parent->left())
         {
             node   = parent;
             right_rotate(node);
@@ -154,103 +260,325 @@ class Red_black_tree
             if (!parent || !grand) return node;
         }
 
-        parent->color = Color::black;
-        grand ->color = Color::red;
+        parent->set_color(Color::black);
+        grand ->set_color(Color::red);
         left_rotate(grand);
 
         return node;
     }
 
+    // put new_node (may be nullptr) where old_node hangs from its parent
+    void replace_in_parent_(NodeT *old_node, NodeT *new_node) noexcept
+    {
+        NodeT *parent_node = old_node->parent();
+
+        if (new_node)
+            new_node->set_parent(parent_node);
+
+        if (parent_node == header_)
+        {
+            root_            = new_node;
+            header_->set_parent(new_node);
+        }
+        else if (old_node == left_child(parent_node))
+            parent_node->set_left(new_node);
+        else
+            parent_node->set_right(new_node);
+    }
+
+    // unlink node from the tree (threads, header, sizes, colors) and free it,
+    // returns the in-order successor of the removed node
+    NodeT *erase_node_(NodeT *node) noexcept
+    {
+        NodeT *successor   = inorder_successor  (node);
+        NodeT *predecessor = inorder_predecessor(node);
+
+        NodeT *node_left  = left_child (node);
+        NodeT *node_right = right_child(node);
+
+        NodeT *child        = nullptr; // subtree that lost a black node (may be empty)
+        NodeT *child_parent = nullptr;
+        Color  removed_color = node->color();
+
+        if (node_left && node_right)
+        {
+            // successor has no left child: move it into node's place
+            NodeT *heir   = successor;
+            child         = right_child(heir);
+            removed_color = heir->color();
+
+            predecessor->set_right(heir);
+
+            if (heir != node_right)
+            {
+                child_parent = heir->parent();
+
+                if (child)
+                {
+                    child->set_parent(child_parent);
+                    child_parent->set_left(child);
+                }
+                else
+                {
+                    child_parent->set_left(heir); // heir becomes its predecessor
+                    child_parent->set_left_thread(true);
+                }
+
+                heir->set_right(node_right);
+                heir->set_right_thread(false);
+                node_right->set_parent(heir);
+            }
+            else
+                child_parent = heir;
+
+            heir->set_left(node_left);
+            heir->set_left_thread(false);
+            node_left->set_parent(heir);
+
+            replace_in_parent_(node, heir);
+            heir->set_color(node->color());
+            heir->size_ = node->size_;
+        }
+        else
+        {
+            child        = node_left ? node_left : node_right;
+            child_parent = node->parent();
+
+            if (node_left)
+                predecessor->set_right(node->right());
+            else if (node_right)
+                successor->set_left(node->left());
+
+            if (child)
+                replace_in_parent_(node, child);
+            else if (child_parent == header_)
+                root_ = nullptr;
+            else if (node == left_child(child_parent))
+            {
+                child_parent->set_left(node->left());
+                child_parent->set_left_thread(true);
+            }
+            else
+            {
+                child_parent->set_right(node->right());
+                child_parent->set_right_thread(true);
+            }
+
+            if (header_->left() == node)
+                header_->set_left(successor);
+            if (header_->right() == node)
+                header_->set_right(predecessor);
+        }
+
+        destroy_node_(node);
+
+        if (!root_)
+        {
+            make_empty_();
+            return header_;
+        }
+
+        decrement_sizes_upward_(child_parent);
+
+        if (removed_color == Color::black)
+            fix_erase(child, child_parent);
+
+        return successor;
+    }
+
+    // balance after erase: child carries an extra black
+    void fix_erase(NodeT *child, NodeT *parent) noexcept
+    {
+        while (child != root_ && is_black_(child))
+        {
+            count_(&Rb_stats::erase_fix_loops);
+
+            if (child == left_child(parent))
+            {
+                NodeT *sibling = right_child(parent);
+
+                if (sibling->color() == Color::red)
+                {
+                    sibling->set_color(Color::black);
+                    parent ->set_color(Color::red);
+                    left_rotate(parent);
+                    sibling = right_child(parent);
+                }
+
+                if (is_black_(left_child(sibling)) && is_black_(right_child(sibling)))
+                {
+                    sibling->set_color(Color::red);
+                    child  = parent;
+                    parent = parent->parent();
+                    continue;
+                }
+
+                if (is_black_(right_child(sibling)))
+                {
+                    left_child(sibling)->set_color(Color::black);
+                    sibling->set_color(Color::red);
+                    right_rotate(sibling);
+                    sibling = right_child(parent);
+                }
+
+                sibling->set_color(parent->color());
+                parent ->set_color(Color::black);
+                right_child(sibling)->set_color(Color::black);
+                left_rotate(parent);
+                break;
+            }
+            else
+            {
+                NodeT *sibling = left_child(parent);
+
+                if (sibling->color() == Color::red)
+                {
+                    sibling->set_color(Color::black);
+                    parent ->set_color(Color::red);
+                    right_rotate(parent);
+                    sibling = left_child(parent);
+                }
+
+                if (is_black_(left_child(sibling)) && is_black_(right_child(sibling)))
+                {
+                    sibling->set_color(Color::red);
+                    child  = parent;
+                    parent = parent->parent();
+                    continue;
+                }
+
+                if (is_black_(left_child(sibling)))
+                {
+                    right_child(sibling)->set_color(Color::black);
+                    sibling->set_color(Color::red);
+                    left_rotate(sibling);
+                    sibling = left_child(parent);
+                }
+
+                sibling->set_color(parent->color());
+                parent ->set_color(Color::black);
+                left_child(sibling)->set_color(Color::black);
+                right_rotate(parent);
+                break;
+            }
+        }
+
+        if (child)
+            child->set_color(Color::black);
+    }
+
     void left_rotate(NodeT *pivot_node) noexcept
     {
         if (!pivot_node)                 return;
-        if (pivot_node->right_is_thread) return;
+        if (pivot_node->right_is_thread()) return;
 
-        NodeT *new_root     = pivot_node->right_;
-        NodeT *pivot_parent = pivot_node->parent_;
+        NodeT *new_root     = pivot_node->right();
+        NodeT *pivot_parent = pivot_node->parent();
         if (!new_root)                   return;
 
-        if (new_root->left_is_thread)
+        count_(&Rb_stats::left_rotations);
+
+        if (new_root->left_is_thread())
         {
-            pivot_node->right_          = new_root;
-            pivot_node->right_is_thread = 1;
+            pivot_node->set_right(new_root);
+            pivot_node->set_right_thread(true);
         }
         else
         {
-            NodeT *beta_subtree         = new_root->left_;
-            pivot_node->right_          = beta_subtree;
-            pivot_node->right_is_thread = 0;
+            NodeT *beta_subtree         = new_root->left();
+            pivot_node->set_right(beta_subtree);
+            pivot_node->set_right_thread(false);
 
             if (beta_subtree)
-                beta_subtree->parent_   = pivot_node;
+                beta_subtree->set_parent(pivot_node);
         }
 
-        new_root->parent_ = pivot_parent;
+        new_root->set_parent(pivot_parent);
 
         if (pivot_parent == header_)
         {
             root_            = new_root;
-            header_->parent_ = root_;
+            header_->set_parent(root_);
         }
-        else if (pivot_node == pivot_parent->left_)
-            pivot_parent->left_ = new_root;
+        else if (pivot_node == pivot_parent->left())
+            pivot_parent->set_left(new_root);
         else
-            pivot_parent->right_ = new_root;
+            pivot_parent->set_right(new_root);
+
+        new_root->set_left(pivot_node);
+        new_root->set_left_thread(false);
+        pivot_node->set_parent(new_root);
 
-        new_root->left_          = pivot_node;
-        new_root->left_is_thread = 0;
-        pivot_node->parent_      = new_root;
+        new_root->size_ = pivot_node->size_;
+        update_size_(pivot_node);
+
+        if constexpr (kAggregated)
+        {
+            new_root->agg_ = pivot_node->agg_;
+            pull_(pivot_node);
+        }
     }
 
     void right_rotate(NodeT *pivot_node) noexcept
     {
         if (!pivot_node)                return;
-        if (pivot_node->left_is_thread) return;
+        if (pivot_node->left_is_thread()) return;
 
-        NodeT *new_root     = pivot_node->left_;
-        NodeT *pivot_parent = pivot_node->parent_;
+        NodeT *new_root     = pivot_node->left();
+        NodeT *pivot_parent = pivot_node->parent();
         if (!new_root)                  return;
 
-        if (new_root->right_is_thread)
+        count_(&Rb_stats::right_rotations);
+
+        if (new_root->right_is_thread())
         {
-            pivot_node->left_          = new_root;
-            pivot_node->left_is_thread = 1;
+            pivot_node->set_left(new_root);
+            pivot_node->set_left_thread(true);
         }
         else
         {
-            NodeT *beta_subtree        = new_root->right_;
-            pivot_node->left_          = beta_subtree;
-            pivot_node->left_is_thread = 0;
+            NodeT *beta_subtree        = new_root->right();
+            pivot_node->set_left(beta_subtree);
+            pivot_node->set_left_thread(false);
 
             if (beta_subtree)
-                beta_subtree->parent_  = pivot_node;
+                beta_subtree->set_parent(pivot_node);
         }
 
-        new_root->parent_ = pivot_parent;
+        new_root->set_parent(pivot_parent);
 
         if (pivot_parent == header_)
         {
             root_            = new_root;
-            header_->parent_ = root_;
+            header_->set_parent(root_);
         }
-        else if (pivot_node == pivot_parent->right_)
-            pivot_parent->right_ = new_root;
+        else if (pivot_node == pivot_parent->right())
+            pivot_parent->set_right(new_root);
         else
-            pivot_parent->left_ = new_root;
+            pivot_parent->set_left(new_root);
+
 
 
+        new_root->set_right(pivot_node);
+        new_root->set_right_thread(false);
+        pivot_node->set_parent(new_root);
 
-        new_root->right_          = pivot_node;
-        new_root->right_is_thread = 0;
-        pivot_node->parent_       = new_root;
+        new_root->size_ = pivot_node->size_;
+        update_size_(pivot_node);
+
+        if constexpr (kAggregated)
+        {
+            new_root->agg_ = pivot_node->agg_;
+            pull_(pivot_node);
+        }
     }
 
     static NodeT *leftmost(NodeT *node)
     {
         if (!node)
             return nullptr;
-        while (!node->left_is_thread)
-            node = node->left_;
+        while (!node->left_is_thread())
+            node = node->left();
 
         return node;
     }
@@ -259,8 +587,8 @@ class Red_black_tree
     {
         if (!node)
             return nullptr;
-        while (!node->right_is_thread)
-            node = node->right_;
+        while (!node->right_is_thread())
+            node = node->right();
 
         return node;
     }
@@ -273,26 +601,26 @@ class Red_black_tree
             return;
         }
 
-        header_->parent_ = root_;
-        root_->parent_   = header_;
+        header_->set_parent(root_);
+        root_->set_parent(header_);
 
-        header_->left_   = leftmost(root_);
-        header_->right_  = rightmost(root_);
+        header_->set_left(leftmost(root_));
+        header_->set_right(rightmost(root_));
 
-        if (header_->left_ && header_->left_ != header_)
+        if (header_->left() && header_->left() != header_)
         {
-            header_->left_->left_          = header_;
-            header_->left_->left_is_thread = 1;
+            header_->left()->set_left(header_);
+            header_->left()->set_left_thread(true);
         }
 
-        if (header_->right_ && header_->right_ != header_)
+        if (header_->right() && header_->right() != header_)
         {
-            header_->right_->right_          = header_;
-            header_->right_->right_is_thread = 1;
+            header_->right()->set_right(header_);
+            header_->right()->set_right_thread(true);
         }
 
-        header_->left_is_thread  = 1;
-        header_->right_is_thread = 1;
+        header_->set_left_thread(true);
+        header_->set_right_thread(true);
     }
 
     NodeT *inorder_successor(NodeT *node) const noexcept
@@ -300,25 +628,33 @@ class Red_black_tree
         if (!node)
             return header_;
 
-        if (node->right_is_thread)
-            return node->right_;
+        if (node->right_is_thread())
+            return node->right();
 
-        node = node->right_;
-        while (node && !node->left_is_thread)
-            node = node->left_;
+        node = node->right();
+        while (node && !node->left_is_thread())
+            node = node->left();
 
         return node ? node : header_;
     }
 
+    NodeT *inorder_predecessor(NodeT *node) const noexcept
+    {
+        if (node->left_is_thread())
+            return node->left();
+
+        return rightmost(node->left());
+    }
+
     void init_header_() noexcept
     {
-        header_->color   = Color::black;
-        header_->parent_ = nullptr;
-        header_->left_   = header_;
-        header_->right_  = header_;
+        header_->set_color(Color::black);
+        header_->set_parent(nullptr);
+        header_->set_left(header_);
+        header_->set_right(header_);
 
-        header_->left_is_thread  = 1;
-        header_->right_is_thread = 1;
+        header_->set_left_thread(true);
+        header_->set_right_thread(true);
     }
 
     void make_empty_() noexcept
@@ -329,61 +665,97 @@ class Red_black_tree
 
     void destroy_subtree() noexcept
     {
-        NodeT *cur = header_->left_;
+        // all nodes at once: a private arena or the node array
+        if (root_ && storage_.try_release_all())
+        {
+            make_empty_();
+            return;
+        }
+
+        NodeT *cur = header_->left();
         while (cur != header_)
         {
             NodeT *next_node = inorder_successor(cur);
-            delete cur;
+            destroy_node_(cur);
             cur = next_node;
         }
 
         root_            = nullptr;
-        header_->parent_ = nullptr;
-        header_->left_   = header_;
-        header_->right_  = header_;
+        header_->set_parent(nullptr);
+        header_->set_left(header_);
+        header_->set_right(header_);
 
-        header_->left_is_thread  = 1;
-        header_->right_is_thread = 1;
+        header_->set_left_thread(true);
+        header_->set_right_thread(true);
     }
 
 
 public:
-    using const_iterator = RB_const_iterator<KeyT>;
+    // range_queries_batch beats single queries on one thread, so the driver
+    // collects query runs for it
+    static constexpr bool kBatchesQueries = true;
+
+    // smaller trees stay in cache: sorting a query run costs more than
+    // range_queries_batch saves, so it answers them one by one
+    static constexpr std::size_t kBatchMinKeys = std::size_t{1} << 14;
+
+    using const_iterator = RB_const_iterator<KeyT, NodeT>;
+    using allocator_type = Alloc;
+
+    Red_black_tree() noexcept(std::is_nothrow_default_constructible<Alloc>::value)
+        : Red_black_tree(Alloc()) {}
+
+    explicit Red_black_tree(const Alloc &alloc) noexcept
+        : Red_black_tree(Compare(), alloc) {}
 
-    Red_black_tree() noexcept
+    explicit Red_black_tree(const Compare &comp, const Alloc &alloc = Alloc()) noexcept
+        : storage_(alloc), comp_(comp)
     {
         init_header_();
     }
 
-    Red_black_tree(KeyT key) : Red_black_tree()
+    Red_black_tree(const KeyT &key, const Alloc &alloc = Alloc()) : Red_black_tree(alloc)
     {
-        NodeT *root_node = new NodeT(key, Color::black);
+        insert_elem(key);
+    }
 
-        root_            = root_node;
+    Compare key_comp() const { return comp_; }
 
-        header_->parent_ = root_;
-        header_->left_   = root_;
-        header_->right_  = root_;
+    allocator_type get_allocator() const { return storage_.get_allocator(); }
 
-        root_->parent_   = header_;
 
-        root_->left_           = header_;
-        root_->left_is_thread  = 1;
-        root_->right_          = header_;
-        root_->right_is_thread = 1;
+    ~Red_black_tree()
+    {
+        destroy_subtree();
     }
 
+    Red_black_tree(const Red_black_tree& other)
+        : Red_black_tree(other.comp_, other.storage_.copy_allocator())
+    {
+        Red_black_tree tmp(comp_, get_allocator()); // tmp has been successfully created => it will be destroyed when it is excluded
+        tmp.build_from_sorted_(other.begin(), other.end()); // keys of other are already sorted => O(n)
 
-    ~Red_black_tree()
+        swap(tmp);
+    }
+
+    // builds a balanced tree from strictly increasing keys in O(n),
+    // equal neighbours are collapsed into one key
+    template <typename InputIt>
+    static Red_black_tree from_sorted(InputIt first, InputIt last, const Alloc &alloc = Alloc(),
+                                      const Compare &comp = Compare())
     {
-        destroy_subtree();
+        Red_black_tree tree(comp, alloc);
+        tree.build_from_sorted_(first, last);
+
+        return tree;
     }
 
-    Red_black_tree(const Red_black_tree& other) : Red_black_tree()
+    // replaces the contents with sorted keys in O(n), strong guarantee
+    template <typename InputIt>
+    void assign_sorted(InputIt first, InputIt last)
     {
-        Red_black_tree tmp;         // tmp has been successfully created => it will be destroyed when it is excluded
-        for (auto it = other.begin(); it != other.end(); ++it)
-            tmp.insert_elem(*it);   // building a copy in tmp
+        Red_black_tree tmp(comp_, get_allocator());
+        tmp.build_from_sorted_(first, last);
 
         swap(tmp);
     }
@@ -415,7 +787,15 @@ public:
     }
 
     Red_black_tree(Red_black_tree &&other) noexcept
+        : storage_(std::move(other.storage_)), comp_(other.comp_)
     {
+        if constexpr (Storage::kNodesMove)
+        {
+                  sync_with_storage_();
+            other.sync_with_storage_();
+            return;
+        }
+
         init_header_();
 
         if (!other.root_)
@@ -423,73 +803,206 @@ public:
 
         root_ = other.root_;
 
-        header_->parent_ = root_;
-        header_->left_   = other.header_->left_;
-        header_->right_  = other.header_->right_;
+        header_->set_parent(root_);
+        header_->set_left(other.header_->left());
+        header_->set_right(other.header_->right());
 
-        root_->parent_   = header_;
+        root_->set_parent(header_);
 
-        header_->left_->left_          = header_;
-        header_->left_->left_is_thread = 1;
+        header_->left()->set_left(header_);
+        header_->left()->set_left_thread(true);
 
-        header_->right_->right_          = header_;
-        header_->right_->right_is_thread = 1;
+        header_->right()->set_right(header_);
+        header_->right()->set_right_thread(true);
 
         other.make_empty_();
     }
 
     Red_black_tree& operator=(Red_black_tree &&other) noexcept
     {
+        static_assert(Node_traits::propagate_on_container_move_assignment::value ||
+                      Node_traits::is_always_equal::value,
+                      "move assignment steals nodes, allocator must follow them");
+
         if (this == &other)
             return *this;
 
         destroy_subtree();
+        storage_.move_assign(other.storage_);
+        comp_ = other.comp_;
+
+        if constexpr (Storage::kNodesMove)
+        {
+                  sync_with_storage_();
+            other.sync_with_storage_();
+            return *this;
+        }
 
         if (!other.root_)
             return *this;
 
         root_ = other.root_;
 
-        header_->parent_ = root_;
-        header_->left_   = other.header_->left_;
-        header_->right_  = other.header_->right_;
+        header_->set_parent(root_);
+        header_->set_left(other.header_->left());
+        header_->set_right(other.header_->right());
 
-        root_->parent_   = header_;
+        root_->set_parent(header_);
 
-        header_->left_->left_    = header_;
-        header_->right_->right_  = header_;
+        header_->left()->set_left(header_);
+        header_->right()->set_right(header_);
 
         other.make_empty_();
         return *this;
     }
 
     // inserting key
-    void insert_elem(const KeyT key)
+    void insert_elem(const KeyT &key)
     {
-        if (!root_)
+        insert(key);
+    }
+
+    // like std::set::insert: the position of key and whether it was
+    // inserted (false = an equal key was already there)
+    std::pair<const_iterator, bool> insert(const KeyT &key)
+    {
+        // key may be one of our own keys, and growing the array moves them;
+        // std::vector::push_back has the same aliasing problem
+        if constexpr (Storage::kNodesMove)
         {
-            NodeT *new_node = create_red_node_(key, nullptr);
-            attach_first_node_(new_node);
+            if (storage_.owns(&key))
+                return insert_unique_(KeyT(key));
+        }
 
-            return;
+        return insert_unique_(key);
+    }
+
+    // the key is moved into the node, and only if it is not there yet
+    std::pair<const_iterator, bool> insert(KeyT &&key)
+    {
+        return insert_unique_(std::move(key));
+    }
+
+    // like std::set::emplace: the key is constructed right in a new node,
+    // which is dropped again if an equal key is already there. Compact_layout
+    // builds the key first and moves it in: args may refer into the node
+    // array, which the insert may move.
+    template <typename... Args>
+    std::pair<const_iterator, bool> emplace(Args &&...args)
+    {
+        if constexpr (Storage::kNodesMove)
+            return insert_unique_(KeyT(std::forward<Args>(args)...));
+        else
+        {
+            NodeT *new_node = storage_.create(Color::red, std::forward<Args>(args)...);
+            pull_(new_node);
+
+            if (!root_)
+            {
+                attach_first_node_(new_node);
+                return {begin(), true};
+            }
+
+            bool   insert_left = false;
+            NodeT *equal_node  = nullptr;
+            NodeT *parent_node = nullptr;
+
+            try
+            {
+                parent_node = find_parent_for_insert_(new_node->key_, insert_left, &equal_node);
+            }
+            catch (...)
+            {
+                destroy_node_(new_node);
+                throw;
+            }
+
+            if (!parent_node)
+            {
+                destroy_node_(new_node);
+                return {const_iterator(equal_node, header_), false};
+            }
+
+            return {const_iterator(link_red_node_(parent_node, insert_left, new_node), header_), true};
+        }
+    }
+
+    // like std::set::emplace_hint: hint is the position the key is expected
+    // to go before. A key adjacent to hint costs O(1) comparisons and
+    // amortized O(1) rebalancing; a wrong hint falls back to a finger search.
+    // Returns the position of key (inserted or already present).
+    const_iterator insert_hint(const_iterator hint, const KeyT &key)
+    {
+        if constexpr (Storage::kNodesMove)
+        {
+            if (storage_.owns(&key))
+            {
+                const KeyT copy(key);
+                return insert_hint(hint, copy);
+            }
+        }
+
+        if (!root_)
+        {
+            insert_elem(key);
+            return begin();
         }
 
+        NodeT *finger = reserve_nodes_(1, const_cast<NodeT *>(hint.get_node()));
+        if (finger == header_)
+            finger = header_->right();
+
         bool   insert_left = false;
-        NodeT *parent_node = find_parent_for_insert_(key, insert_left);
+        NodeT *parent_node = find_parent_near_(finger, key, insert_left);
 
-        // key already exists
         if (!parent_node)
+            return lower_bound(key);
+
+        return const_iterator(insert_at_(parent_node, insert_left, key), header_);
+    }
+
+    // inserts a batch of keys in any order. The batch is sorted and each key
+    // is placed by a finger search from the previous one, so close keys do not
+    // pay a root-to-leaf walk; a batch at least as big as the tree is merged
+    // and rebuilt in O(n + m). Basic exception guarantee.
+    template <typename InputIt>
+    void insert_range(InputIt first, InputIt last)
+    {
+        std::vector<KeyT> batch(first, last);
+
+        std::sort(batch.begin(), batch.end(), comp_);
+        batch.erase(std::unique(batch.begin(), batch.end(),
+                                [this](const KeyT &lhs, const KeyT &rhs) { return !comp_(lhs, rhs); }),
+                    batch.end());
+
+        if (batch.empty())
+            return;
+
+        if (batch.size() >= size())
+        {
+            std::vector<KeyT> merged;
+            merged.reserve(size() + batch.size());
+            std::set_union(begin(), end(), batch.begin(), batch.end(), std::back_inserter(merged), comp_);
+
+            assign_sorted(merged.begin(), merged.end());
             return;
+        }
 
-        NodeT *new_node = create_red_node_(key, parent_node);
+        reserve_nodes_(batch.size());
 
-        if (insert_left)
-            attach_as_left_child_(parent_node, new_node);
-        else
-            attach_as_right_child_(parent_node, new_node);
+        NodeT *finger = nullptr;
+        for (const KeyT &key : batch)
+        {
+            bool   insert_left = false;
+            NodeT *parent_node = finger ? find_parent_near_(finger, key, insert_left)
+                                        : find_parent_for_insert_(key, insert_left);
 
-        fix_insert(new_node);
-        enforce_header_threads_();
+            // key already exists => keep the old finger, it is still next to key
+            if (!parent_node)
+                continue;
+
+            finger = insert_at_(parent_node, insert_left, key);
+        }
     }
 
     const_iterator begin() const
@@ -497,7 +1010,7 @@ public:
         if (!root_)
             return const_iterator(header_, header_);
 
-        return const_iterator(header_->left_, header_);
+        return const_iterator(header_->left(), header_);
     }
 
     const_iterator end() const
@@ -505,21 +1018,251 @@ public:
         return const_iterator(header_, header_);
     }
 
-    uint64_t range_queries(const KeyT key1, const KeyT key2) const
+    std::size_t size() const noexcept { return subtree_size(root_); }
+    bool       empty() const noexcept { return !root_; }
+
+    // number of keys in [key1, key2], O(log n) via subtree sizes
+    uint64_t range_queries(const KeyT &key1, const KeyT &key2) const
+    {
+        return range_queries_(key1, key2);
+    }
+
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    uint64_t range_queries(const K &key1, const K &key2) const
+    {
+        return range_queries_(key1, key2);
+    }
+
+    // Aggregate of the keys in [key1, key2] in key order, identity() when
+    // key2 <= key1 (the contract of range_queries); O(log n) via subtree
+    // aggregates
+    aggregate_type range_aggregate(const KeyT &key1, const KeyT &key2) const
+    {
+        return range_aggregate_(key1, key2);
+    }
+
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    aggregate_type range_aggregate(const K &key1, const K &key2) const
+    {
+        return range_aggregate_(key1, key2);
+    }
+
+    // aggregate of all keys, O(1)
+    aggregate_type aggregate() const
+    {
+        static_assert(kAggregated, "the tree has no Aggregate");
+        return subtree_aggregate_(root_);
+    }
+
+    // lets f change the key at pos in place, e.g. the mapped value of a map
+    // entry; f must keep its order among the other keys. The aggregates on
+    // the path to the root are recomputed, O(log n).
+    template <typename F>
+    void modify(const_iterator pos, F &&f)
+    {
+        assert(pos != end() && "modify(end()) is UB");
+
+        NodeT *node = const_cast<NodeT *>(pos.get_node());
+        std::forward<F>(f)(node->key_);
+
+        for (NodeT *cur = node; cur != header_; cur = cur->parent())
+            pull_(cur);
+    }
+
+    // range_queries for a whole run of queries: *out++ gets the answer to
+    // each (key1, key2) pair of [first, last) in order. All endpoints are
+    // sorted once; a tree not much bigger than the run is then swept in
+    // order in O(n), a bigger one is ranked by descents in key order, which
+    // keep the shared top of the tree in cache.
+    template <typename ForwardIt, typename OutIt>
+    void range_queries_batch(ForwardIt first, ForwardIt last, OutIt out) const
+    {
+        if (size() < kBatchMinKeys)
+        {
+            for (; first != last; ++first, ++out)
+                *out = range_queries(first->first, first->second);
+            return;
+        }
+
+        struct Endpoint
+        {
+            const KeyT *key;
+            std::size_t slot; // 2 * query index, + 1 for the upper end
+        };
+
+        const std::size_t count = static_cast<std::size_t>(std::distance(first, last));
+
+        std::vector<Endpoint> ends;
+        ends.reserve(2 * count);
+
+        std::size_t idx = 0;
+        for (ForwardIt it = first; it != last; ++it, ++idx)
+        {
+            if (comp_(it->first, it->second))
+            {
+                ends.push_back({&it->first,  2 * idx});
+                ends.push_back({&it->second, 2 * idx + 1});
+            }
+        }
+
+        // equal keys: lower ends (count of keys < key) before upper ones (<= key)
+        std::sort(ends.begin(), ends.end(), [this](const Endpoint &lhs, const Endpoint &rhs)
+        {
+            if (comp_(*lhs.key, *rhs.key))
+                return true;
+            if (comp_(*rhs.key, *lhs.key))
+                return false;
+
+            return (lhs.slot & 1) < (rhs.slot & 1);
+        });
+
+        std::vector<std::size_t> counts(2 * count);
+
+        if (size() <= kSweepPerEndpoint * ends.size())
+        {
+            const_iterator it  = begin();
+            const_iterator fin = end();
+            std::size_t    passed = 0;
+
+            for (const Endpoint &end_point : ends)
+            {
+                const KeyT &key = *end_point.key;
+
+                if (end_point.slot & 1)
+                    for (; it != fin && !comp_(key, *it); ++it)
+                        ++passed;
+                else
+                    for (; it != fin && comp_(*it, key); ++it)
+                        ++passed;
+
+                counts[end_point.slot] = passed;
+            }
+        }
+        else
+        {
+            for (const Endpoint &end_point : ends)
+                counts[end_point.slot] = (end_point.slot & 1) ? count_not_greater_(*end_point.key)
+                                                              : count_less_(*end_point.key);
+        }
+
+        for (std::size_t i = 0; i < count; ++i, ++out)
+            *out = counts[2 * i + 1] - counts[2 * i];
+    }
+
+    // k-th smallest key (k starts from 1), end() if k is out of range
+    const_iterator select(std::size_t k) const
+    {
+        if (k == 0 || k > size())
+            return end();
+
+        NodeT *cur = root_;
+        while (cur)
+        {
+            const std::size_t left_size = subtree_size(left_child(cur));
+
+            if (k <= left_size)
+                cur = left_child(cur);
+            else if (k == left_size + 1)
+                break;
+            else
+            {
+                k  -= left_size + 1;
+                cur = right_child(cur);
+            }
+        }
+
+        return const_iterator(cur ? cur : header_, header_);
+    }
+
+    // number of keys less than key
+    std::size_t rank(const KeyT &key) const
+    {
+        return count_less_(key);
+    }
+
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    std::size_t rank(const K &key) const
+    {
+        return count_less_(key);
+    }
+
+    // immutable read-optimized copy of the current keys, O(n); the snapshot
+    // does not follow later changes of the tree
+    Frozen_set<KeyT, Compare> freeze() const
+    {
+        return Frozen_set<KeyT, Compare>(begin(), end(), comp_);
+    }
+
+    // nodes at each depth, the root is at depth 0; O(n)
+    std::vector<std::size_t> depth_histogram() const
+    {
+        std::vector<std::size_t> levels;
+        if (!root_)
+            return levels;
+
+        std::vector<std::pair<const NodeT *, std::size_t>> stack{{root_, 0}};
+        while (!stack.empty())
+        {
+            const auto [node, depth] = stack.back();
+            stack.pop_back();
+
+            if (levels.size() <= depth)
+                levels.resize(depth + 1);
+            ++levels[depth];
+
+            if (const NodeT *left = left_child(node))
+                stack.push_back({left, depth + 1});
+            if (const NodeT *right = right_child(node))
+                stack.push_back({right, depth + 1});
+        }
+
+        return levels;
+    }
+
+    // number of levels, 0 for an empty tree; O(n)
+    std::size_t height() const
+    {
+        return depth_histogram().size();
+    }
+
+#ifdef RBTREE_STATS
+    const Rb_stats &stats() const noexcept { return stats_; }
+    void reset_stats() noexcept { stats_ = Rb_stats{}; }
+#endif
+
+    // removes the key if present, returns the number of removed keys
+    std::size_t erase(const KeyT &key)
     {
-        if (key2 <= key1)
+        NodeT *found_node = lower_bound_node(key);
+        if (!found_node || comp_(key, found_node->key_))
             return 0;
 
-        auto first = lower_bound(key1);
-        auto last  = upper_bound(key2);
+        erase_node_(found_node);
+        return 1;
+    }
+
+    // removes the key at pos, returns iterator to the next key
+    const_iterator erase(const_iterator pos)
+    {
+        assert(pos != end() && "erase(end()) is UB");
 
-        return std::distance(first, last);
+        NodeT *next_node = erase_node_(const_cast<NodeT *>(pos.get_node()));
+        return const_iterator(next_node, header_);
     }
 
     void swap(Red_black_tree &other) noexcept
     {
         using std::swap;
         swap(root_, other.root_);
+        swap(comp_, other.comp_);
+        storage_.swap(other.storage_);
+
+        if constexpr (Storage::kNodesMove)
+        {
+                  sync_with_storage_();
+            other.sync_with_storage_();
+            return;
+        }
 
               rebind_header_from_root_();
         other.rebind_header_from_root_();
@@ -527,71 +1270,250 @@ public:
 
 
 private:
-    NodeT *lower_bound_node(const KeyT &key) const
+    template <typename K>
+    NodeT *lower_bound_node(const K &key) const
     {
         NodeT *cur = root_;
         NodeT *res = nullptr;
 
         while (cur)
         {
-            if (!(cur->key_ < key)) // key <= cur->key_
+            if (!comp_(cur->key_, key)) // key <= cur->key_
             {
                 res = cur;
-                cur = (cur->left_is_thread ? nullptr : cur->left_);
+                cur = (cur->left_is_thread() ? nullptr : cur->left());
             }
 
             else
-                cur = (cur->right_is_thread ? nullptr : cur->right_);
+                cur = (cur->right_is_thread() ? nullptr : cur->right());
         }
 
         return res;
     }
 
-    NodeT *upper_bound_node(const KeyT &key) const
+    template <typename K>
+    NodeT *upper_bound_node(const K &key) const
     {
         NodeT *cur = root_;
         NodeT *res = nullptr;
 
         while (cur)
         {
-            if (key < cur->key_) // cur->key_ > key
+            if (comp_(key, cur->key_)) // cur->key_ > key
             {
                 res = cur;
-                cur = (cur->left_is_thread ? nullptr : cur->left_);
+                cur = (cur->left_is_thread() ? nullptr : cur->left());
             }
 
             else
-                cur = (cur->right_is_thread ? nullptr : cur->right_);
+                cur = (cur->right_is_thread() ? nullptr : cur->right());
         }
 
         return res;
     }
 
-    NodeT *find_parent_for_insert_(const KeyT key, bool &insert_left) const
+    // number of keys < key
+    template <typename K>
+    std::size_t count_less_(const K &key) const
+    {
+        const NodeT *cur = root_;
+        std::size_t  cnt = 0;
+
+        while (cur)
+        {
+            if (comp_(cur->key_, key))
+            {
+                cnt += subtree_size(left_child(cur)) + 1;
+                cur  = right_child(cur);
+            }
+            else
+                cur = left_child(cur);
+        }
+
+        return cnt;
+    }
+
+    // number of keys <= key
+    template <typename K>
+    std::size_t count_not_greater_(const K &key) const
+    {
+        const NodeT *cur = root_;
+        std::size_t  cnt = 0;
+
+        while (cur)
+        {
+            if (comp_(key, cur->key_))
+                cur = left_child(cur);
+            else
+            {
+                cnt += subtree_size(left_child(cur)) + 1;
+                cur  = right_child(cur);
+            }
+        }
+
+        return cnt;
+    }
+
+    NodeT *find_parent_for_insert_(const KeyT &key, bool &insert_left, NodeT **equal_node = nullptr) const
+    {
+        return descend_for_insert_(root_, key, insert_left, equal_node);
+    }
+
+    template <typename K>
+    uint64_t range_queries_(const K &key1, const K &key2) const
+    {
+        if (!comp_(key1, key2))
+            return 0;
+
+        return count_not_greater_(key2) - count_less_(key1);
+    }
+
+    // descend to the highest node inside [key1, key2], then follow both
+    // bounds below it: every subtree hanging inside the range is taken whole
+    template <typename K>
+    aggregate_type range_aggregate_(const K &key1, const K &key2) const
+    {
+        static_assert(kAggregated, "the tree has no Aggregate");
+
+        if (!comp_(key1, key2))
+            return Aggregate::identity();
+
+        const NodeT *split = root_;
+        while (split)
+        {
+            if (comp_(split->key_, key1))
+                split = right_child(split);
+            else if (comp_(key2, split->key_))
+                split = left_child(split);
+            else
+                break;
+        }
+
+        if (!split)
+            return Aggregate::identity();
+
+        // keys in [key1, split), gathered from the right
+        aggregate_type left = Aggregate::identity();
+        for (const NodeT *cur = left_child(split); cur;)
+        {
+            if (comp_(cur->key_, key1))
+                cur = right_child(cur);
+            else
+            {
+                left = Aggregate::combine(Aggregate::combine(Aggregate::lift(cur->key_), subtree_aggregate_(right_child(cur))), left);
+                cur  = left_child(cur);
+            }
+        }
+
+        // keys in (split, key2], gathered from the left
+        aggregate_type right = Aggregate::identity();
+        for (const NodeT *cur = right_child(split); cur;)
+        {
+            if (comp_(key2, cur->key_))
+                cur = left_child(cur);
+            else
+            {
+                right = Aggregate::combine(right, Aggregate::combine(subtree_aggregate_(left_child(cur)), Aggregate::lift(cur->key_)));
+                cur   = right_child(cur);
+            }
+        }
+
+        return Aggregate::combine(Aggregate::combine(left, Aggregate::lift(split->key_)), right);
+    }
+
+    // finger search. A key that falls between finger and its in-order
+    // neighbour is placed without searching; otherwise climb from the
+    // neighbour to the lowest ancestor whose subtree must contain key and
+    // descend from there
+    NodeT *find_parent_near_(NodeT *finger, const KeyT &key, bool &insert_left) const
+    {
+        if (comp_(finger->key_, key))
+        {
+            NodeT *successor = inorder_successor(finger);
+
+            if (successor == header_ || comp_(key, successor->key_))
+            {
+                // free slot is finger's right thread or successor's left thread
+                insert_left = !finger->right_is_thread();
+                return insert_left ? successor : finger;
+            }
+
+            if (!comp_(successor->key_, key))
+                return nullptr; // key already exists
+
+            NodeT *current_node = successor;
+            while (current_node != root_)
+            {
+                NodeT *parent_node = current_node->parent();
+
+                if (current_node == left_child(parent_node) && comp_(key, parent_node->key_))
+                    break;
+
+                current_node = parent_node;
+            }
+
+            return descend_for_insert_(current_node, key, insert_left);
+        }
+
+        if (comp_(key, finger->key_))
+        {
+            NodeT *predecessor = inorder_predecessor(finger);
+
+            if (predecessor == header_ || comp_(predecessor->key_, key))
+            {
+                insert_left = finger->left_is_thread();
+                return insert_left ? finger : predecessor;
+            }
+
+            if (!comp_(key, predecessor->key_))
+                return nullptr;
+
+            NodeT *current_node = predecessor;
+            while (current_node != root_)
+            {
+                NodeT *parent_node = current_node->parent();
+
+                if (current_node == right_child(parent_node) && comp_(parent_node->key_, key))
+                    break;
+
+                current_node = parent_node;
+            }
+
+            return descend_for_insert_(current_node, key, insert_left);
+        }
+
+        return nullptr; // key already exists
+    }
+
+    // nullptr if key is already there, *equal_node (when given) is then its node
+    NodeT *descend_for_insert_(NodeT *start_node, const KeyT &key, bool &insert_left,
+                               NodeT **equal_node = nullptr) const
     {
         NodeT *parent_node  = nullptr;
-        NodeT *current_node = root_;
+        NodeT *current_node = start_node;
 
         while (current_node)
         {
             parent_node = current_node;
 
-            if (key < current_node->key_)
+            if (comp_(key, current_node->key_))
             {
                 insert_left = true;
-                if (current_node->left_is_thread)
+                if (current_node->left_is_thread())
                     break;
-                current_node = current_node->left_;
+                current_node = current_node->left();
             }
-            else if (key > current_node->key_)
+            else if (comp_(current_node->key_, key))
             {
                 insert_left = false;
-                if (current_node->right_is_thread)
+                if (current_node->right_is_thread())
                     break;
-                current_node = current_node->right_;
+                current_node = current_node->right();
             }
             else
             {
+                if (equal_node)
+                    *equal_node = current_node;
                 return nullptr; // key already exists
             }
         }
@@ -600,85 +1522,229 @@ private:
         return parent_node;
     }
 
-    NodeT *create_red_node_(const KeyT key, NodeT *parent_node)
+    // links a new red node below parent_node and rebalances, returns the node
+    template <typename K>
+    NodeT *insert_at_(NodeT *parent_node, bool insert_left, K &&key)
     {
-        NodeT *new_node = new NodeT(key, Color::red);
-               new_node->parent_ = parent_node;
+        return link_red_node_(parent_node, insert_left, create_red_node_(std::forward<K>(key), parent_node));
+    }
+
+    NodeT *link_red_node_(NodeT *parent_node, bool insert_left, NodeT *new_node) noexcept
+    {
+        new_node->set_parent(parent_node);
+
+        if (insert_left)
+            attach_as_left_child_(parent_node, new_node);
+        else
+            attach_as_right_child_(parent_node, new_node);
+
+        increment_sizes_upward_(parent_node);
+        fix_insert(new_node);
+        enforce_header_threads_();
 
         return new_node;
     }
 
+    template <typename K>
+    NodeT *create_red_node_(K &&key, NodeT *parent_node)
+    {
+        NodeT *new_node = storage_.create(Color::red, std::forward<K>(key));
+        new_node->set_parent(parent_node);
+        pull_(new_node);
+
+        return new_node;
+    }
+
+    // the node is created only once the key is known to be new
+    template <typename K>
+    std::pair<const_iterator, bool> insert_unique_(K &&key)
+    {
+        reserve_nodes_(1);
+
+        if (!root_)
+        {
+            attach_first_node_(create_red_node_(std::forward<K>(key), nullptr));
+            return {begin(), true};
+        }
+
+        bool   insert_left = false;
+        NodeT *equal_node  = nullptr;
+        NodeT *parent_node = find_parent_for_insert_(key, insert_left, &equal_node);
+
+        if (!parent_node)
+            return {const_iterator(equal_node, header_), false};
+
+        return {const_iterator(insert_at_(parent_node, insert_left, std::forward<K>(key)), header_), true};
+    }
+
+    void destroy_node_(NodeT *node) noexcept
+    {
+        storage_.destroy(node);
+    }
+
     void attach_first_node_(NodeT *new_node) noexcept
     {
         root_        = new_node;
-        root_->color = Color::black;
+        root_->set_color(Color::black);
 
-        header_->parent_ = root_;
-        header_->left_   = root_;
-        header_->right_  = root_;
+        header_->set_parent(root_);
+        header_->set_left(root_);
+        header_->set_right(root_);
 
-        root_->parent_   = header_;
+        root_->set_parent(header_);
 
-        root_->left_           = header_;
-        root_->left_is_thread  = 1;
-        root_->right_          = header_;
-        root_->right_is_thread = 1;
+        root_->set_left(header_);
+        root_->set_left_thread(true);
+        root_->set_right(header_);
+        root_->set_right_thread(true);
     }
 
     void attach_as_left_child_(NodeT *parent_node, NodeT *new_node) noexcept
     {
-        new_node->left_           = parent_node->left_;
-        new_node->left_is_thread  = 1;
-        new_node->right_          = parent_node;
-        new_node->right_is_thread = 1;
+        new_node->set_left(parent_node->left());
+        new_node->set_left_thread(true);
+        new_node->set_right(parent_node);
+        new_node->set_right_thread(true);
 
-        parent_node->left_          = new_node;
-        parent_node->left_is_thread = 0;
+        parent_node->set_left(new_node);
+        parent_node->set_left_thread(false);
 
-        NodeT *predecessor_node = new_node->left_;
+        NodeT *predecessor_node = new_node->left();
         if (predecessor_node == header_)
         {
-            header_->left_ = new_node;
+            header_->set_left(new_node);
         }
-        else if (predecessor_node && predecessor_node->right_is_thread)
+        else if (predecessor_node && predecessor_node->right_is_thread())
         {
-            predecessor_node->right_ = new_node;
+            predecessor_node->set_right(new_node);
         }
     }
 
     void attach_as_right_child_(NodeT *parent_node, NodeT *new_node) noexcept
     {
-        new_node->right_          = parent_node->right_;
-        new_node->right_is_thread = 1;
-        new_node->left_           = parent_node;
-        new_node->left_is_thread  = 1;
+        new_node->set_right(parent_node->right());
+        new_node->set_right_thread(true);
+        new_node->set_left(parent_node);
+        new_node->set_left_thread(true);
 
-        parent_node->right_          = new_node;
-        parent_node->right_is_thread = 0;
+        parent_node->set_right(new_node);
+        parent_node->set_right_thread(false);
 
-        NodeT *successor_node = new_node->right_;
+        NodeT *successor_node = new_node->right();
         if (successor_node == header_)
         {
-            header_->right_ = new_node;
+            header_->set_right(new_node);
         }
-        else if (successor_node && successor_node->left_is_thread)
+        else if (successor_node && successor_node->left_is_thread())
         {
-            successor_node->left_ = new_node;
+            successor_node->set_left(new_node);
         }
     }
 
+    // fills an empty tree: nodes are allocated first (all or nothing),
+    // then linked without any comparisons or rotations
+    template <typename InputIt>
+    void build_from_sorted_(InputIt first, InputIt last)
+    {
+        assert(!root_ && "build_from_sorted_ expects an empty tree");
+
+        using Category = typename std::iterator_traits<InputIt>::iterator_category;
+        constexpr bool kForward = std::is_base_of<std::forward_iterator_tag, Category>::value;
+
+        // nodes may move while the array grows => count the keys first
+        if constexpr (Storage::kNodesMove && !kForward)
+        {
+            const std::vector<KeyT> keys(first, last);
+            build_from_sorted_(keys.begin(), keys.end());
+            return;
+        }
+
+        std::vector<NodeT *> nodes;
+
+        if constexpr (kForward)
+        {
+            const auto count = static_cast<std::size_t>(std::distance(first, last));
+
+            reserve_nodes_(count);
+            nodes.reserve(count);
+        }
+
+        try
+        {
+            for (; first != last; ++first)
+            {
+                if (!nodes.empty() && !comp_(nodes.back()->key_, *first))
+                {
+                    assert(!comp_(*first, nodes.back()->key_) && "keys must be sorted");
+                    continue;
+                }
+
+                nodes.push_back(nullptr);
+                nodes.back() = create_red_node_(*first, nullptr);
+            }
+        }
+        catch (...)
+        {
+            for (NodeT *node : nodes)
+                if (node)
+                    destroy_node_(node);
+            throw;
+        }
+
+        if (nodes.empty())
+            return;
+
+        // levels [0, full_levels) are complete and black, the last partial level is red
+        std::size_t full_levels = 0;
+        while ((std::size_t{2} << full_levels) - 1 <= nodes.size())
+            ++full_levels;
+
+        root_ = link_sorted_(nodes, 0, nodes.size(), header_, 0, full_levels);
+
+        header_->set_parent(root_);
+        header_->set_left(nodes.front());
+        header_->set_right(nodes.back());
+    }
+
+    // median split of nodes[lo, hi): subtree sizes differ by at most one
+    NodeT *link_sorted_(const std::vector<NodeT *> &nodes,
+                        std::size_t lo, std::size_t hi,
+                        NodeT *parent_node, std::size_t depth, std::size_t red_depth) noexcept
+    {
+        if (lo == hi)
+            return nullptr;
+
+        const std::size_t mid  = lo + (hi - lo) / 2;
+        NodeT            *node = nodes[mid];
+
+        node->set_parent(parent_node);
+        node->set_color(depth >= red_depth ? Color::red : Color::black);
+        node->size_   = static_cast<decltype(node->size_)>(hi - lo);
+
+        NodeT *left_node  = link_sorted_(nodes, lo, mid,      node, depth + 1, red_depth);
+        NodeT *right_node = link_sorted_(nodes, mid + 1, hi, node, depth + 1, red_depth);
+
+        node->set_left_thread(!left_node);
+        node->set_left(left_node  ? left_node  : (mid > 0                ? nodes[mid - 1] : header_));
+        node->set_right_thread(!right_node);
+        node->set_right(right_node ? right_node : (mid + 1 < nodes.size() ? nodes[mid + 1] : header_));
+
+        pull_(node);
+        return node;
+    }
+
     void enforce_header_threads_() noexcept
     {
-        if (header_->left_ != header_)
+        if (header_->left() != header_)
         {
-            header_->left_->left_          = header_;
-            header_->left_->left_is_thread = 1;
+            header_->left()->set_left(header_);
+            header_->left()->set_left_thread(true);
         }
 
-        if (header_->right_ != header_)
+        if (header_->right() != header_)
         {
-            header_->right_->right_          = header_;
-            header_->right_->right_is_thread = 1;
+            header_->right()->set_right(header_);
+            header_->right()->set_right_thread(true);
         }
     }
 
@@ -693,11 +1759,38 @@ public:
         return const_iterator(found_node ? found_node : header_, header_);
     }
 
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    const_iterator lower_bound(const K &key) const
+    {
+        NodeT *found_node = lower_bound_node(key);
+        return const_iterator(found_node ? found_node : header_, header_);
+    }
+
     const_iterator upper_bound(const KeyT &key) const
     {
         NodeT *found_node = upper_bound_node(key);
         return const_iterator(found_node ? found_node : header_, header_);
     }
+
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    const_iterator upper_bound(const K &key) const
+    {
+        NodeT *found_node = upper_bound_node(key);
+        return const_iterator(found_node ? found_node : header_, header_);
+    }
+
+    bool contains(const KeyT &key) const
+    {
+        NodeT *found_node = lower_bound_node(key);
+        return found_node && !comp_(key, found_node->key_);
+    }
+
+    template <typename K, typename C = Compare, typename = Transparent_<C>>
+    bool contains(const K &key) const
+    {
+        NodeT *found_node = lower_bound_node(key);
+        return found_node && !comp_(key, found_node->key_);
+    }
 };
 
 }; // namespace Tree
\ No newline at end of file
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "red_black_tree.hpp"
+
+namespace Tree
+{
+
+namespace detail
+{
+
+// parallel_for of Driver::Thread_pool on the calling thread only
+struct Serial_pool
+{
+    unsigned size() const noexcept { return 1; }
+
+    template <typename F>
+    void parallel_for(std::size_t n, F &&f, std::size_t = 1)
+    {
+        if (n)
+            f(std::size_t{0}, n);
+    }
+};
+
+} // namespace detail
+
+// Range-partitioned set of Red_black_tree shards. Shard i holds the keys in
+// [splitters_[i - 1], splitters_[i]), so a bulk insert splits into
+// independent per-shard inserts that run in parallel, each on its own root
+// and its own fix_insert. A range count is the boundary shards' counts plus
+// the sizes of the whole shards between them.
+//
+// Splitters start empty (all keys land in shard 0) and are re-cut at key
+// quantiles whenever a shard grows past kSkewFactor times its fair share.
+// Every shard default-constructs its own allocator, so shards filled by
+// different threads never share an arena.
+//
+// PoolT is anything with Driver::Thread_pool's size() / parallel_for.
+// The container itself is not thread-safe.
+template <typename KeyT, typename Alloc = std::allocator<KeyT>, typename Layout = Pointer_layout>
+class Sharded_tree
+{
+public:
+    using tree_type = Red_black_tree<KeyT, Alloc, Layout>;
+
+    static constexpr std::size_t kDefaultShards = 16;
+
+private:
+    static constexpr std::size_t kSkewFactor      = 2;
+    static constexpr std::size_t kMinKeysPerShard = 1024; // no rebalancing below this
+
+    std::vector<tree_type> shards_;
+    std::vector<KeyT>      splitters_; // empty or shards_.size() - 1 increasing keys
+
+    std::size_t size_       = 0;
+    std::size_t rebalances_ = 0;
+
+    std::size_t shard_of_(const KeyT &key) const
+    {
+        return static_cast<std::size_t>(
+            std::upper_bound(splitters_.begin(), splitters_.end(), key) - splitters_.begin());
+    }
+
+    bool skewed_(std::size_t largest) const noexcept
+    {
+        const std::size_t n = shards_.size();
+        return n > 1 && size_ >= kMinKeysPerShard * n && largest > kSkewFactor * size_ / n;
+    }
+
+    static std::size_t count_not_greater_(const tree_type &shard, const KeyT &key)
+    {
+        const auto it = shard.lower_bound(key);
+        return shard.rank(key) + (it != shard.end() && !(key < *it));
+    }
+
+public:
+    explicit Sharded_tree(std::size_t shards = kDefaultShards)
+        : shards_(std::max<std::size_t>(shards, 1)) {}
+
+    void insert_elem(const KeyT &key)
+    {
+        tree_type &shard = shards_[shard_of_(key)];
+
+        const std::size_t before = shard.size();
+        shard.insert_elem(key);
+        size_ += shard.size() - before;
+
+        if (skewed_(shard.size()))
+            rebalance();
+    }
+
+    // bulk insert: every thread of pool buckets a slice of the input by
+    // shard, then every shard gets its bucket through one insert_range
+    template <typename RandomIt, typename PoolT>
+    void insert_range(RandomIt first, RandomIt last, PoolT &pool)
+    {
+        const std::size_t count  = static_cast<std::size_t>(last - first);
+        const std::size_t shards = shards_.size();
+        const std::size_t parts  = std::max<std::size_t>(1, std::min<std::size_t>(pool.size(), count));
+
+        std::vector<std::vector<std::vector<KeyT>>> buckets(parts, std::vector<std::vector<KeyT>>(shards));
+
+        pool.parallel_for(parts, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t part = begin; part < end; ++part)
+                for (std::size_t i = count * part / parts; i < count * (part + 1) / parts; ++i)
+                    buckets[part][shard_of_(first[i])].push_back(first[i]);
+        }, 1);
+
+        std::vector<std::size_t> added(shards);
+
+        pool.parallel_for(shards, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t s = begin; s < end; ++s)
+            {
+                std::vector<KeyT> keys = std::move(buckets[0][s]);
+                for (std::size_t part = 1; part < parts; ++part)
+                    keys.insert(keys.end(), buckets[part][s].begin(), buckets[part][s].end());
+
+                const std::size_t before = shards_[s].size();
+                shards_[s].insert_range(keys.begin(), keys.end());
+                added[s] = shards_[s].size() - before;
+            }
+        }, 1);
+
+        std::size_t largest = 0;
+        for (std::size_t s = 0; s < shards; ++s)
+        {
+            size_  += added[s];
+            largest = std::max(largest, shards_[s].size());
+        }
+
+        if (skewed_(largest))
+            rebalance(pool);
+    }
+
+    template <typename RandomIt>
+    void insert_range(RandomIt first, RandomIt last)
+    {
+        detail::Serial_pool pool;
+        insert_range(first, last, pool);
+    }
+
+    // removes the key if present, returns the number of removed keys
+    std::size_t erase(const KeyT &key)
+    {
+        const std::size_t removed = shards_[shard_of_(key)].erase(key);
+        size_ -= removed;
+
+        return removed;
+    }
+
+    // re-cuts the splitters at key quantiles and rebuilds every shard, O(n)
+    template <typename PoolT>
+    void rebalance(PoolT &pool)
+    {
+        std::vector<KeyT> keys;
+        keys.reserve(size_);
+        for (const tree_type &shard : shards_)
+            keys.insert(keys.end(), shard.begin(), shard.end());
+
+        const std::size_t n     = shards_.size();
+        const std::size_t total = keys.size();
+
+        // fewer keys than shards would need equal splitters
+        if (n == 1 || total < n)
+            return;
+
+        // keys are unique, so the first key of every slice is a strictly
+        // increasing splitter
+        splitters_.clear();
+        for (std::size_t s = 1; s < n; ++s)
+            splitters_.push_back(keys[total * s / n]);
+
+        pool.parallel_for(n, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t s = begin; s < end; ++s)
+                shards_[s].assign_sorted(keys.begin() + total * s / n, keys.begin() + total * (s + 1) / n);
+        }, 1);
+
+        ++rebalances_;
+    }
+
+    void rebalance()
+    {
+        detail::Serial_pool pool;
+        rebalance(pool);
+    }
+
+    std::size_t size () const noexcept { return size_; }
+    bool        empty() const noexcept { return size_ == 0; }
+
+    // number of keys less than key
+    std::size_t rank(const KeyT &key) const
+    {
+        const std::size_t s = shard_of_(key);
+
+        std::size_t less = shards_[s].rank(key);
+        for (std::size_t i = 0; i < s; ++i)
+            less += shards_[i].size();
+
+        return less;
+    }
+
+    bool contains(const KeyT &key) const
+    {
+        const tree_type &shard = shards_[shard_of_(key)];
+        const auto it = shard.lower_bound(key);
+
+        return it != shard.end() && !(key < *it);
+    }
+
+    // same contract as Red_black_tree::range_queries
+    uint64_t range_queries(const KeyT &key1, const KeyT &key2) const
+    {
+        if (!(key1 < key2))
+            return 0;
+
+        const std::size_t first = shard_of_(key1);
+        const std::size_t last  = shard_of_(key2);
+
+        if (first == last)
+            return shards_[first].range_queries(key1, key2);
+
+        uint64_t cnt = shards_[first].size() - shards_[first].rank(key1);
+        for (std::size_t s = first + 1; s < last; ++s)
+            cnt += shards_[s].size();
+
+        return cnt + count_not_greater_(shards_[last], key2);
+    }
+
+    std::size_t      shards    () const noexcept { return shards_.size(); }
+    const tree_type &shard     (std::size_t i) const { return shards_[i]; }
+    std::size_t      rebalances() const noexcept { return rebalances_; }
+};
+
+} // namespace Tree
@@ -0,0 +1,730 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+
+#include "frozen_set.hpp"
+
+namespace Tree
+{
+
+namespace detail
+{
+
+struct Skip_level
+{
+    std::atomic<std::uintptr_t> next_{0};  // successor, low bit = owner is erased on this level
+    std::atomic<std::size_t>    count_{1}; // keys in [owner, next_), see Skip_list
+};
+
+// the head has levels only, every other tower is a Skip_node
+struct Skip_tower
+{
+    Skip_level *levels_     = nullptr;
+    unsigned    height_     = 0;
+    Skip_tower *next_alloc_ = nullptr; // every node ever linked, for cleanup
+};
+
+template <typename KeyT>
+struct Skip_node : Skip_tower
+{
+    KeyT key_;
+
+    explicit Skip_node(const KeyT &key) : key_(key) {}
+};
+
+} // namespace detail
+
+// Lock-free ordered set with the query surface of Red_black_tree, for
+// write-heavy ingest from many threads where a tree with global rebalancing
+// would need a lock. Insert and erase follow Herlihy and Shavit: a key is
+// linked bottom-up by CAS, erased by marking its links top-down, and marked
+// nodes are unlinked by whoever walks past them. Lookups never write.
+//
+// Every link also carries the number of keys it skips (the head counts as
+// one phantom key), so rank, select and range_queries descend in
+// O(log n) like the tree does with subtree sizes. Moving a split of these
+// counts between two nodes is not one atomic step, so they are kept exact
+// only while one writer at a time runs; readers may run alongside and see
+// an update half counted. Once two writers overlap the counts are marked
+// stale, the order queries fall back to walking the bottom level, and
+// recount() (with no concurrent users) restores them in O(n).
+//
+// Unlinked nodes are not freed while other threads may still stand on
+// them: they stay allocated until reclaim(), assign_sorted() or the
+// destructor. Alloc must be thread-safe if several threads write.
+template <typename KeyT, typename Alloc = std::allocator<KeyT>>
+class Skip_list
+{
+    using NodeT = detail::Skip_node<KeyT>;
+    using Tower = detail::Skip_tower;
+    using Level = detail::Skip_level;
+
+    using NodeAlloc   = typename std::allocator_traits<Alloc>::template rebind_alloc<NodeT>;
+    using NodeTraits  = std::allocator_traits<NodeAlloc>;
+    using LevelAlloc  = typename std::allocator_traits<Alloc>::template rebind_alloc<Level>;
+    using LevelTraits = std::allocator_traits<LevelAlloc>;
+
+public:
+    // p = 1/4 per level: 16 levels index 4^16 keys
+    static constexpr unsigned kMaxLevel = 16;
+
+    // range_queries_batch is a plain loop, the driver gains nothing from
+    // collecting query runs on one thread
+    static constexpr bool kBatchesQueries = false;
+
+private:
+    static constexpr std::uintptr_t kMark = 1;
+
+    NodeAlloc  node_alloc_;
+    LevelAlloc level_alloc_;
+
+    Level head_levels_[kMaxLevel];
+    Tower head_;
+
+    std::atomic<unsigned>    top_{1};        // levels in use, never shrinks
+    std::atomic<std::size_t> size_{0};
+    std::atomic<unsigned>    writers_{0};    // writers inside insert/erase
+    std::atomic<bool>        stale_{false};  // counts are not trusted
+    std::atomic<Tower*>      allocated_{nullptr};
+
+    static Tower *ptr_(std::uintptr_t link) noexcept
+    {
+        return reinterpret_cast<Tower*>(link & ~kMark);
+    }
+
+    static bool marked_(std::uintptr_t link) noexcept { return link & kMark; }
+
+    static std::uintptr_t link_(const Tower *node) noexcept
+    {
+        return reinterpret_cast<std::uintptr_t>(node);
+    }
+
+    static const KeyT &key_of_(const Tower *node) noexcept
+    {
+        return static_cast<const NodeT*>(node)->key_;
+    }
+
+    static Tower *next_(const Tower *node, unsigned level) noexcept
+    {
+        return ptr_(node->levels_[level].next_.load(std::memory_order_acquire));
+    }
+
+    static std::size_t count_(const Tower *node, unsigned level) noexcept
+    {
+        return node->levels_[level].count_.load(std::memory_order_relaxed);
+    }
+
+    // overlapping writers make the counts stale until recount()
+    class Write_guard
+    {
+        Skip_list &list_;
+
+    public:
+        explicit Write_guard(Skip_list &list) : list_(list)
+        {
+            if (list_.writers_.fetch_add(1) != 0)
+                list_.stale_.store(true);
+        }
+
+        ~Write_guard() { list_.writers_.fetch_sub(1); }
+
+        Write_guard(const Write_guard &)            = delete;
+        Write_guard &operator=(const Write_guard &) = delete;
+    };
+
+    static unsigned random_height_() noexcept
+    {
+        // splitmix64, seeded per thread
+        static std::atomic<uint64_t> seeds{0x9e3779b97f4a7c15ull};
+        thread_local uint64_t state = seeds.fetch_add(0x9e3779b97f4a7c15ull);
+
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+
+        unsigned height = 1;
+        while (height < kMaxLevel && (z & 3) == 0)
+        {
+            ++height;
+            z >>= 2;
+        }
+
+        return height;
+    }
+
+    // Level slots in front of the levels that hold the node itself
+    static constexpr std::size_t kHeaderSlots = (sizeof(NodeT) + sizeof(Level) - 1) / sizeof(Level);
+
+    static_assert(alignof(NodeT) <= alignof(Level), "keys with extended alignment are not supported");
+
+    // the node and its levels in one block: a step along a level touches
+    // the key and the next link together
+    NodeT *create_node_(const KeyT &key, unsigned height)
+    {
+        Level *block = LevelTraits::allocate(level_alloc_, kHeaderSlots + height);
+
+        NodeT *node = reinterpret_cast<NodeT*>(block);
+        try
+        {
+            NodeTraits::construct(node_alloc_, node, key);
+        }
+        catch (...)
+        {
+            LevelTraits::deallocate(level_alloc_, block, kHeaderSlots + height);
+            throw;
+        }
+
+        Level *levels = block + kHeaderSlots;
+        for (unsigned l = 0; l < height; ++l)
+            LevelTraits::construct(level_alloc_, levels + l);
+
+        node->levels_ = levels;
+        node->height_ = height;
+
+        return node;
+    }
+
+    void destroy_node_(Tower *tower) noexcept
+    {
+        NodeT *node = static_cast<NodeT*>(tower);
+        const unsigned height = node->height_;
+
+        for (unsigned l = 0; l < height; ++l)
+            LevelTraits::destroy(level_alloc_, node->levels_ + l);
+        NodeTraits::destroy(node_alloc_, node);
+
+        LevelTraits::deallocate(level_alloc_, reinterpret_cast<Level*>(node), kHeaderSlots + height);
+    }
+
+    void remember_(Tower *node) noexcept
+    {
+        Tower *old = allocated_.load(std::memory_order_relaxed);
+        do
+            node->next_alloc_ = old;
+        while (!allocated_.compare_exchange_weak(old, node, std::memory_order_release,
+                                                           std::memory_order_relaxed));
+    }
+
+    // preds[l] / succs[l] around key on every level, marked nodes on the way
+    // are unlinked; true if an unerased key is found
+    bool find_(const KeyT &key, Tower **preds, Tower **succs)
+    {
+    retry:
+        Tower *pred = &head_;
+
+        for (unsigned l = kMaxLevel; l-- > 0;)
+        {
+            Tower *curr = next_(pred, l);
+
+            while (curr)
+            {
+                std::uintptr_t succ = curr->levels_[l].next_.load(std::memory_order_acquire);
+
+                while (marked_(succ))
+                {
+                    std::uintptr_t expected = link_(curr);
+                    if (!pred->levels_[l].next_.compare_exchange_strong(expected, link_(ptr_(succ))))
+                        goto retry;
+
+                    curr = ptr_(succ);
+                    if (!curr)
+                        break;
+
+                    succ = curr->levels_[l].next_.load(std::memory_order_acquire);
+                }
+
+                if (!curr || !(key_of_(curr) < key))
+                    break;
+
+                pred = curr;
+                curr = ptr_(succ);
+            }
+
+            preds[l] = pred;
+            succs[l] = curr;
+        }
+
+        return succs[0] && !(key < key_of_(succs[0]));
+    }
+
+    // first node with !(key_of_(node) < key) (or key < key_of_(node) if
+    // strict), erased nodes skipped; nullptr = none
+    Tower *lower_node_(const KeyT &key, bool strict) const noexcept
+    {
+        const Tower *pred = &head_;
+
+        for (unsigned l = top_.load(std::memory_order_acquire); l-- > 0;)
+            for (Tower *next = next_(pred, l);
+                 next && (strict ? !(key < key_of_(next)) : key_of_(next) < key);
+                 next = next_(pred, l))
+                pred = next;
+
+        Tower *node = next_(pred, 0);
+        while (node && marked_(node->levels_[0].next_.load(std::memory_order_acquire)))
+            node = next_(node, 0);
+
+        return node;
+    }
+
+    // index of the last key < key (or <= key if inclusive), the head is 0
+    std::size_t count_before_(const KeyT &key, bool inclusive) const noexcept
+    {
+        const Tower *node = &head_;
+        std::size_t  pos  = 0;
+
+        for (unsigned l = top_.load(std::memory_order_acquire); l-- > 0;)
+            for (Tower *next = next_(node, l);
+                 next && (inclusive ? !(key < key_of_(next)) : key_of_(next) < key);
+                 next = next_(node, l))
+            {
+                pos += count_(node, l);
+                node = next;
+            }
+
+        return pos;
+    }
+
+    // the same by walking the bottom level, for stale counts
+    std::size_t walk_count_before_(const KeyT &key, bool inclusive) const noexcept
+    {
+        std::size_t pos = 0;
+        for (auto it = begin(); it != end() && (inclusive ? !(key < *it) : *it < key); ++it)
+            ++pos;
+
+        return pos;
+    }
+
+    void raise_top_(unsigned height) noexcept
+    {
+        unsigned top = top_.load();
+
+        while (top < height)
+        {
+            // the head's new levels skip every key
+            if (!stale_.load())
+                for (unsigned l = top; l < height; ++l)
+                    head_.levels_[l].count_.store(size_.load() + 1, std::memory_order_relaxed);
+
+            if (top_.compare_exchange_weak(top, height))
+                break;
+        }
+    }
+
+    // counts for a node just linked with the preds of the insert
+    void count_insert_(Tower *node, Tower *const *preds, Tower *const *succs) noexcept
+    {
+        const unsigned height = node->height_;
+        const unsigned top    = top_.load();
+
+        for (unsigned l = 1; l < height; ++l)
+        {
+            // the keys from node up to its successor move out of pred's link
+            std::size_t moved = 0;
+            for (const Tower *cur = node; cur != succs[l]; cur = next_(cur, l - 1))
+                moved += count_(cur, l - 1);
+
+            node->levels_[l].count_.store(moved, std::memory_order_relaxed);
+            preds[l]->levels_[l].count_.fetch_add(1 - moved, std::memory_order_relaxed);
+        }
+
+        for (unsigned l = height; l < top; ++l)
+            preds[l]->levels_[l].count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_erase_(Tower *node, Tower *const *preds) noexcept
+    {
+        const unsigned height = node->height_;
+        const unsigned top    = top_.load();
+
+        for (unsigned l = 1; l < height; ++l)
+            preds[l]->levels_[l].count_.fetch_add(count_(node, l) - 1, std::memory_order_relaxed);
+
+        for (unsigned l = height; l < top; ++l)
+            preds[l]->levels_[l].count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // unlinks marked nodes everywhere; no concurrent users
+    void unlink_marked_() noexcept
+    {
+        for (unsigned l = 0; l < kMaxLevel; ++l)
+        {
+            Tower *pred = &head_;
+            while (Tower *curr = next_(pred, l))
+            {
+                const std::uintptr_t succ = curr->levels_[l].next_.load();
+                if (marked_(succ))
+                    pred->levels_[l].next_.store(link_(ptr_(succ)));
+                else
+                    pred = curr;
+            }
+        }
+    }
+
+    void free_all_() noexcept
+    {
+        for (Tower *node = allocated_.exchange(nullptr); node;)
+        {
+            Tower *next = node->next_alloc_;
+            destroy_node_(node);
+            node = next;
+        }
+    }
+
+    void reset_head_() noexcept
+    {
+        for (Level &level : head_levels_)
+        {
+            level.next_.store(0);
+            level.count_.store(1);
+        }
+
+        top_.store(1);
+        size_.store(0);
+        stale_.store(false);
+    }
+
+public:
+    class const_iterator
+    {
+        const Skip_list *list_ = nullptr;
+        const Tower     *node_ = nullptr;
+
+        friend class Skip_list;
+
+        const_iterator(const Skip_list *list, const Tower *node) : list_(list), node_(node) {}
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type        = KeyT;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const KeyT*;
+        using reference         = const KeyT&;
+
+        const_iterator() = default;
+
+        reference operator* () const { return  key_of_(node_); }
+        pointer   operator->() const { return &key_of_(node_); }
+
+        const_iterator &operator++()
+        {
+            do
+                node_ = next_(node_, 0);
+            while (node_ && marked_(node_->levels_[0].next_.load(std::memory_order_acquire)));
+
+            return *this;
+        }
+
+        // O(log n): a search for the last key before this one
+        const_iterator &operator--()
+        {
+            const Tower *pred = &list_->head_;
+
+            for (unsigned l = list_->top_.load(std::memory_order_acquire); l-- > 0;)
+                for (Tower *next = next_(pred, l);
+                     next && (!node_ || key_of_(next) < key_of_(node_));
+                     next = next_(pred, l))
+                    pred = next;
+
+            node_ = pred;
+            return *this;
+        }
+
+        const_iterator operator++(int) { auto old = *this; ++*this; return old; }
+        const_iterator operator--(int) { auto old = *this; --*this; return old; }
+
+        friend bool operator==(const const_iterator &lhs, const const_iterator &rhs) { return lhs.node_ == rhs.node_; }
+        friend bool operator!=(const const_iterator &lhs, const const_iterator &rhs) { return lhs.node_ != rhs.node_; }
+    };
+
+    Skip_list() : Skip_list(Alloc()) {}
+
+    explicit Skip_list(const Alloc &alloc) : node_alloc_(alloc), level_alloc_(alloc)
+    {
+        head_.levels_ = head_levels_;
+        head_.height_ = kMaxLevel;
+    }
+
+    Skip_list(const Skip_list &)            = delete;
+    Skip_list &operator=(const Skip_list &) = delete;
+
+    ~Skip_list() { free_all_(); }
+
+    // thread-safe, false if the key is already there
+    bool insert_elem(const KeyT &key)
+    {
+        Write_guard guard(*this);
+
+        Tower *preds[kMaxLevel];
+        Tower *succs[kMaxLevel];
+
+        if (find_(key, preds, succs))
+            return false;
+
+        const unsigned height = random_height_();
+        NodeT *node = create_node_(key, height);
+
+        for (;;)
+        {
+            for (unsigned l = 0; l < height; ++l)
+                node->levels_[l].next_.store(link_(succs[l]), std::memory_order_relaxed);
+
+            raise_top_(height);
+
+            std::uintptr_t expected = link_(succs[0]);
+            if (preds[0]->levels_[0].next_.compare_exchange_strong(expected, link_(node)))
+                break;
+
+            if (find_(key, preds, succs))
+            {
+                destroy_node_(node);
+                return false;
+            }
+        }
+
+        remember_(node);
+        size_.fetch_add(1);
+
+        for (unsigned l = 1; l < height; ++l)
+            for (;;)
+            {
+                std::uintptr_t expected = link_(succs[l]);
+                if (preds[l]->levels_[l].next_.compare_exchange_strong(expected, link_(node)))
+                    break;
+
+                find_(key, preds, succs);
+
+                // re-aim the node's own link, unless it is being erased
+                std::uintptr_t own = node->levels_[l].next_.load();
+                if (marked_(own) || !node->levels_[l].next_.compare_exchange_strong(own, link_(succs[l])))
+                    return true;
+            }
+
+        if (!stale_.load())
+            count_insert_(node, preds, succs);
+
+        return true;
+    }
+
+    template <typename InputIt>
+    void insert_range(InputIt first, InputIt last)
+    {
+        for (; first != last; ++first)
+            insert_elem(*first);
+    }
+
+    // thread-safe, returns the number of removed keys
+    std::size_t erase(const KeyT &key)
+    {
+        Write_guard guard(*this);
+
+        Tower *preds[kMaxLevel];
+        Tower *succs[kMaxLevel];
+
+        if (!find_(key, preds, succs))
+            return 0;
+
+        Tower *victim = succs[0];
+
+        for (unsigned l = victim->height_; l-- > 1;)
+        {
+            std::uintptr_t succ = victim->levels_[l].next_.load();
+            while (!marked_(succ) && !victim->levels_[l].next_.compare_exchange_weak(succ, succ | kMark))
+                ;
+        }
+
+        // whoever marks the bottom level erases the key
+        std::uintptr_t succ = victim->levels_[0].next_.load();
+        for (;;)
+        {
+            if (marked_(succ))
+                return 0;
+
+            if (victim->levels_[0].next_.compare_exchange_weak(succ, succ | kMark))
+                break;
+        }
+
+        size_.fetch_sub(1);
+
+        if (!stale_.load())
+            count_erase_(victim, preds);
+
+        find_(key, preds, succs);
+        return 1;
+    }
+
+    // replaces the contents with sorted keys in O(n), no concurrent users;
+    // equal neighbours are collapsed into one key
+    template <typename InputIt>
+    void assign_sorted(InputIt first, InputIt last)
+    {
+        free_all_();
+        reset_head_();
+
+        Tower *tails[kMaxLevel];
+        for (Tower *&tail : tails)
+            tail = &head_;
+
+        unsigned    top  = 1;
+        std::size_t size = 0;
+
+        for (; first != last; ++first)
+        {
+            if (tails[0] != &head_ && !(key_of_(tails[0]) < *first))
+                continue;
+
+            const unsigned height = random_height_();
+            NodeT *node = create_node_(*first, height);
+            remember_(node);
+
+            for (unsigned l = 0; l < height; ++l)
+            {
+                tails[l]->levels_[l].next_.store(link_(node), std::memory_order_relaxed);
+                tails[l] = node;
+            }
+
+            top = std::max(top, height);
+            ++size;
+        }
+
+        top_.store(top);
+        size_.store(size);
+        recount();
+    }
+
+    // rebuilds stale counts in O(n), no concurrent users
+    void recount() noexcept
+    {
+        unlink_marked_();
+
+        const unsigned top = top_.load();
+        for (unsigned l = 1; l < top; ++l)
+            for (Tower *node = &head_; node;)
+            {
+                Tower      *next  = next_(node, l);
+                std::size_t count = 0;
+
+                for (const Tower *cur = node; cur != next; cur = next_(cur, l - 1))
+                    count += count_(cur, l - 1);
+
+                node->levels_[l].count_.store(count, std::memory_order_relaxed);
+                node = next;
+            }
+
+        stale_.store(false);
+    }
+
+    bool counts_exact() const noexcept { return !stale_.load(); }
+
+    // frees erased nodes, no concurrent users
+    void reclaim() noexcept
+    {
+        unlink_marked_();
+
+        Tower *keep = nullptr;
+        for (Tower *node = allocated_.exchange(nullptr); node;)
+        {
+            Tower *next = node->next_alloc_;
+
+            if (marked_(node->levels_[0].next_.load()))
+                destroy_node_(node);
+            else
+            {
+                node->next_alloc_ = keep;
+                keep = node;
+            }
+
+            node = next;
+        }
+
+        allocated_.store(keep);
+    }
+
+    const_iterator begin() const
+    {
+        const_iterator it(this, &head_);
+        return ++it;
+    }
+
+    const_iterator end() const { return const_iterator(this, nullptr); }
+
+    std::size_t size () const noexcept { return size_.load(std::memory_order_relaxed); }
+    bool        empty() const noexcept { return size() == 0; }
+
+    const_iterator lower_bound(const KeyT &key) const { return const_iterator(this, lower_node_(key, false)); }
+    const_iterator upper_bound(const KeyT &key) const { return const_iterator(this, lower_node_(key, true)); }
+
+    bool contains(const KeyT &key) const
+    {
+        const Tower *node = lower_node_(key, false);
+        return node && !(key < key_of_(node));
+    }
+
+    // number of keys less than key
+    std::size_t rank(const KeyT &key) const
+    {
+        return stale_.load() ? walk_count_before_(key, false) : count_before_(key, false);
+    }
+
+    // k-th smallest key (1-based), end() if k is out of range
+    const_iterator select(std::size_t k) const
+    {
+        if (k == 0 || k > size())
+            return end();
+
+        if (stale_.load())
+        {
+            auto it = begin();
+            while (--k && it != end())
+                ++it;
+            return it;
+        }
+
+        const Tower *node = &head_;
+        std::size_t  pos  = 0;
+
+        for (unsigned l = top_.load(std::memory_order_acquire); l-- > 0;)
+            for (Tower *next = next_(node, l); next && pos + count_(node, l) <= k; next = next_(node, l))
+            {
+                pos += count_(node, l);
+                node = next;
+            }
+
+        return (pos == k && node != &head_) ? const_iterator(this, node) : end();
+    }
+
+    // same contract as Red_black_tree::range_queries
+    uint64_t range_queries(const KeyT &key1, const KeyT &key2) const
+    {
+        if (!(key1 < key2))
+            return 0;
+
+        if (!stale_.load())
+            return count_before_(key2, true) - count_before_(key1, false);
+
+        uint64_t cnt = 0;
+        for (auto it = lower_bound(key1); it != end() && !(key2 < *it); ++it)
+            ++cnt;
+
+        return cnt;
+    }
+
+    template <typename ForwardIt, typename OutIt>
+    void range_queries_batch(ForwardIt first, ForwardIt last, OutIt out) const
+    {
+        for (; first != last; ++first, ++out)
+            *out = range_queries(first->first, first->second);
+    }
+
+    Frozen_set<KeyT> freeze() const
+    {
+        return Frozen_set<KeyT>(begin(), end());
+    }
+};
+
+} // namespace Tree
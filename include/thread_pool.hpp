@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Driver
+{
+
+// Fixed set of worker threads for data-parallel loops. parallel_for cuts
+// [0, n) into contiguous chunks, one per thread (the caller takes the first),
+// and returns when all of them are done: static chunking is enough for
+// query runs, where every item costs about the same.
+class Thread_pool
+{
+    std::vector<std::thread> workers_;
+
+    std::mutex              mtx_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+
+    std::function<void(std::size_t)> task_; // task_(part)
+    std::size_t parts_      = 0;
+    std::size_t generation_ = 0;
+    std::size_t pending_    = 0;
+    bool        stop_       = false;
+
+    std::exception_ptr error_;
+
+    void worker_loop_(std::size_t part)
+    {
+        std::size_t seen = 0;
+
+        for (;;)
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+
+            if (stop_)
+                return;
+
+            seen = generation_;
+            const bool has_work = part < parts_;
+            lock.unlock();
+
+            std::exception_ptr error;
+            if (has_work)
+            {
+                try
+                {
+                    task_(part);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+            }
+
+            lock.lock();
+            if (error && !error_)
+                error_ = error;
+
+            if (--pending_ == 0)
+                done_cv_.notify_one();
+        }
+    }
+
+public:
+    // default for parallel_for: smaller chunks of cheap items cost more to
+    // hand out than to compute in place
+    static constexpr std::size_t kMinChunk = 256;
+
+    explicit Thread_pool(unsigned threads)
+    {
+        for (unsigned i = 1; i < threads; ++i)
+            workers_.emplace_back([this, i] { worker_loop_(i); });
+    }
+
+    Thread_pool(const Thread_pool &)            = delete;
+    Thread_pool &operator=(const Thread_pool &) = delete;
+
+    ~Thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+
+        start_cv_.notify_all();
+
+        for (auto &worker : workers_)
+            worker.join();
+    }
+
+    unsigned size() const noexcept { return static_cast<unsigned>(workers_.size() + 1); }
+
+    // f(begin, end) for contiguous pieces of at least min_chunk items
+    // covering [0, n); the first exception thrown by any piece is rethrown here
+    template <typename F>
+    void parallel_for(std::size_t n, F &&f, std::size_t min_chunk = kMinChunk)
+    {
+        const std::size_t parts = std::min<std::size_t>(size(), n / std::max<std::size_t>(min_chunk, 1));
+
+        if (parts <= 1)
+        {
+            if (n)
+                f(std::size_t{0}, n);
+            return;
+        }
+
+        auto run_part = [&f, n, parts](std::size_t part)
+        {
+            f(n * part / parts, n * (part + 1) / parts);
+        };
+
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            task_    = run_part;
+            parts_   = parts;
+            pending_ = workers_.size();
+            error_   = nullptr;
+            ++generation_;
+        }
+
+        start_cv_.notify_all();
+
+        std::exception_ptr error;
+        try
+        {
+            run_part(0);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        std::unique_lock<std::mutex> lock(mtx_);
+        done_cv_.wait(lock, [this] { return pending_ == 0; });
+
+        task_ = nullptr;
+        if (!error)
+            error = error_;
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+} // namespace Driver
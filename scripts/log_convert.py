@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Converter between the text command log and the binary one.
+
+Binary layout (read by Driver::Binary_reader, rb_tree --binary-input):
+    header  : 8 bytes b"RBTLOG\\x00\\x01"
+    command : opcode byte (ASCII 'k', 'd', 'm', 'n' or 'q'),
+              then 1 operand (2 for 'q') as a zigzag LEB128 varint
+"""
+import argparse
+import sys
+from pathlib import Path
+from typing import Iterator, List, Tuple
+
+MAGIC = b"RBTLOG\x00\x01"
+
+OPERANDS = {"k": 1, "d": 1, "m": 1, "n": 1, "q": 2}
+
+INT64_MIN = -(1 << 63)
+INT64_MAX = (1 << 63) - 1
+MASK64 = (1 << 64) - 1
+
+
+def parse_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(
+        description="Convert rb_tree command logs between text and binary formats"
+    )
+    parser.add_argument("input", help="Input log file")
+    parser.add_argument("output", help="Output log file")
+    parser.add_argument(
+        "--to-text", action="store_true",
+        help="Binary -> text (default: text -> binary)"
+    )
+    return parser.parse_args()
+
+
+def zigzag(value: int) -> int:
+    return ((value << 1) ^ (value >> 63)) & MASK64
+
+
+def unzigzag(value: int) -> int:
+    return (value >> 1) ^ -(value & 1)
+
+
+def put_varint(out: bytearray, value: int) -> None:
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+
+
+def text_commands(text: str) -> Iterator[Tuple[str, List[int]]]:
+    """Same grammar as Driver::Stream_reader: a mode letter, then numbers."""
+    tokens = text.split()
+    pos = 0
+    while pos < len(tokens):
+        token = tokens[pos]
+        mode, rest = token[0], token[1:]
+        pos += 1
+
+        if mode not in OPERANDS:
+            raise SystemExit(f"ERROR: unknown mode '{mode}'")
+
+        raw = [rest] if rest else []
+        while len(raw) < OPERANDS[mode]:
+            if pos == len(tokens):
+                raise SystemExit(f"ERROR: expected number after '{mode}'")
+            raw.append(tokens[pos])
+            pos += 1
+
+        try:
+            operands = [int(x) for x in raw]
+        except ValueError:
+            raise SystemExit(f"ERROR: expected number after '{mode}'")
+
+        for x in operands:
+            if not INT64_MIN <= x <= INT64_MAX:
+                raise SystemExit(f"ERROR: {x} does not fit into int64")
+
+        yield mode, operands
+
+
+def to_binary(text: str) -> bytes:
+    out = bytearray(MAGIC)
+    for mode, operands in text_commands(text):
+        out.append(ord(mode))
+        for x in operands:
+            put_varint(out, zigzag(x))
+    return bytes(out)
+
+
+def to_text(data: bytes) -> str:
+    if data[:len(MAGIC)] != MAGIC:
+        raise SystemExit("ERROR: not a binary command log (bad header)")
+
+    lines = []
+    pos = len(MAGIC)
+    while pos < len(data):
+        mode = chr(data[pos])
+        pos += 1
+        if mode not in OPERANDS:
+            raise SystemExit(f"ERROR: unknown opcode {ord(mode)} at byte {pos - 1}")
+
+        operands = []
+        for _ in range(OPERANDS[mode]):
+            value, shift = 0, 0
+            while True:
+                if pos == len(data):
+                    raise SystemExit("ERROR: truncated varint")
+                byte = data[pos]
+                pos += 1
+                # same bound as Binary_reader: the 10th byte holds only bit 63
+                if shift == 63 and byte > 1:
+                    raise SystemExit(f"ERROR: over-long varint at byte {pos - 1}")
+                value |= (byte & 0x7F) << shift
+                shift += 7
+                if byte < 0x80:
+                    break
+            operands.append(unzigzag(value))
+
+        lines.append(" ".join([mode] + [str(x) for x in operands]))
+
+    return "\n".join(lines) + ("\n" if lines else "")
+
+
+def main() -> None:
+    args = parse_args()
+    in_path = Path(args.input)
+    out_path = Path(args.output)
+
+    if not in_path.exists():
+        print(f"[ERROR] input file not found: {in_path}", file=sys.stderr)
+        sys.exit(2)
+
+    if args.to_text:
+        out_path.write_text(to_text(in_path.read_bytes()), encoding="utf-8")
+    else:
+        out_path.write_bytes(to_binary(in_path.read_text(encoding="utf-8")))
+
+    print(f"[log_convert] {in_path} ({in_path.stat().st_size} bytes) -> "
+          f"{out_path} ({out_path.stat().st_size} bytes)")
+
+
+if __name__ == "__main__":
+    main()
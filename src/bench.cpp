@@ -2,45 +2,124 @@
 #include <cstdint>
 #include <set>
 #include <chrono>
+#include <cmath>
 #include <algorithm>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 #include "cxxopts.hpp"
+#include "arena_allocator.hpp"
 #include "red_black_tree.hpp"
+#include "skip_list.hpp"
 #include "driver.hpp"
+#include "latency_histogram.hpp"
+#include "perf_counters.hpp"
 
-using TreeT = Tree::Red_black_tree<int64_t>;
+using TreeT         = Tree::Red_black_tree<int64_t, Tree::Arena_allocator<int64_t>>;
+using Compact_treeT = Tree::Red_black_tree<int64_t, std::allocator<int64_t>, Tree::Compact_layout>;
+using Skip_listT    = Tree::Skip_list<int64_t>;
 using Clock = std::chrono::steady_clock;
 using ns    = std::chrono::nanoseconds;
 using us    = std::chrono::microseconds;
 
-static long long get_bench_batch_arg(int argc, char** argv, long long def_val)
+struct Bench_args
+{
+    long long           batch;
+    std::string         layout;
+    std::string         structure;
+    std::size_t         latency_sample;
+    std::string         perf_ops;
+    bool                tree_stats;
+    Driver::Run_options run;
+};
+
+static Bench_args get_bench_args(int argc, char** argv, long long def_batch)
 {
     cxxopts::Options options("rb_tree_bench", "RB-tree benchmark");
 
     options.add_options()
         ("bench-batch",
          "Batch size for benchmark",
-         cxxopts::value<long long>()->default_value(std::to_string(def_val)));
+         cxxopts::value<long long>()->default_value(std::to_string(def_batch)))
+        ("layout",
+         "Node layout of the tree: pointer or compact",
+         cxxopts::value<std::string>()->default_value("pointer"))
+        ("freeze-after",
+         "Answer queries from a frozen snapshot after N reads in a row (0 = off)",
+         cxxopts::value<std::size_t>()->default_value("0"))
+        ("fast-input",
+         "Parse stdin with the read(2) tokenizer instead of std::cin")
+        ("binary-input",
+         "Replay a binary command log (scripts/log_convert.py) instead of stdin",
+         cxxopts::value<std::string>())
+        ("threads",
+         "Answer runs of q commands on this many threads",
+         cxxopts::value<unsigned>()->default_value("1"))
+        ("structure",
+         "Ordered set to run on: rbtree or skiplist (--layout applies to rbtree)",
+         cxxopts::value<std::string>()->default_value("rbtree"))
+        ("latency-sample",
+         "Time every N-th op alone for the latency percentiles (1 = every op, 0 = off)",
+         cxxopts::value<std::size_t>()->default_value("16"))
+        ("perf-counters",
+         "Hardware counters per op for: insert,erase,query,order or all (empty = off)",
+         cxxopts::value<std::string>()->default_value(""))
+        ("tree-stats",
+         "Print the shape of the final tree and, with RBTREE_STATS, its rebalancing work");
 
     auto result = options.parse(argc, argv);
 
-    return result["bench-batch"].as<long long>();
+    Bench_args args{result["bench-batch"].as<long long>(),
+                    result["layout"].as<std::string>(),
+                    result["structure"].as<std::string>(),
+                    result["latency-sample"].as<std::size_t>(),
+                    result["perf-counters"].as<std::string>(),
+                    result.count("tree-stats") > 0, {}};
+    args.run.freeze_after = result["freeze-after"].as<std::size_t>();
+    args.run.fast_input   = result.count("fast-input") > 0;
+    args.run.threads      = std::max(1u, result["threads"].as<unsigned>());
+
+    if (result.count("binary-input"))
+        args.run.binary_input = result["binary-input"].as<std::string>();
+
+    return args;
 }
 
+// total time of batches of ops; every sample_every_-th op is also timed on
+// its own into hist_ (0 = no per-op sampling). A sampled op adds two clock
+// reads to its batch.
 struct Batch_timer
 {
     std::size_t in_batch_ = 0;
     ns total_{0};
     Clock::time_point t0_{};
 
+    std::size_t       sample_every_ = 0;
+    std::size_t       seen_         = 0;
+    bool              sampling_     = false;
+    Clock::time_point op_t0_{};
+
+    Driver::Latency_histogram hist_;
+
     void start()
     {
         if (in_batch_ == 0)
             t0_ = Clock::now();
+
+        sampling_ = sample_every_ && ++seen_ % sample_every_ == 0;
+        if (sampling_)
+            op_t0_ = Clock::now();
     }
 
     void stop(std::size_t batch_sz)
     {
+        if (sampling_)
+            hist_.record(static_cast<uint64_t>(std::chrono::duration_cast<ns>(Clock::now() - op_t0_).count()));
+
         if (++in_batch_ == batch_sz)
         {
             total_ += std::chrono::duration_cast<ns>(Clock::now() - t0_);
@@ -58,29 +137,187 @@ struct Batch_timer
     }
 };
 
+static void report_latency(const char *name, const Driver::Latency_histogram &hist)
+{
+    std::cerr << "  " << name << ": ";
+
+    if (hist.count() == 0)
+    {
+        std::cerr << "no samples\n";
+        return;
+    }
+
+    std::cerr << "p50 "    << hist.percentile(0.50)
+              << "  p90 "  << hist.percentile(0.90)
+              << "  p99 "  << hist.percentile(0.99)
+              << "  p999 " << hist.percentile(0.999)
+              << "  max "  << hist.max()
+              << "  (" << hist.count() << " samples)\n";
+}
+
+// one counter group per op type, null when not asked for; the group is
+// enabled only around the op itself, inside its Batch_timer window
+using Perf_ptr = std::unique_ptr<Driver::Perf_counters>;
+
+static void perf_start(const Perf_ptr &perf)
+{
+    if (perf)
+        perf->start();
+}
+
+static void perf_stop(const Perf_ptr &perf)
+{
+    if (perf)
+        perf->stop();
+}
+
+static void report_perf(const char *name, const Perf_ptr &perf, std::size_t ops)
+{
+    if (!perf)
+        return;
+
+    std::cerr << "  " << name << ": ";
+
+    if (!perf->available())
+    {
+        std::cerr << "unavailable (" << perf->error() << ")\n";
+        return;
+    }
+
+    if (ops == 0)
+    {
+        std::cerr << "no ops\n";
+        return;
+    }
+
+    using Perf = Driver::Perf_counters;
+
+    uint64_t values[Perf::kEvents];
+    perf->read(values);
+
+    for (int e = 0; e < Perf::kEvents; ++e)
+    {
+        std::cerr << Perf::kNames[e] << ' ';
+        if (perf->available(static_cast<Perf::Event>(e)))
+            std::cerr << static_cast<double>(values[e]) / ops;
+        else
+            std::cerr << "n/a";
+        std::cerr << "  ";
+    }
+
+    if (perf->available(Perf::kCycles) && perf->available(Perf::kInstructions) && values[Perf::kCycles])
+        std::cerr << "IPC " << static_cast<double>(values[Perf::kInstructions]) / values[Perf::kCycles] << "  ";
+
+    std::cerr << '(' << ops << " ops)\n";
+}
+
+// time spent inside the wrapped reader = input parsing (and reading)
+template <typename ReaderT>
+struct Timed_reader
+{
+    ReaderT     &inner_;
+    ns           total_{0};
+    std::size_t  commands_ = 0;
+
+    bool next(char &mode, int64_t &a, int64_t &b)
+    {
+        const auto t0 = Clock::now();
+        const bool ok = inner_.next(mode, a, b);
+        total_ += std::chrono::duration_cast<ns>(Clock::now() - t0);
+
+        commands_ += ok;
+        return ok;
+    }
+};
+
+// bytes == 0 => unknown (std::istream does not tell)
+template <typename ReaderT>
+static void report_parse(const char *name, const Timed_reader<ReaderT> &timed, std::size_t bytes)
+{
+    const double sec = std::chrono::duration<double>(timed.total_).count();
+
+    std::cerr
+        << "\nParse (" << name << "):\n"
+        << "  commands: " << timed.commands_ << "\n"
+        << "  time    : " << std::chrono::duration_cast<us>(timed.total_).count() << " us total\n";
+
+    if (sec <= 0)
+        return;
+
+    std::cerr << "  rate    : " << timed.commands_ / sec / 1e6 << " M commands/s";
+    if (bytes)
+        std::cerr << ", " << bytes / sec / (1 << 20) << " MiB/s";
+    std::cerr << '\n';
+}
+
+template <typename TreeT>
 struct Bench_policy
 {
-    explicit Bench_policy(std::size_t batch_sz)
-        : batch_sz_(batch_sz) {}
+    Bench_policy(std::size_t batch_sz, std::string layout, std::size_t latency_sample,
+                 const std::string &perf_ops = "")
+        : batch_sz_(batch_sz), layout_(std::move(layout)), latency_sample_(latency_sample)
+    {
+        for (Batch_timer *timer : {&our_ins_, &our_era_, &our_qry_, &our_ord_,
+                                   &set_ins_, &set_era_, &set_qry_, &set_ord_})
+            timer->sample_every_ = latency_sample;
+
+        std::istringstream list(perf_ops);
+        for (std::string op; std::getline(list, op, ',');)
+        {
+            const bool all = op == "all";
+
+            if (all || op == "insert") perf_ins_ = std::make_unique<Driver::Perf_counters>();
+            if (all || op == "erase")  perf_era_ = std::make_unique<Driver::Perf_counters>();
+            if (all || op == "query")  perf_qry_ = std::make_unique<Driver::Perf_counters>();
+            if (all || op == "order")  perf_ord_ = std::make_unique<Driver::Perf_counters>();
+
+            if (!all && op != "insert" && op != "erase" && op != "query" && op != "order")
+                std::cerr << "WARNING: unknown --perf-counters op '" << op << "' ignored\n";
+        }
+    }
 
     std::size_t batch_sz_;
+    std::string layout_;
+    std::size_t latency_sample_; // every N-th op is timed alone, 0 = off
 
     std::set<int64_t> ref_;
 
+    std::vector<int64_t> ins_keys_; // replayed in finalize to compare single vs batched inserts
+
     std::size_t ins_cnt_ = 0;
+    std::size_t era_cnt_ = 0;
     std::size_t qry_cnt_ = 0;
+    std::size_t ord_cnt_ = 0;
+    std::size_t frz_cnt_ = 0;
+
+    int64_t checksum_ = 0; // answers must be used, or the compiler drops the lookups
 
     Batch_timer our_ins_;
+    Batch_timer our_era_;
     Batch_timer our_qry_;
+    Batch_timer our_ord_;
+    ns          our_frz_{0};
     Batch_timer set_ins_;
+    Batch_timer set_era_;
     Batch_timer set_qry_;
+    Batch_timer set_ord_;
+
+    Perf_ptr perf_ins_;
+    Perf_ptr perf_era_;
+    Perf_ptr perf_qry_;
+    Perf_ptr perf_ord_;
+    bool     perf_qry_threads_ = false; // a run was split over the pool: other threads are not counted
 
     void insert(TreeT &tree, int64_t key)
     {
         our_ins_.start();
-        tree.insert_elem(key);
+        perf_start(perf_ins_);
+        Driver::insert_key(tree, key);
+        perf_stop(perf_ins_);
         our_ins_.stop(batch_sz_);
 
+        ins_keys_.push_back(key);
+
         if constexpr (Driver::kVerifyWithSet)
         {
             set_ins_.start();
@@ -91,18 +328,58 @@ struct Bench_policy
         ++ins_cnt_;
     }
 
-    int64_t query(TreeT &tree, int64_t a, int64_t b)
+    // sorted run from the driver: one O(n) build instead of n inserts
+    void insert_sorted(TreeT &tree, const std::vector<int64_t> &keys)
+    {
+        auto t0 = Clock::now();
+        perf_start(perf_ins_);
+        tree.assign_sorted(keys.begin(), keys.end());
+        perf_stop(perf_ins_);
+        our_ins_.total_ += std::chrono::duration_cast<ns>(Clock::now() - t0);
+
+        if constexpr (Driver::kVerifyWithSet)
+        {
+            t0 = Clock::now();
+            ref_.insert(keys.begin(), keys.end());
+            set_ins_.total_ += std::chrono::duration_cast<ns>(Clock::now() - t0);
+        }
+
+        ins_keys_.insert(ins_keys_.end(), keys.begin(), keys.end());
+        ins_cnt_ += keys.size();
+    }
+
+    void erase(TreeT &tree, int64_t key)
+    {
+        our_era_.start();
+        perf_start(perf_era_);
+        tree.erase(key);
+        perf_stop(perf_era_);
+        our_era_.stop(batch_sz_);
+
+        if constexpr (Driver::kVerifyWithSet)
+        {
+            set_era_.start();
+            ref_.erase(key);
+            set_era_.stop(batch_sz_);
+        }
+
+        ++era_cnt_;
+    }
+
+    // set is the tree itself or its frozen snapshot
+    template <typename SetT>
+    int64_t query(const SetT &set, int64_t a, int64_t b)
     {
         our_qry_.start();
-        const auto ans = tree.range_queries(a, b);
+        perf_start(perf_qry_);
+        const int64_t ans = set.range_queries(a, b);
+        perf_stop(perf_qry_);
         our_qry_.stop(batch_sz_);
 
         if constexpr (Driver::kVerifyWithSet)
         {
             set_qry_.start();
-            auto first = ref_.lower_bound(a);
-            auto last  = ref_.upper_bound(b);
-            const auto check = std::distance(first, last);
+            const int64_t check = (b <= a) ? 0 : std::distance(ref_.lower_bound(a), ref_.upper_bound(b));
             set_qry_.stop(batch_sz_);
 
             if (check != ans)
@@ -117,60 +394,384 @@ struct Bench_policy
         return ans;
     }
 
-    void handle_answer(int64_t, int64_t, int64_t){}
+    // a run of q commands: timed as a whole, checked after
+    template <typename SetT>
+    void query_batch(const SetT &set, const std::vector<Driver::Query> &queries,
+                     std::vector<int64_t> &answers, Driver::Thread_pool &pool)
+    {
+        auto t0 = Clock::now();
+        perf_start(perf_qry_);
+        pool.parallel_for(queries.size(), [&](std::size_t begin, std::size_t end)
+        {
+            set.range_queries_batch(queries.begin() + begin, queries.begin() + end, answers.begin() + begin);
+        });
+        perf_stop(perf_qry_);
+        our_qry_.total_ += std::chrono::duration_cast<ns>(Clock::now() - t0);
+
+        // per-op latency of a run: every latency_sample_-th query is asked
+        // again on its own, outside the timed total
+        for (std::size_t i = latency_sample_ ? latency_sample_ - 1 : queries.size(); i < queries.size(); i += latency_sample_)
+        {
+            const auto q0 = Clock::now();
+            checksum_ += set.range_queries(queries[i].first, queries[i].second);
+            our_qry_.hist_.record(static_cast<uint64_t>(std::chrono::duration_cast<ns>(Clock::now() - q0).count()));
+        }
+
+        if constexpr (Driver::kVerifyWithSet)
+        {
+            t0 = Clock::now();
+            for (std::size_t i = 0; i < queries.size(); ++i)
+            {
+                const auto [a, b] = queries[i];
+                const int64_t check = (b <= a) ? 0 : std::distance(ref_.lower_bound(a), ref_.upper_bound(b));
+
+                if (check != answers[i])
+                {
+                    std::cerr << "MISMATCH: [" << a << ' ' << b
+                              << "] our=" << answers[i]
+                              << " set=" << check << '\n';
+                }
+            }
+            set_qry_.total_ += std::chrono::duration_cast<ns>(Clock::now() - t0);
+        }
+
+        perf_qry_threads_ |= pool.size() > 1;
+        qry_cnt_ += queries.size();
+    }
+
+    // k-th smallest (m) key
+    int64_t select(TreeT &tree, int64_t k)
+    {
+        our_ord_.start();
+        perf_start(perf_ord_);
+        auto it = tree.select(k > 0 ? static_cast<std::size_t>(k) : 0);
+        const int64_t ans = (it == tree.end()) ? 0 : *it;
+        perf_stop(perf_ord_);
+        our_ord_.stop(batch_sz_);
+
+        if constexpr (Driver::kVerifyWithSet)
+        {
+            set_ord_.start();
+            const bool in_range = k > 0 && static_cast<std::size_t>(k) <= ref_.size();
+            const int64_t check = in_range ? *std::next(ref_.begin(), k - 1) : 0;
+            set_ord_.stop(batch_sz_);
+
+            if (check != ans)
+                std::cerr << "MISMATCH: m " << k << " our=" << ans << " set=" << check << '\n';
+        }
+
+        ++ord_cnt_;
+        return ans;
+    }
+
+    // number of keys less than key (n)
+    template <typename SetT>
+    int64_t rank(const SetT &set, int64_t key)
+    {
+        our_ord_.start();
+        perf_start(perf_ord_);
+        const int64_t ans = set.rank(key);
+        perf_stop(perf_ord_);
+        our_ord_.stop(batch_sz_);
+
+        if constexpr (Driver::kVerifyWithSet)
+        {
+            set_ord_.start();
+            const int64_t check = std::distance(ref_.begin(), ref_.lower_bound(key));
+            set_ord_.stop(batch_sz_);
+
+            if (check != ans)
+                std::cerr << "MISMATCH: n " << key << " our=" << ans << " set=" << check << '\n';
+        }
+
+        ++ord_cnt_;
+        return ans;
+    }
+
+    Tree::Frozen_set<int64_t> freeze(const TreeT &tree)
+    {
+        const auto t0 = Clock::now();
+        auto frozen = tree.freeze();
+        our_frz_ += std::chrono::duration_cast<ns>(Clock::now() - t0);
+
+        ++frz_cnt_;
+        return frozen;
+    }
+
+    void handle_answer(char, int64_t, int64_t, int64_t ans)
+    {
+        checksum_ += ans;
+    }
 
     void finalize()
     {
         our_ins_.flush();
+        our_era_.flush();
         our_qry_.flush();
+        our_ord_.flush();
 
         if constexpr (Driver::kVerifyWithSet)
         {
             set_ins_.flush();
+            set_era_.flush();
             set_qry_.flush();
+            set_ord_.flush();
         }
 
         const auto us_our_ins =
             std::chrono::duration_cast<us>(our_ins_.total_).count();
 
+        const auto us_our_era =
+            std::chrono::duration_cast<us>(our_era_.total_).count();
+
         const auto us_our_qry =
             std::chrono::duration_cast<us>(our_qry_.total_).count();
 
+        const auto us_our_ord =
+            std::chrono::duration_cast<us>(our_ord_.total_).count();
+
         std::cerr
             << "[BENCH]\n"
+            << "layout     : " << layout_   << "\n"
             << "batch      : " << batch_sz_ << "\n"
             << "insert ops : " << ins_cnt_  << "\n"
-            << "query  ops : " << qry_cnt_  << "\n\n"
+            << "erase  ops : " << era_cnt_  << "\n"
+            << "query  ops : " << qry_cnt_  << "\n"
+            << "order  ops : " << ord_cnt_  << "\n"
+            << "freezes    : " << frz_cnt_  << "\n"
+            << "checksum   : " << checksum_ << "\n\n"
             << "Our tree:\n"
             << "  insert: " << us_our_ins << " us total\n"
-            << "  query : " << us_our_qry << " us total\n";
+            << "  erase : " << us_our_era << " us total\n"
+            << "  query : " << us_our_qry << " us total\n"
+            << "  order : " << us_our_ord << " us total\n"
+            << "  freeze: " << std::chrono::duration_cast<us>(our_frz_).count() << " us total\n";
 
         if constexpr (Driver::kVerifyWithSet)
         {
             const auto us_set_ins =
                 std::chrono::duration_cast<us>(set_ins_.total_).count();
 
+            const auto us_set_era =
+                std::chrono::duration_cast<us>(set_era_.total_).count();
+
             const auto us_set_qry =
                 std::chrono::duration_cast<us>(set_qry_.total_).count();
 
+            const auto us_set_ord =
+                std::chrono::duration_cast<us>(set_ord_.total_).count();
+
             std::cerr
                 << "\nstd::set:\n"
                 << "  insert: " << us_set_ins << " us total\n"
-                << "  query : " << us_set_qry << " us total\n";
+                << "  erase : " << us_set_era << " us total\n"
+                << "  query : " << us_set_qry << " us total\n"
+                << "  order : " << us_set_ord << " us total\n";
         }
+
+        report_latencies_();
+        report_perf_();
+        report_batched_insert_();
+    }
+
+private:
+    // per-op tails, where rebalancing cascades and cache misses show up
+    void report_latencies_() const
+    {
+        if (latency_sample_ == 0)
+            return;
+
+        std::cerr << "\nLatency, ns (every ";
+        if (latency_sample_ > 1)
+            std::cerr << latency_sample_ << "th ";
+        std::cerr << "op):\nOur tree:\n";
+        report_latency("insert", our_ins_.hist_);
+        report_latency("erase ", our_era_.hist_);
+        report_latency("query ", our_qry_.hist_);
+        report_latency("order ", our_ord_.hist_);
+
+        if constexpr (Driver::kVerifyWithSet)
+        {
+            std::cerr << "std::set:\n";
+            report_latency("insert", set_ins_.hist_);
+            report_latency("erase ", set_era_.hist_);
+            report_latency("query ", set_qry_.hist_);
+            report_latency("order ", set_ord_.hist_);
+        }
+    }
+
+    // hardware counters per op of our tree; every op pays two ioctl(2)
+    // calls for them, so the timings above are inflated when this is on
+    void report_perf_() const
+    {
+        if (!perf_ins_ && !perf_era_ && !perf_qry_ && !perf_ord_)
+            return;
+
+        std::cerr << "\nPerf counters, per op (user space):\n";
+        report_perf("insert", perf_ins_, ins_cnt_);
+        report_perf("erase ", perf_era_, era_cnt_);
+        report_perf("query ", perf_qry_, qry_cnt_);
+        report_perf("order ", perf_ord_, ord_cnt_);
+
+        if (perf_qry_ && perf_qry_threads_)
+            std::cerr << "  (query runs split over --threads: only the calling thread's share is counted)\n";
+    }
+
+    // replays every inserted key into fresh trees: insert_elem per key
+    // vs insert_range over chunks of batch_sz_ keys
+    void report_batched_insert_() const
+    {
+        if (ins_keys_.empty())
+            return;
+
+        const std::size_t n = ins_keys_.size();
+
+        TreeT single;
+        auto  t0 = Clock::now();
+        for (int64_t key : ins_keys_)
+            single.insert_elem(key);
+        const auto ns_single = std::chrono::duration_cast<ns>(Clock::now() - t0).count();
+
+        TreeT batched;
+        t0 = Clock::now();
+        for (std::size_t pos = 0; pos < n; pos += batch_sz_)
+        {
+            const std::size_t end = std::min(n, pos + batch_sz_);
+            batched.insert_range(ins_keys_.begin() + pos, ins_keys_.begin() + end);
+        }
+        const auto ns_batched = std::chrono::duration_cast<ns>(Clock::now() - t0).count();
+
+        std::cerr
+            << "\nInsert replay (" << n << " keys, chunk " << batch_sz_ << "):\n"
+            << "  single : " << static_cast<double>(ns_single)  / n << " ns/key\n"
+            << "  batched: " << static_cast<double>(ns_batched) / n << " ns/key\n";
     }
 };
 
+// height and depth histogram of the tree left after the run, plus the
+// rotations and recolors that built it when compiled with RBTREE_STATS
+template <typename BenchTreeT>
+static void report_tree_stats(const BenchTreeT &tree, std::size_t inserts, std::size_t erases)
+{
+    if constexpr (std::is_same_v<BenchTreeT, Skip_listT>)
+    {
+        std::cerr << "\nTree stats: not available for the skip list\n";
+    }
+    else
+    {
+        const std::vector<std::size_t> levels = tree.depth_histogram();
+
+        std::size_t depth_sum = 0;
+        for (std::size_t d = 0; d < levels.size(); ++d)
+            depth_sum += d * levels[d];
+
+        const std::size_t n = tree.size();
+
+        std::cerr
+            << "\nTree shape (" << n << " keys):\n"
+            << "  height   : " << levels.size()
+            << " (perfect " << (n ? static_cast<std::size_t>(std::log2(n)) + 1 : 0)
+            << ", red-black bound " << static_cast<std::size_t>(2 * std::log2(n + 1)) << ")\n"
+            << "  avg depth: " << (n ? static_cast<double>(depth_sum) / n : 0.0) << '\n'
+            << "  depth    :";
+        for (std::size_t d = 0; d < levels.size(); ++d)
+            std::cerr << ' ' << d << ':' << levels[d];
+        std::cerr << '\n';
+
+#ifdef RBTREE_STATS
+        const Tree::Rb_stats &st = tree.stats();
+        auto per = [](uint64_t count, std::size_t ops) { return ops ? static_cast<double>(count) / ops : 0.0; };
+
+        std::cerr
+            << "Rebalancing:\n"
+            << "  rotations       : " << st.rotations()
+            << " (left " << st.left_rotations << ", right " << st.right_rotations << ")\n"
+            << "  recolors        : " << st.recolors << '\n'
+            << "  fix_insert loops: " << st.insert_fix_loops << ", " << per(st.insert_fix_loops, inserts) << " per insert\n"
+            << "  fix_erase loops : " << st.erase_fix_loops  << ", " << per(st.erase_fix_loops,  erases)  << " per erase\n";
+#else
+        (void)inserts;
+        (void)erases;
+        std::cerr << "Rebalancing: configure with -DRBTREE_STATS=ON to count rotations and recolors\n";
+#endif
+    }
+}
+
+template <typename BenchTreeT>
+static int run_bench(std::size_t batch_sz, const Bench_args &args)
+{
+    BenchTreeT tree;
+    Bench_policy<BenchTreeT> policy(batch_sz, args.structure == "skiplist" ? args.structure : args.layout,
+                                    args.latency_sample, args.perf_ops);
+
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+
+    if (!args.run.binary_input.empty())
+    {
+        Driver::Binary_reader reader(args.run.binary_input);
+        if (!reader.is_open())
+            return 1;
+
+        Timed_reader<Driver::Binary_reader> timed{reader};
+
+        const int rc = Driver::run_commands(timed, tree, policy, args.run);
+        report_parse("binary log", timed, reader.bytes_read());
+        if (args.tree_stats)
+            report_tree_stats(tree, policy.ins_cnt_, policy.era_cnt_);
+
+        return rc;
+    }
+
+    if (args.run.fast_input)
+    {
+        Driver::Fd_reader reader(0);
+        Timed_reader<Driver::Fd_reader> timed{reader};
+
+        const int rc = Driver::run_commands(timed, tree, policy, args.run);
+        report_parse("read(2)", timed, reader.bytes_read());
+        if (args.tree_stats)
+            report_tree_stats(tree, policy.ins_cnt_, policy.era_cnt_);
+
+        return rc;
+    }
+
+    Driver::Stream_reader reader(std::cin);
+    Timed_reader<Driver::Stream_reader> timed{reader};
+
+    const int rc = Driver::run_commands(timed, tree, policy, args.run);
+    report_parse("std::cin", timed, 0);
+    if (args.tree_stats)
+        report_tree_stats(tree, policy.ins_cnt_, policy.era_cnt_);
+
+    return rc;
+}
+
 int main(int argc, char** argv)
 {
-    const long long raw =
-        get_bench_batch_arg(argc, argv, 2000);
+    const Bench_args args =
+        get_bench_args(argc, argv, 2000);
 
     const std::size_t batch_sz =
-        static_cast<std::size_t>(std::max(1LL, raw));
+        static_cast<std::size_t>(std::max(1LL, args.batch));
+
+    if (args.structure == "skiplist")
+        return run_bench<Skip_listT>(batch_sz, args);
 
-    TreeT tree;
-    Bench_policy policy(batch_sz);
+    if (args.structure != "rbtree")
+    {
+        std::cerr << "ERROR: unknown structure '" << args.structure << "'\n";
+        return 1;
+    }
+
+    if (args.layout == "compact")
+        return run_bench<Compact_treeT>(batch_sz, args);
+
+    if (args.layout != "pointer")
+    {
+        std::cerr << "ERROR: unknown layout '" << args.layout << "'\n";
+        return 1;
+    }
 
-    return Driver::run(tree, policy);
+    return run_bench<TreeT>(batch_sz, args);
 }
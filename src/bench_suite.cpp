@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "arena_allocator.hpp"
+#include "red_black_tree.hpp"
+#include "skip_list.hpp"
+
+// Parameterized workloads over the tree and its alternatives. Every
+// benchmark reports ns/op and ops/s (items_per_second) plus p50/p90/p99 of
+// the per-op time over blocks of kBlockOps ops. JSON for regression tracking:
+//   rb_tree_bench_suite --benchmark_out=suite.json --benchmark_out_format=json
+
+using TreeT      = Tree::Red_black_tree<int64_t, Tree::Arena_allocator<int64_t>>;
+using Skip_listT = Tree::Skip_list<int64_t>;
+using Std_setT   = std::set<int64_t>;
+
+// std::vector kept sorted: O(log n) lookups, O(n) updates
+struct Sorted_vector
+{
+    std::vector<int64_t> keys_;
+};
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+
+// ---------------------------------------------------------------------------
+// the same operations on every container
+
+void insert(TreeT &set, int64_t key)          { set.insert_elem(key); }
+void insert(Skip_listT &set, int64_t key)     { set.insert_elem(key); }
+void insert(Std_setT &set, int64_t key)       { set.insert(key); }
+void insert(Sorted_vector &set, int64_t key)
+{
+    auto it = std::lower_bound(set.keys_.begin(), set.keys_.end(), key);
+    if (it == set.keys_.end() || *it != key)
+        set.keys_.insert(it, key);
+}
+
+void erase(TreeT &set, int64_t key)          { set.erase(key); }
+void erase(Skip_listT &set, int64_t key)     { set.erase(key); }
+void erase(Std_setT &set, int64_t key)       { set.erase(key); }
+void erase(Sorted_vector &set, int64_t key)
+{
+    auto it = std::lower_bound(set.keys_.begin(), set.keys_.end(), key);
+    if (it != set.keys_.end() && *it == key)
+        set.keys_.erase(it);
+}
+
+// keys in [a, b]
+uint64_t count(const TreeT &set, int64_t a, int64_t b)      { return set.range_queries(a, b); }
+uint64_t count(const Skip_listT &set, int64_t a, int64_t b) { return set.range_queries(a, b); }
+uint64_t count(const Std_setT &set, int64_t a, int64_t b)
+{
+    return (b <= a) ? 0 : std::distance(set.lower_bound(a), set.upper_bound(b));
+}
+uint64_t count(const Sorted_vector &set, int64_t a, int64_t b)
+{
+    if (b <= a)
+        return 0;
+
+    return std::upper_bound(set.keys_.begin(), set.keys_.end(), b)
+         - std::lower_bound(set.keys_.begin(), set.keys_.end(), a);
+}
+
+// sorted unique keys
+void fill(TreeT &set, const std::vector<int64_t> &keys)      { set.assign_sorted(keys.begin(), keys.end()); }
+void fill(Skip_listT &set, const std::vector<int64_t> &keys) { set.assign_sorted(keys.begin(), keys.end()); }
+void fill(Std_setT &set, const std::vector<int64_t> &keys)   { set.insert(keys.begin(), keys.end()); }
+void fill(Sorted_vector &set, const std::vector<int64_t> &keys) { set.keys_ = keys; }
+
+// ---------------------------------------------------------------------------
+// workloads
+
+enum class Order { Sorted, Random, Reverse, Zipfian };
+enum class Width { Narrow, Wide, Random };
+
+constexpr std::size_t kBlockOps   = 64;      // ops per latency sample
+constexpr std::size_t kQueryOps   = 1 << 14; // ops per iteration of query / mixed runs
+constexpr double      kZipfTheta  = 0.99;    // YCSB default skew
+
+// Zipf-distributed ranks in [0, n) (Gray et al., as in YCSB)
+class Zipf_generator
+{
+    double n_, theta_, alpha_, zetan_, eta_;
+
+    static double zeta(std::size_t n, double theta)
+    {
+        double sum = 0;
+        for (std::size_t i = 1; i <= n; ++i)
+            sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        return sum;
+    }
+
+public:
+    Zipf_generator(std::size_t n, double theta)
+        : n_(static_cast<double>(n)), theta_(theta), alpha_(1.0 / (1.0 - theta)), zetan_(zeta(n, theta))
+    {
+        eta_ = (1.0 - std::pow(2.0 / n_, 1.0 - theta_)) / (1.0 - zeta(2, theta_) / zetan_);
+    }
+
+    template <typename Gen>
+    std::size_t operator()(Gen &gen)
+    {
+        const double u  = std::uniform_real_distribution<double>(0.0, 1.0)(gen);
+        const double uz = u * zetan_;
+
+        if (uz < 1.0)
+            return 0;
+        if (uz < 1.0 + std::pow(0.5, theta_))
+            return 1;
+
+        return std::min(static_cast<std::size_t>(n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_)),
+                        static_cast<std::size_t>(n_) - 1);
+    }
+};
+
+// n keys in the given order; zipfian keys repeat, hot ranks are scattered
+// over the key space
+std::vector<int64_t> make_keys(std::size_t n, Order order)
+{
+    std::vector<int64_t> keys(n);
+    std::mt19937_64 gen(n);
+
+    switch (order)
+    {
+        case Order::Sorted:
+        case Order::Reverse:
+            for (std::size_t i = 0; i < n; ++i)
+                keys[i] = static_cast<int64_t>(2 * i);
+            if (order == Order::Reverse)
+                std::reverse(keys.begin(), keys.end());
+            break;
+
+        case Order::Random:
+            for (std::size_t i = 0; i < n; ++i)
+                keys[i] = static_cast<int64_t>(2 * i);
+            std::shuffle(keys.begin(), keys.end(), gen);
+            break;
+
+        case Order::Zipfian:
+        {
+            Zipf_generator zipf(n, kZipfTheta);
+            for (auto &key : keys)
+                key = static_cast<int64_t>((zipf(gen) * 0x9e3779b97f4a7c15ull) >> 1);
+            break;
+        }
+    }
+
+    return keys;
+}
+
+// per-op time over blocks of kBlockOps ops, reported as percentiles
+class Latency_sampler
+{
+    std::vector<double> samples_;
+    Clock::time_point   t0_;
+    std::size_t         in_block_ = 0;
+
+public:
+    void op_begin()
+    {
+        if (in_block_ == 0)
+            t0_ = Clock::now();
+    }
+
+    void op_end()
+    {
+        if (++in_block_ == kBlockOps)
+        {
+            samples_.push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0_).count() / kBlockOps);
+            in_block_ = 0;
+        }
+    }
+
+    void report(benchmark::State &state, std::size_t ops)
+    {
+        state.SetItemsProcessed(static_cast<int64_t>(ops));
+
+        if (samples_.empty())
+            return;
+
+        std::sort(samples_.begin(), samples_.end());
+        state.counters["ns/op"] = std::accumulate(samples_.begin(), samples_.end(), 0.0) / samples_.size();
+
+        auto pct = [&](double p) { return samples_[static_cast<std::size_t>(p * (samples_.size() - 1))]; };
+
+        state.counters["p50_ns"] = pct(0.50);
+        state.counters["p90_ns"] = pct(0.90);
+        state.counters["p99_ns"] = pct(0.99);
+    }
+};
+
+template <typename SetT>
+void bm_insert(benchmark::State &state, Order order)
+{
+    const auto keys = make_keys(static_cast<std::size_t>(state.range(0)), order);
+
+    Latency_sampler lat;
+    std::size_t     ops = 0;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        {
+            SetT set;
+            state.ResumeTiming();
+
+            for (int64_t key : keys)
+            {
+                lat.op_begin();
+                insert(set, key);
+                lat.op_end();
+            }
+
+            benchmark::ClobberMemory();
+            state.PauseTiming();
+        } // destruction is not timed
+        state.ResumeTiming();
+
+        ops += keys.size();
+    }
+
+    lat.report(state, ops);
+}
+
+template <typename SetT>
+void bm_query(benchmark::State &state, Width width)
+{
+    const std::size_t n = static_cast<std::size_t>(state.range(0));
+
+    SetT set;
+    fill(set, make_keys(n, Order::Sorted));
+
+    // keys are 0, 2, ..., 2n - 2
+    const int64_t span = static_cast<int64_t>(2 * n);
+    std::mt19937_64 gen(n + 1);
+
+    std::vector<std::pair<int64_t, int64_t>> queries(kQueryOps);
+    for (auto &[a, b] : queries)
+    {
+        a = static_cast<int64_t>(gen() % span);
+
+        switch (width)
+        {
+            case Width::Narrow: b = a + 32; break;                 // ~16 keys
+            case Width::Wide:   b = a + span / 8; break;           // ~n/8 keys
+            case Width::Random:
+                b = static_cast<int64_t>(gen() % span);
+                if (b < a)
+                    std::swap(a, b);
+                break;
+        }
+    }
+
+    Latency_sampler lat;
+    std::size_t     ops = 0;
+
+    for (auto _ : state)
+    {
+        uint64_t sum = 0;
+        for (const auto &[a, b] : queries)
+        {
+            lat.op_begin();
+            sum += count(set, a, b);
+            lat.op_end();
+        }
+
+        benchmark::DoNotOptimize(sum);
+        ops += queries.size();
+    }
+
+    lat.report(state, ops);
+}
+
+// read_pct% narrow range queries, the rest inserts and erases of random
+// keys half of which are present
+template <typename SetT>
+void bm_mixed(benchmark::State &state, unsigned read_pct)
+{
+    const std::size_t n = static_cast<std::size_t>(state.range(0));
+
+    SetT set;
+    fill(set, make_keys(n, Order::Sorted));
+
+    const int64_t span = static_cast<int64_t>(2 * n);
+    std::mt19937_64 gen(n + 2);
+
+    struct Op { char kind; int64_t key; };
+
+    std::vector<Op> ops_list(kQueryOps);
+    for (auto &op : ops_list)
+    {
+        const unsigned roll = static_cast<unsigned>(gen() % 100);
+        op.key  = static_cast<int64_t>(gen() % span);
+        op.kind = (roll < read_pct) ? 'q' : (gen() & 1) ? 'k' : 'd';
+    }
+
+    Latency_sampler lat;
+    std::size_t     ops = 0;
+
+    for (auto _ : state)
+    {
+        uint64_t sum = 0;
+        for (const Op &op : ops_list)
+        {
+            lat.op_begin();
+            switch (op.kind)
+            {
+                case 'q': sum += count(set, op.key, op.key + 32); break;
+                case 'k': insert(set, op.key); break;
+                case 'd': erase(set, op.key); break;
+            }
+            lat.op_end();
+        }
+
+        benchmark::DoNotOptimize(sum);
+        ops += ops_list.size();
+    }
+
+    lat.report(state, ops);
+}
+
+// ---------------------------------------------------------------------------
+// registration
+
+// 1K, 10K, ..., up to max_keys
+std::vector<int64_t> sizes_up_to(std::size_t max_keys)
+{
+    std::vector<int64_t> sizes;
+    for (std::size_t n = 1000; n <= max_keys && n <= 100'000'000; n *= 10)
+        sizes.push_back(static_cast<int64_t>(n));
+
+    return sizes;
+}
+
+template <typename SetT>
+void register_set(const std::string &name, std::size_t max_keys, std::size_t max_update_keys)
+{
+    const auto sizes = sizes_up_to(max_keys);
+
+    const std::pair<const char*, Order> orders[] = {
+        {"sorted", Order::Sorted}, {"random", Order::Random}, {"reverse", Order::Reverse}, {"zipfian", Order::Zipfian}};
+
+    for (const auto &[order_name, order] : orders)
+    {
+        auto *bm = benchmark::RegisterBenchmark(("insert/" + std::string(order_name) + "/" + name).c_str(),
+                                                [order = order](benchmark::State &st) { bm_insert<SetT>(st, order); });
+        for (int64_t n : sizes)
+            if (order == Order::Sorted || static_cast<std::size_t>(n) <= max_update_keys)
+                bm->Arg(n);
+        bm->Unit(benchmark::kMillisecond)->UseRealTime();
+    }
+
+    const std::pair<const char*, Width> widths[] = {
+        {"narrow", Width::Narrow}, {"wide", Width::Wide}, {"random", Width::Random}};
+
+    for (const auto &[width_name, width] : widths)
+    {
+        auto *bm = benchmark::RegisterBenchmark(("query/" + std::string(width_name) + "/" + name).c_str(),
+                                                [width = width](benchmark::State &st) { bm_query<SetT>(st, width); });
+        for (int64_t n : sizes)
+            bm->Arg(n);
+        bm->Unit(benchmark::kMicrosecond)->UseRealTime();
+    }
+
+    for (unsigned read_pct : {10u, 50u, 90u})
+    {
+        auto *bm = benchmark::RegisterBenchmark(("mixed/read" + std::to_string(read_pct) + "/" + name).c_str(),
+                                                [read_pct](benchmark::State &st) { bm_mixed<SetT>(st, read_pct); });
+        for (int64_t n : sizes)
+            if (static_cast<std::size_t>(n) <= max_update_keys)
+                bm->Arg(n);
+        bm->Unit(benchmark::kMicrosecond)->UseRealTime();
+    }
+}
+
+// takes --max-keys=N out of argv before Google Benchmark sees it
+std::size_t take_max_keys(int &argc, char **argv, std::size_t def)
+{
+    constexpr const char *kFlag = "--max-keys=";
+
+    std::size_t max_keys = def;
+    int out = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], kFlag, std::strlen(kFlag)) == 0)
+            max_keys = std::strtoull(argv[i] + std::strlen(kFlag), nullptr, 10);
+        else
+            argv[out++] = argv[i];
+    }
+    argc = out;
+
+    return max_keys;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    // 100M keys take several GiB per container, so bigger sizes are opt-in
+    const std::size_t max_keys = take_max_keys(argc, argv, 1'000'000);
+
+    register_set<TreeT>        ("rbtree",   max_keys, max_keys);
+    register_set<Skip_listT>   ("skiplist", max_keys, max_keys);
+    register_set<Std_setT>     ("std_set",  max_keys, max_keys);
+    // O(n) per update: unordered inserts and mixed runs only on small sizes
+    register_set<Sorted_vector>("sorted_vector", max_keys, 10'000);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
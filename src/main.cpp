@@ -1,22 +1,49 @@
 #include <iostream>
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
 #include <set>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 #include "cxxopts.hpp"
+#include "arena_allocator.hpp"
 #include "red_black_tree.hpp"
+#include "skip_list.hpp"
 #include "graphic_dump.hpp"
 #include "driver.hpp"
+#include "output_writer.hpp"
 
-using TreeT = Tree::Red_black_tree<int64_t>;
+using TreeT      = Tree::Red_black_tree<int64_t, Tree::Arena_allocator<int64_t>>;
+using Skip_listT = Tree::Skip_list<int64_t>;
 
-static std::string get_gv_file_arg(int argc, char** argv, const char* def_name)
+struct Cli_args
+{
+    std::string         gv_file;
+    std::string         structure;
+    Driver::Run_options run;
+};
+
+static Cli_args get_cli_args(int argc, char** argv, const char* def_name)
 {
     cxxopts::Options options("rb_tree", "Red-black tree visualizer");
 
     options.add_options()
         ("f,gv-file",   "Path to .dot output file",  cxxopts::value<std::string>())
         ("p,gv-prefix", "Prefix for .dot file name", cxxopts::value<std::string>())
+        ("freeze-after",
+         "Answer queries from a frozen snapshot after N reads in a row (0 = off)",
+         cxxopts::value<std::size_t>()->default_value("0"))
+        ("fast-input",  "Parse stdin with the read(2) tokenizer instead of std::cin")
+        ("binary-input",
+         "Replay a binary command log (scripts/log_convert.py) instead of stdin",
+         cxxopts::value<std::string>())
+        ("threads",
+         "Answer runs of q commands on this many threads",
+         cxxopts::value<unsigned>()->default_value("1"))
+        ("structure",   "Ordered set to run on: rbtree or skiplist",
+         cxxopts::value<std::string>()->default_value("rbtree"))
         ("h,help",      "Print help");
 
     auto result = options.parse(argc, argv);
@@ -27,50 +54,114 @@ static std::string get_gv_file_arg(int argc, char** argv, const char* def_name)
         std::exit(0);
     }
 
-    if (result.count("gv-file"))
-        return result["gv-file"].as<std::string>();
+    Cli_args args;
+    args.run.freeze_after = result["freeze-after"].as<std::size_t>();
+    args.run.fast_input   = result.count("fast-input") > 0;
+    args.run.threads      = std::max(1u, result["threads"].as<unsigned>());
+    args.structure        = result["structure"].as<std::string>();
 
-    if (result.count("gv-prefix"))
-        return result["gv-prefix"].as<std::string>() + "_tree.dot";
+    if (result.count("binary-input"))
+        args.run.binary_input = result["binary-input"].as<std::string>();
 
-    return def_name;
+    if (result.count("gv-file"))
+        args.gv_file = result["gv-file"].as<std::string>();
+    else if (result.count("gv-prefix"))
+        args.gv_file = result["gv-prefix"].as<std::string>() + "_tree.dot";
+    else
+        args.gv_file = def_name;
+
+    return args;
 }
 
+template <typename TreeT>
 struct Normal_policy
 {
     std::set<int64_t> ref_;
     bool printed_any_ = false;
 
+    Driver::Output_writer out_{std::cout};
+
     void insert(TreeT &tree, int64_t key)
     {
-        tree.insert_elem(key);
+        Driver::insert_key(tree, key);
 
         if constexpr (Driver::kVerifyWithSet)
             ref_.insert(key);
     }
 
-    int64_t query(TreeT &tree, int64_t a, int64_t b)
+    void insert_sorted(TreeT &tree, const std::vector<int64_t> &keys)
     {
-        return tree.range_queries(a, b);
+        tree.assign_sorted(keys.begin(), keys.end());
+
+        if constexpr (Driver::kVerifyWithSet)
+            ref_.insert(keys.begin(), keys.end());
     }
 
-    void handle_answer(int64_t a, int64_t b, int64_t ans)
+    void erase(TreeT &tree, int64_t key)
     {
-        std::cout << ans << ' ';
-        printed_any_ = true;
+        tree.erase(key);
 
         if constexpr (Driver::kVerifyWithSet)
+            ref_.erase(key);
+    }
+
+    // k-th smallest key, 0 if k is out of range (like an invalid q)
+    int64_t select(TreeT &tree, int64_t k)
+    {
+        if (k <= 0)
+            return 0;
+
+        auto it = tree.select(static_cast<std::size_t>(k));
+        return it == tree.end() ? 0 : *it;
+    }
+
+    // set is the tree itself or its frozen snapshot
+    template <typename SetT>
+    int64_t query(const SetT &set, int64_t a, int64_t b)
+    {
+        return set.range_queries(a, b);
+    }
+
+    // a run of q commands: one range_queries_batch per piece of the pool
+    template <typename SetT>
+    void query_batch(const SetT &set, const std::vector<Driver::Query> &queries,
+                     std::vector<int64_t> &answers, Driver::Thread_pool &pool)
+    {
+        pool.parallel_for(queries.size(), [&](std::size_t begin, std::size_t end)
         {
-            auto first = ref_.lower_bound(a);
-            auto last  = ref_.upper_bound(b);
+            set.range_queries_batch(queries.begin() + begin, queries.begin() + end, answers.begin() + begin);
+        });
+    }
 
-            const auto check = std::distance(first, last);
+    template <typename SetT>
+    int64_t rank(const SetT &set, int64_t key)
+    {
+        return set.rank(key);
+    }
+
+    Tree::Frozen_set<int64_t> freeze(const TreeT &tree)
+    {
+        return tree.freeze();
+    }
+
+    void handle_answer(char mode, int64_t a, int64_t b, int64_t ans)
+    {
+        out_.write(ans);
+        out_.put(' ');
+        printed_any_ = true;
+
+        if constexpr (Driver::kVerifyWithSet)
+        {
+            const auto check = reference_answer_(mode, a, b);
 
             if (check != ans)
             {
                 std::cerr << "DBG set=" << check
                           << " tree=" << ans
-                          << " for q " << a << ' ' << b << '\n';
+                          << " for " << mode << ' ' << a;
+                if (mode == 'q')
+                    std::cerr << ' ' << b;
+                std::cerr << '\n';
             }
         }
     }
@@ -78,26 +169,64 @@ struct Normal_policy
     void finalize()
     {
         if (printed_any_)
-            std::cout << '\n';
+            out_.put('\n');
+
+        out_.flush();
+    }
+
+private:
+    int64_t reference_answer_(char mode, int64_t a, int64_t b) const
+    {
+        switch (mode)
+        {
+            case 'q':
+                return (b <= a) ? 0 : std::distance(ref_.lower_bound(a), ref_.upper_bound(b));
+
+            case 'm':
+                if (a <= 0 || static_cast<std::size_t>(a) > ref_.size())
+                    return 0;
+                return *std::next(ref_.begin(), a - 1);
+
+            case 'n':
+                return std::distance(ref_.begin(), ref_.lower_bound(a));
+        }
+
+        return 0;
     }
 };
 
-int main(int argc, char** argv)
+template <typename ContainerT>
+static int run_on(const Cli_args &args)
 {
-    TreeT tree;
-    Normal_policy policy;
+    ContainerT tree;
+    Normal_policy<ContainerT> policy;
 
-    const int rc = Driver::run(tree, policy);
+    const int rc = Driver::run(tree, policy, args.run);
 
 #ifdef CUSTOM_MODE_DEBUG
+    if constexpr (std::is_same_v<ContainerT, TreeT>)
     {
-        const std::string dot_name =
-            get_gv_file_arg(argc, argv, "graphviz/file_graph.dot");
-
         Tree::Print_tree<int64_t> pr_tr;
-        pr_tr.dump(tree, dot_name.c_str(), "graphviz/tree_graph.png", true);
+        pr_tr.dump(tree, args.gv_file.c_str(), "graphviz/tree_graph.png", true);
     }
 #endif
 
     return rc;
-}
\ No newline at end of file
+}
+
+int main(int argc, char** argv)
+{
+    const Cli_args args =
+        get_cli_args(argc, argv, "graphviz/file_graph.dot");
+
+    if (args.structure == "skiplist")
+        return run_on<Skip_listT>(args);
+
+    if (args.structure != "rbtree")
+    {
+        std::cerr << "ERROR: unknown structure '" << args.structure << "'\n";
+        return 1;
+    }
+
+    return run_on<TreeT>(args);
+}
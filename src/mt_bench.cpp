@@ -0,0 +1,243 @@
+#include <iostream>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cxxopts.hpp"
+#include "arena_allocator.hpp"
+#include "concurrent_tree.hpp"
+#include "red_black_tree.hpp"
+#include "sharded_tree.hpp"
+#include "skip_list.hpp"
+#include "thread_pool.hpp"
+
+using TreeT       = Tree::Red_black_tree<int64_t, Tree::Arena_allocator<int64_t>>;
+using Concurrent  = Tree::Concurrent_tree<int64_t, Tree::Arena_allocator<int64_t>>;
+using Sharded     = Tree::Sharded_tree<int64_t, Tree::Arena_allocator<int64_t>>;
+using Skip_listT  = Tree::Skip_list<int64_t>;
+using ms          = std::chrono::milliseconds;
+
+struct Mt_bench_args
+{
+    std::size_t keys;
+    unsigned    max_threads;
+    long long   duration_ms;
+    bool        writer;
+    std::size_t ingest_keys;
+    std::size_t shards;
+};
+
+static Mt_bench_args get_mt_bench_args(int argc, char** argv)
+{
+    cxxopts::Options options("rb_tree_mt_bench", "Concurrent RB-tree read scaling benchmark");
+
+    const unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+
+    options.add_options()
+        ("keys",        "Keys in the tree",
+         cxxopts::value<std::size_t>()->default_value("1000000"))
+        ("max-threads", "Reader threads go 1, 2, 4, ... up to this",
+         cxxopts::value<unsigned>()->default_value(std::to_string(hw)))
+        ("duration-ms", "Measuring time per point",
+         cxxopts::value<long long>()->default_value("500"))
+        ("no-writer",   "Do not run the background writer")
+        ("ingest-keys", "Random keys loaded into the sharded tree, 0 = skip",
+         cxxopts::value<std::size_t>()->default_value("2000000"))
+        ("shards",      "Shards of the sharded tree",
+         cxxopts::value<std::size_t>()->default_value(std::to_string(Sharded::kDefaultShards)));
+
+    auto result = options.parse(argc, argv);
+
+    return {result["keys"].as<std::size_t>(),
+            std::max(1u, result["max-threads"].as<unsigned>()),
+            std::max(1LL, result["duration-ms"].as<long long>()),
+            result.count("no-writer") == 0,
+            result["ingest-keys"].as<std::size_t>(),
+            std::max<std::size_t>(1, result["shards"].as<std::size_t>())};
+}
+
+// range_queries on random windows from `readers` threads while one writer
+// inserts and erases random keys; returns total reads per second
+template <typename ReadF, typename WriteF>
+static double measure(unsigned readers, const Mt_bench_args &args, ReadF read, WriteF write)
+{
+    std::atomic<bool>     stop{false};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> checksum{0}; // an atomic sink keeps the reads alive
+
+    const int64_t key_space = static_cast<int64_t>(args.keys) * 2;
+
+    std::vector<std::thread> threads;
+    for (unsigned r = 0; r < readers; ++r)
+        threads.emplace_back([&, r]
+        {
+            std::mt19937_64 gen(r + 1);
+            uint64_t local_reads = 0;
+            uint64_t local_sum   = 0;
+
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                const int64_t a = static_cast<int64_t>(gen() % key_space);
+                local_sum += read(a, a + 1000);
+                ++local_reads;
+            }
+
+            reads    += local_reads;
+            checksum += local_sum;
+        });
+
+    std::thread writer;
+    if (args.writer)
+        writer = std::thread([&]
+        {
+            std::mt19937_64 gen(0);
+            while (!stop.load(std::memory_order_relaxed))
+                write(static_cast<int64_t>(gen() % key_space), gen() & 1);
+        });
+
+    std::this_thread::sleep_for(ms(args.duration_ms));
+    stop = true;
+
+    for (auto &th : threads)
+        th.join();
+    if (writer.joinable())
+        writer.join();
+
+    return static_cast<double>(reads.load()) * 1000.0 / static_cast<double>(args.duration_ms);
+}
+
+// seconds to load keys in chunks of kIngestChunk, as a stream of updates
+// would arrive
+template <typename LoadF>
+static double time_ingest(const std::vector<int64_t> &keys, LoadF load)
+{
+    constexpr std::size_t kIngestChunk = std::size_t{1} << 16;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (std::size_t i = 0; i < keys.size(); i += kIngestChunk)
+        load(keys.begin() + i, keys.begin() + std::min(keys.size(), i + kIngestChunk));
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// random-key bulk insert into one tree against the sharded tree and the
+// lock-free skip list with 1, 2, 4, ... threads
+static void ingest_scaling(const Mt_bench_args &args)
+{
+    std::mt19937_64 gen(42);
+
+    std::vector<int64_t> keys(args.ingest_keys);
+    for (auto &key : keys)
+        key = static_cast<int64_t>(gen() >> 1);
+
+    TreeT single;
+    const double base = time_ingest(keys, [&](auto first, auto last) { single.insert_range(first, last); });
+
+    std::cout << "ingest: " << args.ingest_keys << " random keys, " << args.shards << " shards\n"
+              << "  single tree: " << base << " s\n";
+
+    for (unsigned threads = 1; ; threads *= 2)
+    {
+        threads = std::min(threads, args.max_threads);
+
+        Driver::Thread_pool pool(threads);
+        Sharded             sharded(args.shards);
+
+        const double t = time_ingest(keys, [&](auto first, auto last) { sharded.insert_range(first, last, pool); });
+
+        // the skip list takes the same chunks with every thread inserting
+        // its share of each chunk concurrently
+        Skip_listT skip_list;
+
+        const double ts = time_ingest(keys, [&](auto first, auto last)
+        {
+            pool.parallel_for(static_cast<std::size_t>(last - first), [&](std::size_t begin, std::size_t end)
+            {
+                for (std::size_t i = begin; i < end; ++i)
+                    skip_list.insert_elem(first[i]);
+            });
+        });
+
+        if (sharded.size() != single.size() || skip_list.size() != single.size())
+            std::cerr << "ERROR: sharded tree has " << sharded.size()
+                      << " keys, skip list " << skip_list.size()
+                      << ", expected " << single.size() << "\n";
+
+        std::cout << "  threads " << threads << ": sharded " << t << " s"
+                  << " (x" << base / t << " vs single tree"
+                  << ", " << sharded.rebalances() << " rebalances)"
+                  << ", skip list " << ts << " s\n";
+
+        if (threads == args.max_threads)
+            break;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const Mt_bench_args args = get_mt_bench_args(argc, argv);
+
+    if (args.ingest_keys)
+        ingest_scaling(args);
+
+    std::vector<int64_t> keys;
+    keys.reserve(args.keys);
+    for (std::size_t i = 0; i < args.keys; ++i)
+        keys.push_back(static_cast<int64_t>(2 * i));
+
+    Concurrent concurrent;
+    concurrent.write([&](TreeT &t) { t.assign_sorted(keys.begin(), keys.end()); });
+
+    TreeT      locked = TreeT::from_sorted(keys.begin(), keys.end());
+    std::mutex lock;
+
+    std::cout << "keys: " << args.keys
+              << ", writer: " << (args.writer ? "on" : "off")
+              << ", " << args.duration_ms << " ms per point\n";
+
+    for (unsigned readers = 1; ; readers *= 2)
+    {
+        readers = std::min(readers, args.max_threads);
+
+        const double lr = measure(readers, args,
+            [&](int64_t a, int64_t b) { return concurrent.range_queries(a, b); },
+            [&](int64_t key, bool ins)
+            {
+                if (ins)
+                    concurrent.insert(key);
+                else
+                    concurrent.erase(key);
+            });
+
+        const double mx = measure(readers, args,
+            [&](int64_t a, int64_t b)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                return locked.range_queries(a, b);
+            },
+            [&](int64_t key, bool ins)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (ins)
+                    locked.insert_elem(key);
+                else
+                    locked.erase(key);
+            });
+
+        std::cout << "  readers " << readers
+                  << ": left-right " << lr / 1e6 << " M reads/s"
+                  << ", mutex "      << mx / 1e6 << " M reads/s\n";
+
+        if (readers == args.max_threads)
+            break;
+    }
+
+    return 0;
+}
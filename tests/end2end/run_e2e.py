@@ -4,10 +4,24 @@ import subprocess
 import sys
 from pathlib import Path
 import difflib
+import tempfile
 import time
 
+SCRIPTS_DIR = Path(__file__).resolve().parents[2] / "scripts"
 
-def run_compare(binary, input_file, expected_file) -> int:
+
+def to_binary_log(input_file, tmp_dir) -> Path:
+    """Text commands -> binary log via scripts/log_convert.py."""
+    sys.path.insert(0, str(SCRIPTS_DIR))
+    import log_convert
+
+    out = Path(tmp_dir) / (Path(input_file).stem + ".rblog")
+    text = Path(input_file).read_text(encoding="utf-8")
+    out.write_bytes(log_convert.to_binary(text))
+    return out
+
+
+def run_compare(binary, input_file, expected_file, bin_args=(), binary_log=False) -> int:
     input_path = Path(input_file)
     expected_path = Path(expected_file)
 
@@ -23,14 +37,20 @@ def run_compare(binary, input_file, expected_file) -> int:
     with expected_path.open("r", encoding="utf-8") as f:
         expected = f.read()
 
-    start = time.perf_counter()
-    proc = subprocess.run(
-        [binary],
-        input=inp.encode("utf-8"),
-        stdout=subprocess.PIPE,
-        stderr=subprocess.PIPE,
-    )
-    elapsed = time.perf_counter() - start
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        if binary_log:
+            log = to_binary_log(input_path, tmp_dir)
+            bin_args = [*bin_args, f"--binary-input={log}"]
+            inp = ""
+
+        start = time.perf_counter()
+        proc = subprocess.run(
+            [binary, *bin_args],
+            input=inp.encode("utf-8"),
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        elapsed = time.perf_counter() - start
 
     output = proc.stdout.decode("utf-8")
 
@@ -56,7 +76,7 @@ def run_compare(binary, input_file, expected_file) -> int:
     return 0
 
 
-def run_bench(binary, input_file) -> int:
+def run_bench(binary, input_file, bin_args=()) -> int:
     input_path = Path(input_file)
 
     if not input_path.exists():
@@ -68,7 +88,7 @@ def run_bench(binary, input_file) -> int:
 
     start = time.perf_counter()
     proc = subprocess.run(
-        [binary],
+        [binary, *bin_args],
         input=inp.encode("utf-8"),
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE,
@@ -98,6 +118,17 @@ def main() -> int:
         required=True,
         help="compare: check output vs expected; bench: just run and measure time",
     )
+    parser.add_argument(
+        "--bin-arg",
+        action="append",
+        default=[],
+        help="Extra argument for the binary, may be repeated (--bin-arg=--fast-input)",
+    )
+    parser.add_argument(
+        "--binary-log",
+        action="store_true",
+        help="Convert the input to a binary command log and pass it via --binary-input",
+    )
     parser.add_argument("binary", help="Path to rb_tree binary")
     parser.add_argument("input", help="Input file for stdin")
     parser.add_argument(
@@ -112,9 +143,10 @@ def main() -> int:
         if not args.expected:
             print("[ERROR] expected file is required in compare mode", file=sys.stderr)
             return 2
-        return run_compare(args.binary, args.input, args.expected)
+        return run_compare(args.binary, args.input, args.expected, args.bin_arg,
+                           args.binary_log)
     else:  # bench
-        return run_bench(args.binary, args.input)
+        return run_bench(args.binary, args.input, args.bin_arg)
 
 
 if __name__ == "__main__":
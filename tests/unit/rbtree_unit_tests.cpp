@@ -1,14 +1,37 @@
 #include <gtest/gtest.h>
 #include <unordered_map>
 #include <optional>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
 
 #include <atomic>
+#include <map>
+#include <limits>
 #include <mutex>
 #include <unordered_set>
+#include <functional>
+#include <fstream>
+#include <cstdio>
 #include <new>
+#include <stdexcept>
+#include <numeric>
+#include <thread>
 #include <vector>
 
+#include "arena_allocator.hpp"
+#include "command_reader.hpp"
+#include "concurrent_tree.hpp"
+#include "latency_histogram.hpp"
+#include "perf_counters.hpp"
+#include "persistent_tree.hpp"
+#include "rb_map.hpp"
 #include "red_black_tree.hpp"
+#include "sharded_tree.hpp"
+#include "skip_list.hpp"
+#include "thread_pool.hpp"
 
 using Key   = int64_t;
 using NodeT = Tree::detail::Node<Key>;
@@ -22,22 +45,23 @@ struct Info {
     std::optional<Key> right;
 };
 
+template <typename NodeT>
 static int CheckRBRec(const NodeT* n,
                       std::optional<Key> min_key = std::nullopt,
                       std::optional<Key> max_key = std::nullopt)
 {
     if (!n) return 1;
 
-    const NodeT* left_child  = (!n->left_is_thread  ? n->left_  : nullptr);
-    const NodeT* right_child = (!n->right_is_thread ? n->right_ : nullptr);
+    const NodeT* left_child  = (!n->left_is_thread()  ? n->left()  : nullptr);
+    const NodeT* right_child = (!n->right_is_thread() ? n->right() : nullptr);
 
     if (min_key) EXPECT_TRUE(*min_key < n->key_) << "BST violation: key <= min";
     if (max_key) EXPECT_TRUE(n->key_ < *max_key) << "BST violation: key >= max";
 
-    if (n->color == Tree::Color::red)
+    if (n->color() == Tree::Color::red)
     {
-        if (left_child)  EXPECT_EQ(left_child->color,  Tree::Color::black);
-        if (right_child) EXPECT_EQ(right_child->color, Tree::Color::black);
+        if (left_child)  EXPECT_EQ(left_child->color(),  Tree::Color::black);
+        if (right_child) EXPECT_EQ(right_child->color(), Tree::Color::black);
     }
 
     const int lh = CheckRBRec(left_child,  min_key, n->key_);
@@ -45,10 +69,104 @@ static int CheckRBRec(const NodeT* n,
 
     EXPECT_EQ(lh, rh) << "black-height mismatch at key=" << n->key_;
 
-    return lh + (n->color == Tree::Color::black ? 1 : 0);
+    return lh + (n->color() == Tree::Color::black ? 1 : 0);
+}
+
+template <typename NodeT>
+static std::size_t CheckSizeRec(const NodeT* n)
+{
+    if (!n) return 0;
+
+    const NodeT* left_child  = (!n->left_is_thread()  ? n->left()  : nullptr);
+    const NodeT* right_child = (!n->right_is_thread() ? n->right() : nullptr);
+
+    const std::size_t expected = CheckSizeRec(left_child) + CheckSizeRec(right_child) + 1;
+    EXPECT_EQ(static_cast<std::size_t>(n->size_), expected) << "subtree size mismatch at key=" << n->key_;
+
+    return expected;
+}
+
+// red-black invariants of a Persistent_tree version, returns black height
+template <typename NodeT>
+static int CheckPersistentRec(const NodeT* n,
+                              std::optional<Key> min_key = std::nullopt,
+                              std::optional<Key> max_key = std::nullopt)
+{
+    if (!n) return 1;
+
+    if (min_key)
+    {
+        EXPECT_TRUE(*min_key < n->key_) << "BST violation: key <= min";
+    }
+    if (max_key)
+    {
+        EXPECT_TRUE(n->key_ < *max_key) << "BST violation: key >= max";
+    }
+
+    if (n->color() == Tree::Color::red)
+    {
+        if (n->left())
+        {
+            EXPECT_EQ(n->left()->color(), Tree::Color::black);
+        }
+        if (n->right())
+        {
+            EXPECT_EQ(n->right()->color(), Tree::Color::black);
+        }
+    }
+
+    const std::size_t expected_size = (n->left()  ? n->left()->size_  : 0)
+                                    + (n->right() ? n->right()->size_ : 0) + 1;
+    EXPECT_EQ(n->size_, expected_size) << "subtree size mismatch at key=" << n->key_;
+
+    const int lh = CheckPersistentRec(n->left(),  min_key, n->key_);
+    const int rh = CheckPersistentRec(n->right(), n->key_, max_key);
+
+    EXPECT_EQ(lh, rh) << "black-height mismatch at key=" << n->key_;
+
+    return lh + (n->color() == Tree::Color::black ? 1 : 0);
 }
 #endif
 
+// in-order walk must match ref both ways, threads must point to in-order neighbours
+template <typename TreeT>
+static void CheckThreads(const TreeT& t, const std::set<Key>& ref)
+{
+    using NodeT = std::remove_pointer_t<decltype(t.end().get_node())>;
+
+    std::vector<const NodeT*> nodes;
+    for (auto it = t.begin(); it != t.end(); ++it)
+        nodes.push_back(it.get_node());
+
+    ASSERT_EQ(nodes.size(), ref.size());
+
+    std::size_t i = 0;
+    for (Key x : ref)
+        EXPECT_EQ(nodes[i++]->key_, x);
+
+    const NodeT* header = t.end().get_node();
+    for (std::size_t j = 0; j < nodes.size(); ++j)
+    {
+        const NodeT* pred = (j == 0)                ? header : nodes[j - 1];
+        const NodeT* succ = (j + 1 == nodes.size()) ? header : nodes[j + 1];
+
+        if (nodes[j]->left_is_thread())
+        {
+            EXPECT_EQ(nodes[j]->left(), pred) << "left thread of " << nodes[j]->key_;
+        }
+        if (nodes[j]->right_is_thread())
+        {
+            EXPECT_EQ(nodes[j]->right(), succ) << "right thread of " << nodes[j]->key_;
+        }
+    }
+
+    std::vector<Key> backwards;
+    for (auto it = t.end(); it != t.begin();)
+        backwards.push_back(*--it);
+
+    EXPECT_TRUE(std::equal(backwards.begin(), backwards.end(), ref.rbegin(), ref.rend()));
+}
+
 
 struct ThrowingKey
 {
@@ -147,7 +265,7 @@ TEST(RBTreeUnit, RBInvariantsAfterInsert)
     const NodeT* root = t.debug_root();
     ASSERT_TRUE(root != nullptr);
 
-    EXPECT_EQ(root->color, Tree::Color::black) << "root must be black";
+    EXPECT_EQ(root->color(), Tree::Color::black) << "root must be black";
     (void)CheckRBRec(root);
 #else
     GTEST_SKIP() << "RB invariants check requires CUSTOM_MODE_DEBUG";
@@ -155,6 +273,1338 @@ TEST(RBTreeUnit, RBInvariantsAfterInsert)
 }
 
 
+TEST(RBTreeUnit, SubtreeSizesAndRangeMatchSet)
+{
+    Tree::Red_black_tree<Key> t;
+    std::set<Key> ref;
+
+    std::mt19937_64 gen(42);
+    std::uniform_int_distribution<Key> dist(-500, 500);
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        const Key x = dist(gen);
+        t.insert_elem(x);
+        ref.insert(x);
+    }
+
+    EXPECT_EQ(t.size(), ref.size());
+
+#ifdef CUSTOM_MODE_DEBUG
+    EXPECT_EQ(CheckSizeRec(t.debug_root()), ref.size());
+#endif
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        const Key a = dist(gen);
+        const Key b = dist(gen);
+
+        const auto expected = (b <= a) ? 0 : std::distance(ref.lower_bound(a), ref.upper_bound(b));
+        EXPECT_EQ(t.range_queries(a, b), static_cast<uint64_t>(expected)) << "q " << a << ' ' << b;
+    }
+}
+
+TEST(RBTreeUnit, SelectAndRank)
+{
+    Tree::Red_black_tree<Key> t;
+    for (Key x : {50, 10, 40, 20, 30})
+        t.insert_elem(x);
+
+    EXPECT_EQ(t.select(0), t.end());
+    EXPECT_EQ(*t.select(1), 10);
+    EXPECT_EQ(*t.select(3), 30);
+    EXPECT_EQ(*t.select(5), 50);
+    EXPECT_EQ(t.select(6), t.end());
+
+    EXPECT_EQ(t.rank(5),  0u);
+    EXPECT_EQ(t.rank(10), 0u);
+    EXPECT_EQ(t.rank(11), 1u);
+    EXPECT_EQ(t.rank(50), 4u);
+    EXPECT_EQ(t.rank(99), 5u);
+
+    for (std::size_t k = 1; k <= t.size(); ++k)
+        EXPECT_EQ(t.rank(*t.select(k)), k - 1);
+}
+
+TEST(RBTreeUnit, ArenaAllocatorCopyMoveSwap)
+{
+    using ArenaTree = Tree::Red_black_tree<Key, Tree::Arena_allocator<Key>>;
+
+    ArenaTree a;
+    for (Key x = 0; x < 1000; ++x)
+        a.insert_elem((x * 7919) % 1000);
+
+    ArenaTree b(a);
+    EXPECT_NE(a.get_allocator(), b.get_allocator()) << "copy must get its own arena";
+    EXPECT_EQ(b.size(), 1000u);
+    EXPECT_EQ(b.range_queries(100, 199), 100u);
+
+    ArenaTree c(std::move(a));
+    EXPECT_EQ(c.size(), 1000u);
+    EXPECT_TRUE(a.empty());
+
+    a.insert_elem(5000); // moved-from tree still has a usable allocator
+    EXPECT_EQ(a.size(), 1u);
+
+    c.swap(a);
+    EXPECT_EQ(a.size(), 1000u);
+    EXPECT_EQ(c.size(), 1u);
+
+    b = c;
+    EXPECT_EQ(b.size(), 1u);
+    EXPECT_EQ(*b.begin(), 5000);
+}
+
+TEST(RBTreeUnit, ArenaAllocatorNonTrivialKey)
+{
+    Tree::Red_black_tree<std::string, Tree::Arena_allocator<std::string>> t;
+    for (int i = 0; i < 300; ++i)
+        t.insert_elem("key_" + std::to_string(i) + std::string(40, 'x'));
+
+    EXPECT_EQ(t.size(), 300u);
+    EXPECT_EQ(t.rank("key_"), 0u);
+    EXPECT_EQ(t.rank("kez"),  300u);
+}
+
+TEST(RBTreeUnit, EraseKeepsInvariants)
+{
+    Tree::Red_black_tree<Key> t;
+    std::set<Key> ref;
+
+    std::mt19937_64 gen(7);
+    std::uniform_int_distribution<Key> dist(0, 300);
+
+    for (int i = 0; i < 6000; ++i)
+    {
+        const Key x = dist(gen);
+
+        if (gen() % 3 == 0)
+        {
+            t.insert_elem(x);
+            ref.insert(x);
+        }
+        else
+            EXPECT_EQ(t.erase(x), ref.erase(x)) << "erase " << x;
+
+        if (i % 50 == 0)
+        {
+            CheckThreads(t, ref);
+#ifdef CUSTOM_MODE_DEBUG
+            if (const NodeT* root = t.debug_root())
+            {
+                EXPECT_EQ(root->color(), Tree::Color::black);
+                (void)CheckRBRec(root);
+                EXPECT_EQ(CheckSizeRec(root), ref.size());
+            }
+#endif
+        }
+
+        if (i % 1000 == 999)
+        {
+            for (Key y = 0; y <= 300; ++y) // alternate inserts so erase has work to do
+            {
+                t.insert_elem(y);
+                ref.insert(y);
+            }
+        }
+    }
+
+    CheckThreads(t, ref);
+}
+
+TEST(RBTreeUnit, EraseByIteratorUntilEmpty)
+{
+    Tree::Red_black_tree<Key> t;
+    std::set<Key> ref;
+    for (Key x = 0; x < 64; ++x)
+    {
+        t.insert_elem(x * 3);
+        ref.insert(x * 3);
+    }
+
+    // erase every other key through the returned iterator
+    for (auto it = t.begin(); it != t.end();)
+    {
+        ref.erase(*it);
+        it = t.erase(it);
+        if (it != t.end())
+            ++it;
+    }
+    CheckThreads(t, ref);
+    EXPECT_EQ(t.size(), 32u);
+
+    while (!t.empty())
+    {
+        ref.erase(*t.begin());
+        t.erase(t.begin());
+        CheckThreads(t, ref);
+    }
+
+    EXPECT_EQ(t.begin(), t.end());
+    EXPECT_EQ(t.range_queries(0, 1000), 0u);
+
+    t.insert_elem(1);
+    EXPECT_EQ(t.size(), 1u);
+}
+
+TEST(RBTreeUnit, FromSortedBuildsValidTree)
+{
+    for (Key n = 0; n < 130; ++n)
+    {
+        std::vector<Key> keys;
+        std::set<Key> ref;
+        for (Key x = 0; x < n; ++x)
+        {
+            keys.push_back(x * 2);
+            ref.insert(x * 2);
+        }
+
+        auto t = Tree::Red_black_tree<Key>::from_sorted(keys.begin(), keys.end());
+        EXPECT_EQ(t.size(), ref.size());
+        CheckThreads(t, ref);
+
+#ifdef CUSTOM_MODE_DEBUG
+        if (const NodeT* root = t.debug_root())
+        {
+            EXPECT_EQ(root->color(), Tree::Color::black);
+            (void)CheckRBRec(root);
+            EXPECT_EQ(CheckSizeRec(root), ref.size());
+        }
+#endif
+
+        // the built tree must stay valid under further updates
+        t.insert_elem(-1);
+        t.erase(0);
+        ref.insert(-1);
+        ref.erase(0);
+        CheckThreads(t, ref);
+#ifdef CUSTOM_MODE_DEBUG
+        (void)CheckRBRec(t.debug_root());
+#endif
+    }
+}
+
+TEST(RBTreeUnit, AssignSortedCollapsesDuplicatesAndCopyUsesIt)
+{
+    const std::vector<Key> keys = {1, 1, 2, 3, 3, 3, 8};
+
+    Tree::Red_black_tree<Key> t;
+    t.insert_elem(100);
+    t.assign_sorted(keys.begin(), keys.end());
+
+    CheckThreads(t, {1, 2, 3, 8});
+
+    Tree::Red_black_tree<Key> copy(t);
+    CheckThreads(copy, {1, 2, 3, 8});
+    EXPECT_EQ(copy.range_queries(2, 8), 3u);
+}
+
+TEST(RBTreeUnit, InsertRangeMatchesSet)
+{
+    Tree::Red_black_tree<Key> t;
+    std::set<Key> ref;
+
+    std::mt19937_64 gen(11);
+    std::uniform_int_distribution<Key> dist(-5000, 5000);
+
+    // first batch goes through the merge path, later small ones through finger search
+    for (std::size_t batch_size : {500u, 500u, 64u, 7u, 64u, 1u, 300u})
+    {
+        std::vector<Key> batch;
+        for (std::size_t i = 0; i < batch_size; ++i)
+            batch.push_back(dist(gen));
+        batch.push_back(batch.front()); // duplicates inside the batch
+
+        t.insert_range(batch.begin(), batch.end());
+        ref.insert(batch.begin(), batch.end());
+
+        CheckThreads(t, ref);
+#ifdef CUSTOM_MODE_DEBUG
+        (void)CheckRBRec(t.debug_root());
+        EXPECT_EQ(CheckSizeRec(t.debug_root()), ref.size());
+#endif
+    }
+
+    std::vector<Key> descending;
+    for (Key x = 6000; x > 5900; --x)
+        descending.push_back(x);
+
+    t.insert_range(descending.begin(), descending.end());
+    ref.insert(descending.begin(), descending.end());
+    CheckThreads(t, ref);
+}
+
+TEST(RBTreeUnit, InsertHint)
+{
+    Tree::Red_black_tree<Key> t;
+    std::set<Key> ref;
+
+    // append through end()
+    for (Key x = 0; x < 200; x += 2)
+    {
+        auto it = t.insert_hint(t.end(), x);
+        EXPECT_EQ(*it, x);
+        ref.insert(x);
+    }
+    CheckThreads(t, ref);
+
+    // exact hints: key goes right before hint
+    for (Key x = 1; x < 200; x += 4)
+    {
+        auto it = t.insert_hint(t.lower_bound(x), x);
+        EXPECT_EQ(*it, x);
+        ref.insert(x);
+    }
+    CheckThreads(t, ref);
+
+    // wrong hints and duplicates
+    std::mt19937_64 gen(3);
+    std::uniform_int_distribution<Key> dist(-100, 300);
+    for (int i = 0; i < 500; ++i)
+    {
+        const Key x    = dist(gen);
+        const Key hint = dist(gen);
+
+        auto it = t.insert_hint(t.lower_bound(hint), x);
+        EXPECT_EQ(*it, x);
+        ref.insert(x);
+    }
+    CheckThreads(t, ref);
+
+#ifdef CUSTOM_MODE_DEBUG
+    (void)CheckRBRec(t.debug_root());
+    EXPECT_EQ(CheckSizeRec(t.debug_root()), ref.size());
+#endif
+}
+
+TEST(RBTreeUnit, CompactLayoutMatchesSet)
+{
+    using Compact_tree = Tree::Red_black_tree<Key, std::allocator<Key>, Tree::Compact_layout>;
+
+    Compact_tree  t;
+    std::set<Key> ref;
+
+    std::mt19937_64 gen(11);
+    std::uniform_int_distribution<Key> dist(0, 2000);
+
+    // the array grows (and moves) many times, erased slots are reused
+    for (int i = 0; i < 20000; ++i)
+    {
+        const Key x = dist(gen);
+
+        switch (gen() % 4)
+        {
+            case 0:  EXPECT_EQ(t.erase(x), ref.erase(x)); break;
+            case 1:  EXPECT_EQ(*t.insert_hint(t.lower_bound(x), x), x); ref.insert(x); break;
+            default: t.insert_elem(x); ref.insert(x); break;
+        }
+
+        if (i % 2000 == 0)
+            CheckThreads(t, ref);
+    }
+
+    std::vector<Key> batch;
+    for (int i = 0; i < 500; ++i)
+        batch.push_back(dist(gen) + 1000);
+
+    t.insert_range(batch.begin(), batch.end());
+    ref.insert(batch.begin(), batch.end());
+
+    CheckThreads(t, ref);
+    ASSERT_EQ(t.size(), ref.size());
+    EXPECT_EQ(t.range_queries(100, 1500),
+              static_cast<uint64_t>(std::distance(ref.lower_bound(100), ref.upper_bound(1500))));
+    EXPECT_EQ(*t.select(10), *std::next(ref.begin(), 9));
+    EXPECT_EQ(t.rank(1000), static_cast<std::size_t>(std::distance(ref.begin(), ref.lower_bound(1000))));
+
+#ifdef CUSTOM_MODE_DEBUG
+    (void)CheckRBRec(t.debug_root());
+    EXPECT_EQ(CheckSizeRec(t.debug_root()), ref.size());
+#endif
+
+    Compact_tree copy(t);
+    CheckThreads(copy, ref);
+
+    Compact_tree moved(std::move(copy));
+    CheckThreads(moved, ref);
+    EXPECT_TRUE(copy.empty());
+
+    copy.insert_elem(5);
+    copy.swap(moved);
+    CheckThreads(copy, ref);
+    CheckThreads(moved, {5});
+
+    moved = std::move(copy);
+    CheckThreads(moved, ref);
+
+    auto built = Compact_tree::from_sorted(ref.begin(), ref.end());
+    CheckThreads(built, ref);
+}
+
+TEST(RBTreeUnit, CompactLayoutNonTrivialKey)
+{
+    Tree::Red_black_tree<std::string, std::allocator<std::string>, Tree::Compact_layout> t;
+    std::set<std::string> ref;
+
+    for (int round = 0; round < 3; ++round)
+    {
+        for (int i = 0; i < 400; ++i)
+        {
+            const std::string key = "key_" + std::to_string((i * 37 + round) % 500);
+            t.insert_elem(key);
+            ref.insert(key);
+        }
+
+        for (int i = 0; i < 500; i += 3)
+        {
+            const std::string key = "key_" + std::to_string(i);
+            EXPECT_EQ(t.erase(key), ref.erase(key));
+        }
+
+        ASSERT_EQ(t.size(), ref.size());
+        EXPECT_TRUE(std::equal(t.begin(), t.end(), ref.begin(), ref.end()));
+    }
+
+    auto copy = t;
+    t.assign_sorted(ref.begin(), ref.begin()); // back to empty, array is kept
+    EXPECT_TRUE(t.empty());
+    EXPECT_TRUE(std::equal(copy.begin(), copy.end(), ref.begin(), ref.end()));
+}
+
+TEST(RBTreeUnit, FrozenSnapshotMatchesTree)
+{
+    std::mt19937_64 gen(5);
+
+    for (std::size_t n : {0u, 1u, 2u, 3u, 7u, 8u, 100u, 1000u})
+    {
+        Tree::Red_black_tree<Key> t;
+        while (t.size() < n)
+            t.insert_elem(static_cast<Key>(gen() % 5000));
+
+        const auto frozen = t.freeze();
+        ASSERT_EQ(frozen.size(), t.size());
+
+        for (Key x = -2; x <= 5002; x += 3)
+        {
+            EXPECT_EQ(frozen.rank(x), t.rank(x)) << "n=" << n << " x=" << x;
+            EXPECT_EQ(frozen.range_queries(x, x + 40), t.range_queries(x, x + 40));
+            EXPECT_EQ(frozen.range_queries(x, x),      t.range_queries(x, x));
+            EXPECT_EQ(frozen.range_queries(x, x - 1),  0u);
+        }
+
+        // snapshot does not follow the tree
+        t.insert_elem(-100);
+        EXPECT_EQ(frozen.size() + 1, t.size());
+    }
+}
+
+TEST(RBTreeUnit, BinaryReaderRejectsOverlongVarint)
+{
+    const std::string path = ::testing::TempDir() + "rbtree_overlong.rblog";
+
+    auto read_log = [&path](std::initializer_list<unsigned char> body, int64_t &key)
+    {
+        {
+            std::ofstream out(path, std::ios::binary);
+            out.write("RBTLOG\x00\x01", 8);
+            for (unsigned char c : body)
+                out.put(static_cast<char>(c));
+        }
+
+        Driver::Binary_reader reader(path);
+        EXPECT_TRUE(reader.is_open());
+
+        char    mode = 0;
+        int64_t b    = 0;
+        return reader.next(mode, key, b);
+    };
+
+    const unsigned char F = 0xFF;
+    int64_t key = 0;
+
+    // zigzag(INT64_MIN) = 2^64 - 1 is the longest valid operand: 9 x 0xFF, 0x01
+    EXPECT_TRUE(read_log({'k', F, F, F, F, F, F, F, F, F, 0x01}, key));
+    EXPECT_EQ(key, std::numeric_limits<int64_t>::min());
+
+    EXPECT_TRUE(read_log({'k', 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00}, key));
+    EXPECT_EQ(key, 0);
+
+    // bits past 63 in the 10th byte, an 11th byte, a cut-off varint
+    EXPECT_FALSE(read_log({'k', F, F, F, F, F, F, F, F, F, 0x03}, key));
+    EXPECT_FALSE(read_log({'k', 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40}, key));
+    EXPECT_FALSE(read_log({'k', F, F, F, F, F, F, F, F, F, 0x81, 0x00}, key));
+    EXPECT_FALSE(read_log({'k', F, F}, key));
+
+    std::remove(path.c_str());
+}
+
+TEST(RBTreeUnit, ConcurrentReadersSeeWholeWrites)
+{
+    // every write adds or removes the pair {2i, 2i + 1}, so a reader that
+    // saw half of a write would find an odd count
+    Tree::Concurrent_tree<Key, Tree::Arena_allocator<Key>> ct;
+
+    constexpr int kPairs   = 200;
+    constexpr int kReaders = 3;
+
+    std::atomic<bool> done{false};
+    std::atomic<int>  torn{0};
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < kReaders; ++r)
+        readers.emplace_back([&, r]
+        {
+            std::mt19937_64 gen(r);
+            do
+            {
+                const Key i = static_cast<Key>(gen() % kPairs);
+
+                if (ct.size() % 2 != 0 || ct.range_queries(2 * i, 2 * i + 1) % 2 != 0)
+                    ++torn;
+
+                // pairs come whole, so the first key >= 2i is even
+                const auto lb = ct.lower_bound(2 * i);
+                if (lb && *lb % 2 != 0)
+                    ++torn;
+            }
+            while (!done.load());
+        });
+
+    std::set<Key> ref;
+    std::mt19937_64 gen(11);
+
+    for (int step = 0; step < 4000; ++step)
+    {
+        const Key i = static_cast<Key>(gen() % kPairs);
+
+        if (ref.count(2 * i))
+        {
+            ct.write([i](auto &t) { t.erase(2 * i); t.erase(2 * i + 1); });
+            ref.erase(2 * i);
+            ref.erase(2 * i + 1);
+        }
+        else
+        {
+            ct.write([i](auto &t) { t.insert_elem(2 * i); t.insert_elem(2 * i + 1); });
+            ref.insert(2 * i);
+            ref.insert(2 * i + 1);
+        }
+    }
+
+    done = true;
+    for (auto &th : readers)
+        th.join();
+
+    EXPECT_EQ(torn.load(), 0);
+    EXPECT_EQ(ct.size(), ref.size());
+
+    ct.read([&](const auto &t)
+    {
+        CheckThreads(t, ref);
+        CheckRBRec(t.debug_root());
+    });
+
+    EXPECT_EQ(ct.erase(-1), 0u);
+    ct.insert(-1);
+    EXPECT_TRUE(ct.contains(-1));
+    EXPECT_EQ(ct.rank(0), 1u);
+    EXPECT_EQ(ct.erase(-1), 1u);
+}
+
+TEST(RBTreeUnit, PersistentVersionsMatchSnapshots)
+{
+    Tree::Persistent_tree<Key> pt;
+    std::vector<std::set<Key>> snapshots{{}};
+
+    std::mt19937_64 gen(17);
+    constexpr int kOps = 3000;
+
+    for (int op = 0; op < kOps; ++op)
+    {
+        std::set<Key> next = snapshots.back();
+        const Key key = static_cast<Key>(gen() % 600);
+
+        if (gen() % 10 < 7)
+        {
+            pt.insert_elem(key);
+            next.insert(key);
+        }
+        else
+            EXPECT_EQ(pt.erase(key), next.erase(key));
+
+        snapshots.push_back(std::move(next));
+    }
+
+    ASSERT_EQ(pt.versions(), snapshots.size());
+
+    for (std::size_t i = 0; i < snapshots.size(); ++i)
+    {
+        const auto v   = pt.version(i);
+        const auto &ref = snapshots[i];
+
+        ASSERT_EQ(v.size(), ref.size()) << "version " << i;
+
+        for (Key a = -1; a <= 601; a += 37)
+        {
+            const Key b = a + 50;
+            const auto expected = std::distance(ref.lower_bound(a), ref.upper_bound(b));
+            EXPECT_EQ(v.range_queries(a, b), static_cast<uint64_t>(expected)) << "version " << i;
+            EXPECT_EQ(v.rank(a), static_cast<std::size_t>(std::distance(ref.begin(), ref.lower_bound(a))));
+        }
+
+        if (i % 100 == 0 || i + 1 == snapshots.size())
+        {
+            const auto keys = v.keys();
+            EXPECT_TRUE(std::equal(keys.begin(), keys.end(), ref.begin(), ref.end()));
+            CheckPersistentRec(v.debug_root());
+        }
+    }
+
+    // O(log n) new nodes per update, far from a full copy per version
+    EXPECT_LT(pt.node_count(), static_cast<std::size_t>(kOps) * 64);
+
+    Tree::Persistent_tree<Key, Tree::Arena_allocator<Key>> moved_from;
+    moved_from.insert_elem(1);
+    auto moved = std::move(moved_from);
+    EXPECT_EQ(moved.size(), 1u);
+    EXPECT_TRUE(moved_from.empty());
+    EXPECT_EQ(moved.version(0).size(), 0u);
+}
+
+TEST(RBTreeUnit, ThreadPoolParallelFor)
+{
+    Driver::Thread_pool pool(4);
+    ASSERT_EQ(pool.size(), 4u);
+
+    const auto caller = std::this_thread::get_id();
+
+    struct Chunk
+    {
+        std::size_t     begin, end;
+        std::thread::id thread;
+    };
+
+    // one pool serves every call: several sizes and chunk minimums in a row
+    for (int round = 0; round < 3; ++round)
+    {
+        for (std::size_t n : {0u, 1u, 255u, 256u, 1000u, 100000u})
+        {
+            for (std::size_t min_chunk : {std::size_t{1}, Driver::Thread_pool::kMinChunk})
+            {
+                std::vector<std::atomic<int>> visits(n);
+                std::vector<Chunk> chunks;
+                std::mutex mtx;
+
+                pool.parallel_for(n, [&](std::size_t begin, std::size_t end)
+                {
+                    for (std::size_t i = begin; i < end; ++i)
+                        visits[i].fetch_add(1, std::memory_order_relaxed);
+
+                    std::lock_guard<std::mutex> lock(mtx);
+                    chunks.push_back({begin, end, std::this_thread::get_id()});
+                }, min_chunk);
+
+                for (std::size_t i = 0; i < n; ++i)
+                    ASSERT_EQ(visits[i].load(), 1) << "n=" << n << " i=" << i;
+
+                if (n == 0)
+                {
+                    EXPECT_TRUE(chunks.empty());
+                    continue;
+                }
+
+                // contiguous pieces tiling [0, n), the first one on the caller
+                std::sort(chunks.begin(), chunks.end(),
+                          [](const Chunk &l, const Chunk &r) { return l.begin < r.begin; });
+
+                const std::size_t parts = std::min<std::size_t>(pool.size(), n / min_chunk);
+                EXPECT_EQ(chunks.size(), std::max<std::size_t>(parts, 1)) << "n=" << n;
+
+                std::size_t next = 0;
+                for (const Chunk &c : chunks)
+                {
+                    EXPECT_EQ(c.begin, next);
+                    EXPECT_LT(c.begin, c.end);
+                    if (chunks.size() > 1)
+                    {
+                        EXPECT_GE(c.end - c.begin, min_chunk);
+                    }
+                    EXPECT_EQ(c.thread == caller, c.begin == 0) << "n=" << n << " begin=" << c.begin;
+                    next = c.end;
+                }
+                EXPECT_EQ(next, n);
+            }
+        }
+    }
+
+    // below the inline threshold the whole range runs on the caller
+    std::vector<std::thread::id> threads;
+    pool.parallel_for(Driver::Thread_pool::kMinChunk - 1, [&](std::size_t begin, std::size_t end)
+    {
+        EXPECT_EQ(begin, 0u);
+        EXPECT_EQ(end, Driver::Thread_pool::kMinChunk - 1);
+        threads.push_back(std::this_thread::get_id());
+    });
+    ASSERT_EQ(threads.size(), 1u);
+    EXPECT_EQ(threads[0], caller);
+
+    // an exception from a worker's piece, or from the caller's, reaches the caller
+    for (std::size_t thrower : {1u, 0u})
+    {
+        std::atomic<int> done{0};
+
+        EXPECT_THROW(pool.parallel_for(4000, [&](std::size_t begin, std::size_t)
+        {
+            if (begin == 4000 * thrower / 4)
+                throw std::runtime_error("chunk failed");
+            ++done;
+        }), std::runtime_error);
+
+        // the other pieces still finished before parallel_for returned
+        EXPECT_EQ(done.load(), 3);
+    }
+
+    // and the pool keeps working after it
+    std::atomic<std::size_t> sum{0};
+    pool.parallel_for(4000, [&](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t i = begin; i < end; ++i)
+            sum += i;
+    });
+    EXPECT_EQ(sum.load(), 4000u * 3999u / 2);
+}
+
+TEST(RBTreeUnit, RangeQueriesBatchMatchesSingle)
+{
+    std::mt19937_64 gen(23);
+
+    Tree::Red_black_tree<Key>                                        t;
+    Tree::Red_black_tree<Key, std::allocator<Key>, Tree::Compact_layout> ct;
+
+    // small trees answer one by one; on a big tree small runs take the
+    // descent path and big runs the sweep
+    for (std::size_t n : {0u, 1u, 50u, 20000u})
+    {
+        while (t.size() < n)
+        {
+            const Key x = static_cast<Key>(gen() % 40000);
+            t.insert_elem(x);
+            ct.insert_elem(x);
+        }
+
+        const auto frozen = t.freeze();
+
+        for (std::size_t q : {0u, 1u, 7u, 500u, 5000u})
+        {
+            std::vector<std::pair<Key, Key>> queries;
+            for (std::size_t i = 0; i < q; ++i)
+            {
+                const Key a = static_cast<Key>(gen() % 40100) - 50;
+                queries.emplace_back(a, a + static_cast<Key>(gen() % 400) - 20);
+            }
+            if (q > 1)
+                queries[1] = queries[0]; // duplicate endpoints
+
+            std::vector<uint64_t> ans(q), cans(q), fans(q);
+            t .range_queries_batch(queries.begin(), queries.end(), ans.begin());
+            ct.range_queries_batch(queries.begin(), queries.end(), cans.begin());
+            frozen.range_queries_batch(queries.begin(), queries.end(), fans.begin());
+
+            for (std::size_t i = 0; i < q; ++i)
+            {
+                const auto expected = t.range_queries(queries[i].first, queries[i].second);
+                EXPECT_EQ(ans [i], expected) << "n=" << n << " q=" << q << " i=" << i;
+                EXPECT_EQ(cans[i], expected);
+                EXPECT_EQ(fans[i], expected);
+            }
+        }
+    }
+}
+
+TEST(RBTreeUnit, ShardedTreeMatchesSet)
+{
+    std::mt19937_64 gen(29);
+
+    Tree::Sharded_tree<Key> t(8);
+    std::set<Key>           s;
+
+    // ascending keys pile up in the last shard and force rebalances
+    std::vector<Key> keys;
+    for (Key x = 0; x < 20000; x += 2)
+        keys.push_back(x);
+
+    for (std::size_t i = 0; i < keys.size(); i += 1000)
+    {
+        t.insert_range(keys.begin() + i, keys.begin() + i + 1000);
+        s.insert(keys.begin() + i, keys.begin() + i + 1000);
+    }
+
+    EXPECT_GT(t.rebalances(), 0u);
+
+    for (int i = 0; i < 5000; ++i)
+    {
+        const Key x = static_cast<Key>(gen() % 30000) - 100;
+
+        if (gen() % 3)
+        {
+            t.insert_elem(x);
+            s.insert(x);
+        }
+        else
+            EXPECT_EQ(t.erase(x), s.erase(x));
+    }
+
+    ASSERT_EQ(t.size(), s.size());
+
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < t.shards(); ++i)
+    {
+        EXPECT_GT(t.shard(i).size(), 0u);
+        total += t.shard(i).size();
+    }
+    EXPECT_EQ(total, s.size());
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        const Key a = static_cast<Key>(gen() % 30200) - 200;
+        const Key b = a + static_cast<Key>(gen() % 8000) - 100;
+
+        const auto expected = (b <= a) ? 0 : std::distance(s.lower_bound(a), s.upper_bound(b));
+        EXPECT_EQ(t.range_queries(a, b), static_cast<uint64_t>(expected)) << a << " " << b;
+        EXPECT_EQ(t.rank(a), static_cast<std::size_t>(std::distance(s.begin(), s.lower_bound(a))));
+        EXPECT_EQ(t.contains(a), s.count(a) == 1);
+    }
+}
+
+TEST(RBTreeUnit, ShardedTreeParallelInsertMatchesSet)
+{
+    std::mt19937_64 gen(37);
+
+    Driver::Thread_pool     pool(4);
+    Tree::Sharded_tree<Key> t(8);
+    std::set<Key>           s;
+
+    auto check = [&](int round)
+    {
+        ASSERT_EQ(t.size(), s.size()) << "round " << round;
+
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < t.shards(); ++i)
+            total += t.shard(i).size();
+        EXPECT_EQ(total, s.size());
+
+        for (int i = 0; i < 300; ++i)
+        {
+            const Key a = static_cast<Key>(gen() % 220000) - 10000;
+            const Key b = a + static_cast<Key>(gen() % 50000) - 1000;
+
+            const auto expected = (b <= a) ? 0 : std::distance(s.lower_bound(a), s.upper_bound(b));
+            ASSERT_EQ(t.range_queries(a, b), static_cast<uint64_t>(expected)) << a << " " << b;
+        }
+    };
+
+    // random batches (with repeats of each other and of the tree) and
+    // ascending runs that pile up in the last shard, all split over the pool
+    Key next_sorted = 100000;
+
+    for (int round = 0; round < 12; ++round)
+    {
+        std::vector<Key> batch;
+
+        if (round % 3 == 2)
+        {
+            for (int i = 0; i < 6000; ++i)
+                batch.push_back(next_sorted += static_cast<Key>(gen() % 3) + 1);
+        }
+        else
+        {
+            const std::size_t n = (round == 0) ? 3 : 5000 + gen() % 5000;
+            for (std::size_t i = 0; i < n; ++i)
+                batch.push_back(static_cast<Key>(gen() % 100000));
+        }
+
+        t.insert_range(batch.begin(), batch.end(), pool);
+        s.insert(batch.begin(), batch.end());
+
+        check(round);
+    }
+
+    EXPECT_GT(t.rebalances(), 0u);
+
+    t.rebalance(pool);
+    check(-1);
+}
+
+TEST(RBTreeUnit, SkipListMatchesSet)
+{
+    std::mt19937_64 gen(31);
+
+    Tree::Skip_list<Key> t;
+    std::set<Key>        s;
+
+    const std::vector<Key> sorted = {1, 3, 3, 5, 8, 13};
+    t.assign_sorted(sorted.begin(), sorted.end());
+    s.insert(sorted.begin(), sorted.end());
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        const Key x = static_cast<Key>(gen() % 4000) - 100;
+
+        if (gen() % 3)
+        {
+            EXPECT_EQ(t.insert_elem(x), s.insert(x).second);
+        }
+        else
+            EXPECT_EQ(t.erase(x), s.erase(x));
+
+        if (i % 5000 == 0)
+            t.reclaim();
+    }
+
+    ASSERT_EQ(t.size(), s.size());
+    EXPECT_TRUE(t.counts_exact());
+    EXPECT_TRUE(std::equal(t.begin(), t.end(), s.begin(), s.end()));
+    EXPECT_EQ(*std::prev(t.end()), *s.rbegin());
+
+    const auto frozen = t.freeze();
+    EXPECT_EQ(frozen.size(), s.size());
+
+    for (int i = 0; i < 3000; ++i)
+    {
+        const Key a = static_cast<Key>(gen() % 4200) - 200;
+        const Key b = a + static_cast<Key>(gen() % 500) - 20;
+
+        const auto expected = (b <= a) ? 0 : std::distance(s.lower_bound(a), s.upper_bound(b));
+        EXPECT_EQ(t.range_queries(a, b), static_cast<uint64_t>(expected)) << a << " " << b;
+        EXPECT_EQ(t.rank(a), static_cast<std::size_t>(std::distance(s.begin(), s.lower_bound(a))));
+        EXPECT_EQ(t.contains(a), s.count(a) == 1);
+
+        const auto lb = t.lower_bound(a);
+        const auto ub = t.upper_bound(a);
+        EXPECT_EQ(lb == t.end(), s.lower_bound(a) == s.end());
+        EXPECT_EQ(ub == t.end(), s.upper_bound(a) == s.end());
+        if (lb != t.end())
+        {
+            EXPECT_EQ(*lb, *s.lower_bound(a));
+        }
+        if (ub != t.end())
+        {
+            EXPECT_EQ(*ub, *s.upper_bound(a));
+        }
+
+        const std::size_t k = gen() % (s.size() + 2);
+        const auto it = t.select(k);
+        if (k == 0 || k > s.size())
+            EXPECT_EQ(it, t.end());
+        else
+            EXPECT_EQ(*it, *std::next(s.begin(), static_cast<std::ptrdiff_t>(k - 1)));
+    }
+}
+
+TEST(RBTreeUnit, SkipListConcurrentWriters)
+{
+    constexpr int kThreads = 4;
+    constexpr Key kKeys    = 20000;
+
+    Tree::Skip_list<Key> t;
+
+    auto run_threads = [](auto body)
+    {
+        std::vector<std::thread> threads;
+        for (int th = 0; th < kThreads; ++th)
+            threads.emplace_back(body, th);
+
+        for (auto &thread : threads)
+            thread.join();
+    };
+
+    // every thread inserts all keys in its own order
+    run_threads([&t](int th)
+    {
+        std::mt19937_64 gen(th);
+
+        std::vector<Key> keys(kKeys);
+        for (Key x = 0; x < kKeys; ++x)
+            keys[x] = x;
+        std::shuffle(keys.begin(), keys.end(), gen);
+
+        for (Key x : keys)
+        {
+            t.insert_elem(x);
+            EXPECT_TRUE(t.contains(x));
+        }
+    });
+
+    // then erases the multiples of 3 of its share while adding new keys
+    run_threads([&t](int th)
+    {
+        for (Key x = th; x < kKeys; x += kThreads)
+        {
+            if (x % 3 == 0)
+            {
+                EXPECT_EQ(t.erase(x), 1u);
+            }
+            t.insert_elem(kKeys + x);
+        }
+    });
+
+    t.recount();
+    ASSERT_TRUE(t.counts_exact());
+
+    std::set<Key> s;
+    for (Key x = 0; x < kKeys; ++x)
+    {
+        if (x % 3 != 0)
+            s.insert(x);
+        s.insert(kKeys + x);
+    }
+
+    ASSERT_EQ(t.size(), s.size());
+    EXPECT_TRUE(std::equal(t.begin(), t.end(), s.begin(), s.end()));
+
+    for (Key a = -5; a < 2 * kKeys + 5; a += 97)
+    {
+        EXPECT_EQ(t.rank(a), static_cast<std::size_t>(std::distance(s.begin(), s.lower_bound(a))));
+        EXPECT_EQ(t.range_queries(a, a + 500),
+                  static_cast<uint64_t>(std::distance(s.lower_bound(a), s.upper_bound(a + 500))));
+    }
+
+    t.reclaim();
+    EXPECT_EQ(t.size(), s.size());
+}
+
+TEST(RBTreeUnit, LatencyHistogramPercentiles)
+{
+    Driver::Latency_histogram hist;
+    EXPECT_EQ(hist.percentile(0.5), 0u);
+
+    // 1..1000 once, plus one spike
+    for (uint64_t v = 1; v <= 1000; ++v)
+        hist.record(v);
+    hist.record(5'000'000);
+
+    EXPECT_EQ(hist.count(), 1001u);
+    EXPECT_EQ(hist.max(), 5'000'000u);
+    EXPECT_EQ(hist.percentile(1.0), 5'000'000u);
+
+    // buckets are within 1/32 of the value above the exact range
+    auto near = [](uint64_t got, uint64_t want) { return got >= want && got <= want + want / 32 + 1; };
+    EXPECT_TRUE(near(hist.percentile(0.5),  501)) << hist.percentile(0.5);
+    EXPECT_TRUE(near(hist.percentile(0.99), 991)) << hist.percentile(0.99);
+    EXPECT_EQ(hist.percentile(0.01), 11u);
+
+    hist.record(UINT64_MAX);
+    EXPECT_EQ(hist.percentile(1.0), UINT64_MAX);
+}
+
+struct Counted_key
+{
+    static inline int copies = 0;
+    static inline int moves  = 0;
+
+    std::string value;
+
+    Counted_key() = default;
+    Counted_key(std::string v) : value(std::move(v)) {}
+    Counted_key(const char *prefix, int n) : value(prefix + std::to_string(n)) {}
+
+    Counted_key(const Counted_key &other) : value(other.value) { ++copies; }
+    Counted_key(Counted_key &&other) noexcept : value(std::move(other.value)) { ++moves; }
+
+    Counted_key &operator=(const Counted_key &) = default;
+    Counted_key &operator=(Counted_key &&)      = default;
+
+    bool operator<(const Counted_key &other) const { return value < other.value; }
+};
+
+TEST(RBTreeUnit, InsertAndEmplaceReturnPositionWithoutCopies)
+{
+    Tree::Red_black_tree<Counted_key> t;
+    Counted_key::copies = Counted_key::moves = 0;
+
+    auto [first, inserted] = t.emplace("k", 5);
+    EXPECT_TRUE(inserted);
+    EXPECT_EQ(first->value, "k5");
+
+    for (int i : {1, 9, 3, 7})
+        EXPECT_TRUE(t.emplace("k", i).second);
+
+    EXPECT_EQ(Counted_key::copies, 0);
+    EXPECT_EQ(Counted_key::moves,  0);  // built right in the node
+
+    // a duplicate points at the key that is already there
+    auto [dup, again] = t.emplace("k", 3);
+    EXPECT_FALSE(again);
+    EXPECT_EQ(dup->value, "k3");
+    EXPECT_EQ(t.size(), 5u);
+
+    auto [moved, moved_in] = t.insert(Counted_key("k4"));
+    EXPECT_TRUE(moved_in);
+    EXPECT_EQ(Counted_key::copies, 0);
+    EXPECT_EQ(Counted_key::moves,  1);  // once, into the node
+
+    // neighbours of the new key without another lookup
+    EXPECT_EQ(std::prev(moved)->value, "k3");
+    EXPECT_EQ(std::next(moved)->value, "k5");
+
+    const Counted_key existing("k9");
+    auto [pos, fresh] = t.insert(existing);
+    EXPECT_FALSE(fresh);
+    EXPECT_EQ(pos, std::prev(t.end()));
+    EXPECT_EQ(Counted_key::copies, 0);  // nothing to insert => nothing copied
+
+    Tree::Red_black_tree<int64_t, std::allocator<int64_t>, Tree::Compact_layout> ct;
+    for (int64_t i = 0; i < 100; ++i)
+        EXPECT_TRUE(ct.emplace(i * 2).second);
+    EXPECT_FALSE(ct.emplace(*std::prev(ct.end())).second);
+    EXPECT_EQ(*ct.insert(int64_t{51}).first, 51);
+    EXPECT_EQ(ct.size(), 101u);
+}
+
+TEST(RBTreeUnit, CustomCompareOrdersEverything)
+{
+    Tree::Red_black_tree<int, std::allocator<int>, Tree::Pointer_layout, std::greater<int>> t;
+    for (int k : {5, 1, 9, 3, 7, 3})
+        t.insert_elem(k);
+
+    std::vector<int> range{10, 8, 6, 4, 2};
+    t.insert_range(range.begin(), range.end());
+
+    std::vector<int> got(t.begin(), t.end());
+    EXPECT_EQ(got, (std::vector<int>{10, 9, 8, 7, 6, 5, 4, 3, 2, 1}));
+
+    EXPECT_EQ(*t.select(1), 10);
+    EXPECT_EQ(t.rank(7), 3u);                // 10 9 8 come first
+    EXPECT_EQ(t.range_queries(8, 3), 6u);    // [8, 3] in this order
+    EXPECT_EQ(t.range_queries(3, 8), 0u);
+    EXPECT_EQ(*t.lower_bound(0 + 11), 10);
+    EXPECT_EQ(t.erase(9), 1u);
+    EXPECT_FALSE(t.contains(9));
+
+    const auto frozen = t.freeze();
+    EXPECT_EQ(frozen.range_queries(8, 3), 6u);
+    EXPECT_EQ(frozen.rank(7), 2u);
+
+    auto copy = t;
+    EXPECT_TRUE(std::equal(copy.begin(), copy.end(), t.begin(), t.end()));
+}
+
+TEST(RBTreeUnit, TransparentLookupWithStringView)
+{
+    using String_tree = Tree::Red_black_tree<std::string, std::allocator<std::string>, Tree::Pointer_layout, std::less<>>;
+
+    String_tree t;
+    for (const char *word : {"pear", "apple", "fig", "kiwi", "banana"})
+        t.insert_elem(word);
+
+    const std::string_view probe = "fig";
+    EXPECT_TRUE(t.contains(probe));
+    EXPECT_FALSE(t.contains(std::string_view("grape")));
+    EXPECT_EQ(*t.lower_bound(probe), "fig");
+    EXPECT_EQ(*t.upper_bound(probe), "kiwi");
+    EXPECT_EQ(t.rank(probe), 2u);
+    EXPECT_EQ(t.range_queries(std::string_view("b"), std::string_view("l")), 3u); // banana fig kiwi
+
+    const auto frozen = t.freeze();
+    EXPECT_EQ(frozen.rank(probe), 2u);
+    EXPECT_EQ(frozen.range_queries(std::string_view("b"), std::string_view("l")), 3u);
+
+    // a key of the tree itself is a valid argument even when inserting may move nodes
+    Tree::Red_black_tree<std::string, std::allocator<std::string>, Tree::Compact_layout, std::less<>> ct;
+    for (std::size_t len = 1; len <= 100; ++len)
+    {
+        ct.insert_elem(std::string(len, 'a'));
+        ct.insert_elem(*std::prev(ct.end())); // already there
+    }
+    EXPECT_EQ(ct.size(), 100u);
+    EXPECT_TRUE(ct.contains(std::string_view("aaa")));
+}
+
+template <typename MapT, typename Fold>
+static void CheckRangeAggregates(const MapT &map, const std::map<int64_t, int64_t> &ref, Fold fold)
+{
+    std::mt19937_64 rng(7);
+    std::uniform_int_distribution<int64_t> key(-10, 1010);
+
+    for (int q = 0; q < 300; ++q)
+    {
+        const int64_t a = key(rng), b = key(rng);
+        const auto want = b <= a ? fold(ref.end(), ref.end())
+                                 : fold(ref.lower_bound(a), ref.upper_bound(b));
+
+        ASSERT_EQ(map.range_aggregate(a, b), want) << "[" << a << ", " << b << "]";
+    }
+
+    EXPECT_EQ(map.aggregate(), fold(ref.begin(), ref.end()));
+}
+
+template <typename Layout>
+static void RunMapAggregates()
+{
+    using It = std::map<int64_t, int64_t>::const_iterator;
+
+    Tree::Rb_map<int64_t, int64_t, Tree::Sum_monoid<int64_t>, std::less<int64_t>,
+                 std::allocator<Tree::Map_entry<int64_t, int64_t>>, Layout> sums;
+    Tree::Rb_map<int64_t, int64_t, Tree::Min_monoid<int64_t>> mins;
+    Tree::Rb_map<int64_t, int64_t, Tree::Max_monoid<int64_t>> maxs;
+    std::map<int64_t, int64_t> ref;
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<int64_t> key(0, 1000), weight(-1000, 1000), op(0, 9);
+
+    for (int step = 0; step < 6000; ++step)
+    {
+        const int64_t k = key(rng), w = weight(rng);
+
+        switch (op(rng))
+        {
+            case 0: case 1:
+                sums.erase(k); mins.erase(k); maxs.erase(k); ref.erase(k);
+                break;
+            case 2:
+                sums.insert(k, w); mins.insert(k, w); maxs.insert(k, w); ref.insert({k, w});
+                break;
+            default:
+                sums.insert_or_assign(k, w); mins.insert_or_assign(k, w); maxs.insert_or_assign(k, w); ref[k] = w;
+                break;
+        }
+
+        if (step % 1000 == 999)
+        {
+            ASSERT_EQ(sums.size(), ref.size());
+
+            CheckRangeAggregates(sums, ref, [](It first, It last)
+            {
+                int64_t sum = 0;
+                for (; first != last; ++first)
+                    sum += first->second;
+                return sum;
+            });
+            CheckRangeAggregates(mins, ref, [](It first, It last)
+            {
+                int64_t min = std::numeric_limits<int64_t>::max();
+                for (; first != last; ++first)
+                    min = std::min(min, first->second);
+                return min;
+            });
+            CheckRangeAggregates(maxs, ref, [](It first, It last)
+            {
+                int64_t max = std::numeric_limits<int64_t>::lowest();
+                for (; first != last; ++first)
+                    max = std::max(max, first->second);
+                return max;
+            });
+        }
+    }
+
+    ASSERT_FALSE(ref.empty());
+    const int64_t some = ref.begin()->first;
+    EXPECT_EQ(sums.at(some), ref.at(some));
+    EXPECT_THROW(sums.at(-1), std::out_of_range);
+
+    sums.update(sums.find(some), [](int64_t &w) { w += 1'000'000; });
+    EXPECT_EQ(sums.range_aggregate(some, some + 1), ref.at(some) + 1'000'000 + (ref.count(some + 1) ? ref.at(some + 1) : 0));
+}
+
+TEST(RBTreeUnit, MapRangeAggregatesMatchStdMap)
+{
+    RunMapAggregates<Tree::Pointer_layout>();
+    RunMapAggregates<Tree::Compact_layout>();
+}
+
+TEST(RBTreeUnit, KeyAggregateSurvivesRebuildAndCopy)
+{
+    using Sum_tree = Tree::Red_black_tree<int64_t, std::allocator<int64_t>, Tree::Pointer_layout,
+                                          std::less<int64_t>, Tree::Key_aggregate<Tree::Sum_monoid<int64_t>>>;
+
+    std::vector<int64_t> keys(1000);
+    std::iota(keys.begin(), keys.end(), 1);
+
+    auto tree = Sum_tree::from_sorted(keys.begin(), keys.end());
+    EXPECT_EQ(tree.aggregate(), 500500);
+    EXPECT_EQ(tree.range_aggregate(10, 20), 165);
+
+    std::vector<int64_t> more{2000, 3000, 1500};
+    tree.insert_range(more.begin(), more.end());
+    tree.erase(1000);
+
+    const Sum_tree copy = tree;
+    EXPECT_EQ(copy.aggregate(), 500500 - 1000 + 6500);
+    EXPECT_EQ(copy.range_aggregate(999, 2000), 999 + 1500 + 2000);
+    EXPECT_EQ(copy.range_aggregate(20, 10), 0);
+}
+
+TEST(RBTreeUnit, DepthHistogramAndStats)
+{
+    Tree::Red_black_tree<int> tree;
+    EXPECT_EQ(tree.height(), 0u);
+    EXPECT_TRUE(tree.depth_histogram().empty());
+
+    // ascending keys: the worst case for an unbalanced BST
+    const int n = 1 << 12;
+    for (int i = 0; i < n; ++i)
+        tree.insert_elem(i);
+
+    const std::vector<std::size_t> levels = tree.depth_histogram();
+    ASSERT_FALSE(levels.empty());
+    EXPECT_EQ(levels[0], 1u);
+    EXPECT_EQ(std::accumulate(levels.begin(), levels.end(), std::size_t{0}), tree.size());
+    EXPECT_EQ(tree.height(), levels.size());
+    EXPECT_LE(tree.height(), 2 * 13u); // 2 * log2(n + 1)
+
+    for (std::size_t d = 0; d + 1 < levels.size(); ++d)
+        EXPECT_LE(levels[d], std::size_t{1} << d);
+
+#ifdef RBTREE_STATS
+    const Tree::Rb_stats grown = tree.stats();
+    EXPECT_GT(grown.left_rotations, 0u);
+    EXPECT_EQ(grown.right_rotations, 0u);
+    EXPECT_GE(grown.insert_fix_loops, grown.recolors);
+
+    for (int i = 0; i < n; i += 2)
+        tree.erase(i);
+    EXPECT_GT(tree.stats().erase_fix_loops, 0u);
+
+    tree.reset_stats();
+    std::vector<int> keys(100);
+    std::iota(keys.begin(), keys.end(), 0);
+    tree.assign_sorted(keys.begin(), keys.end()); // built balanced, nothing to fix
+
+    EXPECT_EQ(tree.stats().rotations(), 0u);
+    EXPECT_EQ(tree.stats().insert_fix_loops, 0u);
+#endif
+}
+
+TEST(RBTreeUnit, PerfCountersWorkOrExplainWhyNot)
+{
+    Driver::Perf_counters perf;
+
+    Tree::Red_black_tree<int> tree;
+    perf.start();
+    for (int i = 0; i < 1000; ++i)
+        tree.insert_elem(i);
+    perf.stop();
+
+    uint64_t values[Driver::Perf_counters::kEvents];
+    perf.read(values);
+
+    // VMs and containers often have no PMU: that must be reported, not crash
+    if (!perf.available())
+    {
+        EXPECT_FALSE(perf.error().empty());
+        EXPECT_EQ(perf.runs(), 0u);
+        for (uint64_t v : values)
+            EXPECT_EQ(v, 0u);
+        return;
+    }
+
+    EXPECT_EQ(perf.runs(), 1u);
+    if (perf.available(Driver::Perf_counters::kInstructions))
+    {
+        EXPECT_GT(values[Driver::Perf_counters::kInstructions], 1000u);
+    }
+}
+
 TEST(RBTreeUnit, ExceptionSafety_InsertStrongGuarantee_OnKeyCopyThrow)
 {
     Tree::Red_black_tree<ThrowingKey> t;